@@ -9,6 +9,7 @@ int arch_intel_ssse3 = 0;
 int arch_intel_sse3 = 0;
 int arch_intel_sse2 = 0;
 int arch_intel_aesni = 0;
+int arch_intel_invariant_tsc = 0;
 
 #ifdef __x86_64__
 #include <cpuid.h>
@@ -20,6 +21,8 @@ int arch_intel_aesni = 0;
 #define CPUID_SSE3    (1)
 #define CPUID_SSE2    (1 << 26)
 #define CPUID_AESNI   (1 << 25)
+/* leaf 0x80000007, edx: runs at a constant rate in all P-, C- and T-states */
+#define CPUID_INVARIANT_TSC (1 << 8)
 
 int arch_intel_probe(void)
 {
@@ -49,6 +52,10 @@ int arch_intel_probe(void)
   if ((ecx & CPUID_AESNI) != 0) {
     arch_intel_aesni = 1;
   }
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+      (edx & CPUID_INVARIANT_TSC) != 0) {
+    arch_intel_invariant_tsc = 1;
+  }
 
   return 0;
 }
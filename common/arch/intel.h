@@ -8,6 +8,7 @@ extern int arch_intel_ssse3;  /* true if we have ssse 3 features */
 extern int arch_intel_sse3;   /* true if we have sse 3 features */
 extern int arch_intel_sse2;   /* true if we have sse 2 features */
 extern int arch_intel_aesni;  /* true if we have aesni features */
+extern int arch_intel_invariant_tsc;  /* true if the tsc ticks at a constant rate */
 
 extern int arch_intel_probe(void);
 
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <atomic>
 #include <cstring>
+#include <stdexcept>
+#include <unordered_map>
 
 #include <stdio.h>
 #include <errno.h>
@@ -22,6 +24,9 @@
 #include "compat.h"
 #include "safe_io.h"
 #include "buffer_raw.h"
+#include "work_pool.h"
+#include "perf_counters.h"
+#include "time.h"
 
 using std::cerr;
 using std::make_pair;
@@ -33,6 +38,15 @@ using std::string;
 // 256K is the maximum "small" object size in tcmalloc above which allocations come from
 // the central heap.  For now let's keep this below that threshold.
 #define BUFFER_ALLOC_UNIT_MAX std::size_t { 256*1024 }
+// smallest buffer a pool's NUMA policy applies to; each one is an mmap
+#define BUFFER_NUMA_MIN (64*1024u)
+// lists shorter than this are simply walked
+#define BUFFER_SEGMENT_INDEX_MIN 64u
+// segments an iterator steps over before it consults the index
+#define BUFFER_SEGMENT_WALK_MAX 8u
+// smallest list, and piece of one, worth checksumming in parallel
+#define BUFFER_PARALLEL_CRC_MIN (1024*1024u)
+#define BUFFER_PARALLEL_CRC_GRAIN (256*1024u)
 
 #ifdef BUFFER_DEBUG
 static ceph::spinlock debug_lock;
@@ -48,6 +62,19 @@ static std::atomic<unsigned> buffer_cached_crc_adjusted { 0 };
 static std::atomic<unsigned> buffer_missed_crc { 0 };
 static bool buffer_track_crc = get_env_bool("BUFFER_TRACK");
 
+static perf::counter_t perf_crc_hit("buffer_crc_cache_hit",
+  "segment crcs served from the raw's cache");
+static perf::counter_t perf_crc_adjusted("buffer_crc_cache_adjusted",
+  "cached segment crcs converted to another seed");
+static perf::counter_t perf_crc_miss("buffer_crc_cache_miss",
+  "segment crcs computed");
+static perf::counter_t perf_write_fd_bytes("buffer_write_fd_bytes",
+  "bytes written by list::write_fd");
+static perf::histogram_t perf_write_fd_lat("buffer_write_fd_latency_ns",
+  "list::write_fd call latency");
+static perf::counter_t perf_refill("buffer_refill_append_space",
+  "append buffers allocated by list::refill_append_space");
+
 void buffer::track_cached_crc(bool b) {
   buffer_track_crc = b;
 }
@@ -250,6 +277,46 @@ public:
   }
 };
 
+class buffer::raw_numa : public buffer::raw {
+  numa::policy_t policy;
+  int node;          // as requested
+  // node charged, -1 for interleave.  Only POLICY_NODE is bound to it;
+  // local and first-touch pages land where they are faulted in, which
+  // is taken to be the allocating cpu's node
+  int placed;
+  int placed_pool;   // survives reassign_to_mempool
+public:
+  MEMPOOL_CLASS_HELPERS();
+
+  raw_numa(unsigned l, numa::policy_t p, int n, int mempool)
+    : raw(l, mempool), policy(p), node(n), placed_pool(mempool) {
+    if (p == numa::POLICY_NODE && (n < 0 || n >= numa::num_nodes())) {
+      throw std::invalid_argument("raw_numa: no such node");
+    }
+    data = (char *)numa::alloc_pages(std::max(len, 1u), policy, node);
+    if (!data)
+      throw bad_alloc();
+    if (policy == numa::POLICY_INTERLEAVE) {
+      placed = -1;
+    } else if (policy == numa::POLICY_NODE) {
+      placed = node;
+    } else {
+      placed = numa::current_node();
+    }
+    mempool::get_pool(mempool::pool_index_t(placed_pool)).adjust_node_bytes(placed, len);
+    bdout << "raw_numa " << this << " alloc " << (void *)data << " " << l
+          << " " << numa::policy_name(policy) << " " << placed << bendl;
+  }
+  ~raw_numa() override {
+    mempool::get_pool(mempool::pool_index_t(placed_pool)).adjust_node_bytes(placed, -(ssize_t)len);
+    numa::free_pages(data, std::max(len, 1u));
+    bdout << "raw_numa " << this << " free " << (void *)data << bendl;
+  }
+  raw* clone_empty() override {
+    return new raw_numa(len, policy, node, mempool);
+  }
+};
+
 unique_leakable_ptr<buffer::raw> buffer::copy(const char *c, unsigned len) {
   auto r = buffer::create_aligned(len, sizeof(size_t));
   memcpy(r->get_data(), c, len);
@@ -290,8 +357,29 @@ buffer::claim_buffer(unsigned len, char *buf, deleter del) {
     new raw_claim_buffer(buf, len, std::move(del)));
 }
 
+unique_leakable_ptr<buffer::raw>
+buffer::create_numa(unsigned len, numa::policy_t policy, int node, int mempool) {
+  return unique_leakable_ptr<buffer::raw>(
+    new raw_numa(len, policy, node, mempool));
+}
+unique_leakable_ptr<buffer::raw>
+buffer::create_in_mempool_on_node(unsigned len, int mempool, int node) {
+  return create_numa(len, numa::POLICY_NODE, node, mempool);
+}
+unique_leakable_ptr<buffer::raw>
+buffer::create_on_node(unsigned len, int node) {
+  return create_numa(len, numa::POLICY_NODE, node, mempool::mempool_buffer_anon);
+}
+
 unique_leakable_ptr<buffer::raw>
 buffer::create_aligned_in_mempool(unsigned len, unsigned align, int mempool) {
+  if (len >= BUFFER_NUMA_MIN && align <= GLOBAL_PAGE_SIZE) {
+    int node;
+    auto policy = mempool::get_pool(mempool::pool_index_t(mempool)).get_numa_policy(&node);
+    if (policy != numa::POLICY_NONE) {
+      return create_numa(len, policy, node, mempool);
+    }
+  }
   // If alignment is a page multiple, use a separate buffer::raw to
   // avoid fragmenting the heap.
   //
@@ -346,7 +434,7 @@ buffer::ptr::ptr(const char *d, unsigned l) : _off(0), _len(l) {
 }
 buffer::ptr::ptr(const ptr& p) : _raw(p._raw), _off(p._off), _len(p._len) {
   if (_raw) {
-    _raw->nref++;
+    _raw->get_ref();
     bdout << "ptr " << this << " get " << _raw << bendl;
   }
 }
@@ -358,7 +446,7 @@ buffer::ptr::ptr(const ptr& p, unsigned o, unsigned l)
   : _raw(p._raw), _off(p._off + o), _len(l) {
   common_assert(o+l <= p._len);
   common_assert(_raw);
-  _raw->nref++;
+  _raw->get_ref();
   bdout << "ptr " << this << " get " << _raw << bendl;
 }
 buffer::ptr::ptr(const ptr& p, unique_leakable_ptr<raw> r)
@@ -370,7 +458,7 @@ buffer::ptr::ptr(const ptr& p, unique_leakable_ptr<raw> r)
 }
 buffer::ptr& buffer::ptr::operator= (const ptr& p) {
   if (p._raw) {
-    p._raw->nref++;
+    p._raw->get_ref();
     bdout << "ptr " << this << " get " << _raw << bendl;
   }
   buffer::raw *raw = p._raw; 
@@ -428,6 +516,15 @@ void buffer::ptr::release() {
     // freshly fabricated one with `1` through the std::atomic's ctor
     // (which doesn't impose a memory barrier on the strongly-ordered
     // x86), this allows to avoid all atomical operations in such case.
+    if (cached_raw->thread_local_refs) {
+      unsigned n = cached_raw->nref.load(std::memory_order_relaxed);
+      if (n == 1) {
+        delete cached_raw;
+      } else {
+        cached_raw->nref.store(n - 1, std::memory_order_relaxed);
+      }
+      return;
+    }
     const bool last_one = (1 == cached_raw->nref.load(std::memory_order_acquire));
     if (likely(last_one) || --cached_raw->nref == 0) {
       bdout << "deleting raw " << static_cast<void*>(cached_raw)
@@ -457,6 +554,11 @@ void buffer::ptr::try_assign_to_mempool(int pool) {
     _raw->try_assign_to_mempool(pool);
   }
 }
+void buffer::ptr::set_thread_local(bool on) {
+  if (_raw) {
+    _raw->set_thread_local(on);
+  }
+}
 
 const char *buffer::ptr::c_str() const {
   common_assert(_raw);
@@ -597,11 +699,24 @@ buffer::list::iterator_impl<is_const>::iterator_impl(const buffer::list::iterato
 template<bool is_const>
 auto buffer::list::iterator_impl<is_const>::operator +=(unsigned o) -> iterator_impl& {
   p_off +=o;
+  unsigned hops = 0;
   while (p != ls->end()) {
     if (p_off >= p->length()) {
       // skip this buffer
       p_off -= p->length();
       p++;
+      if (++hops == BUFFER_SEGMENT_WALK_MAX && p != ls->end() &&
+          p_off >= p->length()) {
+        // a long way to go; jump if the index gets us further
+        if (auto idx = bl->get_segment_index(); idx) {
+          unsigned target = off + o;
+          size_t i = idx->find(target);
+          if (idx->starts[i] > target - p_off) {
+            p = list_iter_t(idx->nodes[i]);
+            p_off = target - idx->starts[i];
+          }
+        }
+      }
     } else {
       // somewhere in this buffer!
       break;
@@ -833,7 +948,35 @@ void buffer::list::iterator::copy_in(unsigned len, const list& otherl) {
 
 // -- buffer::list --
 
+const buffer::list::segment_index_t*
+buffer::list::get_segment_index() const
+{
+  auto idx = _index.load(std::memory_order_acquire);
+  if (idx || _num < BUFFER_SEGMENT_INDEX_MIN) {
+    return idx;
+  }
+  // const readers may race to build it; the first one to publish wins
+  auto fresh = new segment_index_t;
+  fresh->nodes.reserve(_num);
+  fresh->starts.reserve(_num);
+  unsigned pos = 0;
+  for (const auto& node : _buffers) {
+    fresh->nodes.push_back(const_cast<ptr_node*>(&node));
+    fresh->starts.push_back(pos);
+    pos += node.length();
+  }
+  if (_index.compare_exchange_strong(idx, fresh, std::memory_order_acq_rel)) {
+    return fresh;
+  }
+  delete fresh;
+  return idx;
+}
+
 void buffer::list::swap(list& other) noexcept {
+  auto idx = _index.load(std::memory_order_relaxed);
+  _index.store(other._index.load(std::memory_order_relaxed),
+               std::memory_order_relaxed);
+  other._index.store(idx, std::memory_order_relaxed);
   std::swap(_len, other._len);
   std::swap(_num, other._num);
   std::swap(_carriage, other._carriage);
@@ -1019,6 +1162,13 @@ void buffer::list::try_assign_to_mempool(int pool)
   }
 }
 
+void buffer::list::set_thread_local(bool on)
+{
+  for (auto& p : _buffers) {
+    p._raw->set_thread_local(on);
+  }
+}
+
 uint64_t buffer::list::get_wasted_space() const
 {
   if (_num == 1)
@@ -1045,8 +1195,91 @@ uint64_t buffer::list::get_wasted_space() const
   return total - length();
 }
 
+bool buffer::list::should_compact(const compact_policy_t& policy) const
+{
+  unsigned small = 0;
+  for (const auto& node : _buffers) {
+    if (node.length() < policy.small_segment && &node != _carriage &&
+        ++small > policy.max_small_segments) {
+      return true;
+    }
+  }
+  uint64_t wasted = get_wasted_space();
+  return wasted > policy.max_wasted &&
+    wasted * 100 > (uint64_t)_len * policy.max_wasted_ratio;
+}
+
+uint64_t buffer::list::compact(const compact_policy_t& policy)
+{
+  if (_buffers.empty()) {
+    return 0;
+  }
+  invalidate_segment_index();
+  uint64_t wasted = get_wasted_space();
+
+  // how much of each raw this list uses, across all its segments
+  std::unordered_map<const raw*, uint64_t> used;
+  for (const auto& node : _buffers) {
+    used[node._raw] += node.length();
+  }
+  auto well_used = [&](const ptr_node& node) {
+    return used[node._raw] * 100 >=
+      (uint64_t)node.raw_length() * policy.min_utilization;
+  };
+  auto poor = [&](const ptr_node& node) {
+    return &node != _carriage &&
+      (node.length() < policy.small_segment || !well_used(node));
+  };
+
+  const int mempool = get_mempool();
+  auto p = std::begin(_buffers);
+  auto p_prev = _buffers.before_begin();
+  while (p != std::end(_buffers)) {
+    if (!poor(*p)) {
+      p_prev = p++;
+      continue;
+    }
+    // a run of poor segments, up to max_merge bytes
+    auto q = p;
+    unsigned run_len = 0, run_num = 0;
+    do {
+      run_len += q->length();
+      ++run_num;
+      ++q;
+    } while (q != std::end(_buffers) && poor(*q) &&
+             run_len + q->length() <= policy.max_merge);
+    if (run_num == 1 && p->length() && well_used(*p)) {
+      // just small; copying it alone gains nothing
+      p_prev = p++;
+      continue;
+    }
+
+    std::unique_ptr<ptr_node, ptr_node::disposer> merged;
+    if (run_len) {
+      merged = ptr_node::create(buffer::create_in_mempool(run_len, mempool));
+      unsigned pos = 0;
+      for (auto i = p; i != q; ++i) {
+        merged->copy_in(pos, i->length(), i->c_str(), false);
+        pos += i->length();
+      }
+    }
+    while (p != q) {
+      p = _buffers.erase_after_and_dispose(p_prev);
+      _num -= 1;
+    }
+    if (merged) {
+      _buffers.insert_after(p_prev, *merged.release());
+      _num += 1;
+      ++p_prev;
+    }
+  }
+  uint64_t now = get_wasted_space();
+  return wasted > now ? wasted - now : 0;
+}
+
 void buffer::list::rebuild()
 {
+  invalidate_segment_index();
   if (_len == 0) {
     _carriage = &always_empty_bptr;
     _buffers.clear_and_dispose();
@@ -1061,6 +1294,7 @@ void buffer::list::rebuild()
 
 void buffer::list::rebuild(std::unique_ptr<buffer::ptr_node, buffer::ptr_node::disposer> nb)
 {
+  invalidate_segment_index();
   unsigned pos = 0;
   int mempool = _buffers.front().get_mempool();
   nb->reassign_to_mempool(mempool);
@@ -1091,6 +1325,7 @@ bool buffer::list::rebuild_aligned_size_and_memory(unsigned align_size,
 {
   bool had_to_rebuild = false;
 
+  invalidate_segment_index();
   if (max_buffers && _num > max_buffers && _len > (max_buffers * align_size)) {
     align_size = round_up_to(round_up_to(_len, max_buffers) / max_buffers, align_size);
   }
@@ -1149,6 +1384,7 @@ void buffer::list::reserve(size_t prealloc)
     _carriage = ptr.get();
     _buffers.push_back(*ptr.release());
     _num += 1;
+    note_append();
   }
 }
 
@@ -1159,6 +1395,7 @@ void buffer::list::claim_append(list& bl)
   _num += bl._num;
   _buffers.splice_back(bl._buffers);
   bl.clear();
+  note_append();
 }
 
 void buffer::list::append(char c)
@@ -1188,6 +1425,7 @@ buffer::ptr_node& buffer::list::refill_append_space(const unsigned len)
 {
   // make a new buffer.  fill out a complete page, factoring in the
   // raw_combined overhead.
+  perf_refill.inc();
   size_t need = round_up_to(len, sizeof(size_t)) + sizeof(raw_combined);
   size_t alen = round_up_to(need, BUFFER_ALLOC_UNIT);
   if (_carriage == &_buffers.back()) {
@@ -1202,6 +1440,7 @@ buffer::ptr_node& buffer::list::refill_append_space(const unsigned len)
   _carriage = new_back.get();
   _buffers.push_back(*new_back.release());
   _num += 1;
+  note_append();
   return _buffers.back();
 }
 
@@ -1248,6 +1487,7 @@ buffer::list::reserve_t buffer::list::obtain_contiguous_space(const unsigned len
     _buffers.push_back(*new_back);
     _num += 1;
     _carriage = new_back;
+    note_append();
     return { new_back->c_str(), &new_back->_len, &_len };
   } else {
     common_assert(!_buffers.empty());
@@ -1287,6 +1527,7 @@ void buffer::list::append(const ptr& bp, unsigned off, unsigned len)
   _buffers.push_back(*ptr_node::create(bp, off, len).release());
   _len += len;
   _num += 1;
+  note_append();
 }
 
 void buffer::list::append(const list& bl)
@@ -1296,6 +1537,7 @@ void buffer::list::append(const list& bl)
   for (const auto& node : bl._buffers) {
     _buffers.push_back(*ptr_node::create(node).release());
   }
+  note_append();
 }
 
 void buffer::list::append(std::istream& in)
@@ -1333,6 +1575,7 @@ void buffer::list::prepend_zero(unsigned len)
 {
   auto bp = ptr_node::create(len);
   bp->zero(false);
+  invalidate_segment_index();
   _len += len;
   _num += 1;
   _buffers.push_front(*bp.release());
@@ -1370,12 +1613,18 @@ const char& buffer::list::operator[](unsigned n) const
   if (n >= _len)
     throw end_of_buffer();
 
-  for (const auto& node : _buffers) {
-    if (n >= node.length()) {
-      n -= node.length();
+  auto p = std::cbegin(_buffers);
+  if (auto idx = get_segment_index(); idx) {
+    size_t i = idx->find(n);
+    p = buffers_t::const_iterator(idx->nodes[i]);
+    n -= idx->starts[i];
+  }
+  for (; p != std::cend(_buffers); ++p) {
+    if (n >= p->length()) {
+      n -= p->length();
       continue;
     }
-    return node[n];
+    return (*p)[n];
   }
   common_abort();
 }
@@ -1420,6 +1669,11 @@ void buffer::list::substr_of(const list& other, unsigned off, unsigned len)
 
   // skip off
   auto curbuf = std::cbegin(other._buffers);
+  if (auto idx = other.get_segment_index(); idx && off > 0) {
+    size_t i = idx->find(off);
+    curbuf = buffers_t::const_iterator(idx->nodes[i]);
+    off -= idx->starts[i];
+  }
   while (off > 0 && off >= curbuf->length()) {
     // skip this buffer
     //cout << "skipping over " << *curbuf << std::endl;
@@ -1463,6 +1717,15 @@ void buffer::list::splice(unsigned off, unsigned len, list *claim_by /*, bufferl
   // skip off
   auto curbuf = std::begin(_buffers);
   auto curbuf_prev = _buffers.before_begin();
+  if (auto idx = get_segment_index(); idx && off > 0) {
+    size_t i = idx->find(off);
+    curbuf = buffers_t::iterator(idx->nodes[i]);
+    if (i > 0) {
+      curbuf_prev = buffers_t::iterator(idx->nodes[i - 1]);
+    }
+    off -= idx->starts[i];
+  }
+  invalidate_segment_index();
   while (off > 0) {
     common_assert(curbuf != std::end(_buffers));
     if (off >= (*curbuf).length()) {
@@ -1746,6 +2009,7 @@ static int do_writev(int fd, struct iovec *vec, uint64_t offset, unsigned veclen
 
 int buffer::list::write_fd(int fd) const
 {
+  auto start_time = mono_clock::now();
   // use writev!
   iovec iov[IOV_MAX];
   int iovlen = 0;
@@ -1773,6 +2037,7 @@ int buffer::list::write_fd(int fd) const
           goto retry;
         return -err;
       }
+      perf_write_fd_bytes.inc(wrote);
       if (wrote < bytes) {
         // partial write, recover!
         while ((size_t)wrote >= start[0].iov_len) {
@@ -1792,6 +2057,7 @@ int buffer::list::write_fd(int fd) const
       bytes = 0;
     }
   }
+  perf_write_fd_lat.record((mono_clock::now() - start_time).count());
   return 0;
 }
 
@@ -1801,6 +2067,7 @@ int buffer::list::send_fd(int fd) const {
 
 int buffer::list::write_fd(int fd, uint64_t offset) const
 {
+  auto start_time = mono_clock::now();
   iovec iov[IOV_MAX];
 
   auto p = std::cbegin(_buffers);
@@ -1822,8 +2089,10 @@ int buffer::list::write_fd(int fd, uint64_t offset) const
     int r = do_writev(fd, iov, offset, iovlen, bytes);
     if (r < 0)
       return r;
+    perf_write_fd_bytes.inc(bytes);
     offset += bytes;
   }
+  perf_write_fd_lat.record((mono_clock::now() - start_time).count());
   return 0;
 }
 
@@ -1890,6 +2159,10 @@ __u32 buffer::list::crc32c(__u32 crc) const
     }
   }
 
+  perf_crc_hit.inc(cache_hits);
+  perf_crc_adjusted.inc(cache_adjusts);
+  perf_crc_miss.inc(cache_misses);
+
   if (buffer_track_crc) {
     if (cache_adjusts)
       buffer_cached_crc_adjusted += cache_adjusts;
@@ -1902,6 +2175,26 @@ __u32 buffer::list::crc32c(__u32 crc) const
   return crc;
 }
 
+uint32_t buffer::list::crc32c(uint32_t crc, work_pool_t *pool) const
+{
+  if (!pool || pool->size() < 2 || _len < BUFFER_PARALLEL_CRC_MIN) {
+    return crc32c(crc);
+  }
+  // crc32c(a . b, v) = crc32c(b, 0) ^ crc32c(zeros(len(b)), crc32c(a, v)),
+  // so pieces can be hashed from 0 and chained afterwards
+  typedef std::pair<uint32_t, unsigned> piece_t;   // crc from 0, length
+  piece_t all = pool->parallel_reduce(
+    0, _len, BUFFER_PARALLEL_CRC_GRAIN, piece_t(0, 0),
+    [this](size_t b, size_t e) {
+      return piece_t(begin(b).crc32c(e - b, 0), e - b);
+    },
+    [](const piece_t& a, const piece_t& b) {
+      return piece_t(b.first ^ common_crc32(a.first, NULL, b.second),
+                     a.second + b.second);
+    });
+  return all.first ^ common_crc32(crc, NULL, _len);
+}
+
 void buffer::list::invalidate_crc()
 {
   for (const auto& node : _buffers) {
@@ -2104,6 +2397,9 @@ MEMPOOL_DEFINE_OBJECT_FACTORY(buffer::raw_char,
 MEMPOOL_DEFINE_OBJECT_FACTORY(buffer::raw_claimed_char,
                               buffer_raw_claimed_char,
                               buffer_meta);
+MEMPOOL_DEFINE_OBJECT_FACTORY(buffer::raw_numa,
+                              buffer_raw_numa,
+                              buffer_meta);
 MEMPOOL_DEFINE_OBJECT_FACTORY(buffer::raw_static,
                               buffer_raw_static,
                               buffer_meta);
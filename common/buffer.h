@@ -1,6 +1,8 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <algorithm>
+#include <atomic>
 #include <iosfwd>
 #include <iomanip>
 #include <list>
@@ -21,6 +23,7 @@
 
 #include "crc/crc32.h"
 #include "page.h"
+#include "numa.h"
 #include "inline_memory.h"
 #include "assertion.h"
 #include "unique_leakable_ptr.h"
@@ -28,6 +31,8 @@
 #include "error_code.h"
 #include "buffer_fwd.h"
 
+class work_pool_t;
+
 namespace buffer {
 
 // count of cached crc hits (matching input)
@@ -52,6 +57,7 @@ class raw_claimed_char;
 class raw_unshareable; // diagnostic, unshareable char buffer
 class raw_combined;
 class raw_claim_buffer;
+class raw_numa;
 
 /*
  * named constructors
@@ -69,6 +75,11 @@ unique_leakable_ptr<raw> create_aligned_in_mempool(unsigned len, unsigned align,
 unique_leakable_ptr<raw> create_page_aligned(unsigned len);
 unique_leakable_ptr<raw> create_small_page_aligned(unsigned len);
 unique_leakable_ptr<raw> claim_buffer(unsigned len, char *buf, deleter del);
+// buffers placed on a NUMA node (see numa.h); each is its own mapping,
+// so they suit large or long-lived buffers
+unique_leakable_ptr<raw> create_on_node(unsigned len, int node);
+unique_leakable_ptr<raw> create_in_mempool_on_node(unsigned len, int mempool, int node);
+unique_leakable_ptr<raw> create_numa(unsigned len, numa::policy_t policy, int node, int mempool);
 
 class ptr {
   friend class list;
@@ -86,14 +97,16 @@ private:
     const char *pos;   ///< pointer into bp->c_str()
     const char *end_ptr;   ///< pointer to bp->end_c_str()
     const bool deep;   ///< if true, do not allow shallow ptr copies
+    const bool trusted; ///< if true, skip per-read bounds checks
 
     iterator_impl(typename std::conditional<is_const, const ptr*, ptr*>::type p,
-                  size_t offset, bool d)
+                  size_t offset, bool d, bool t=false)
       : bp(p),
       start(p->c_str() + offset),
       pos(start),
       end_ptr(p->end_c_str()),
-      deep(d)
+      deep(d),
+      trusted(t)
     {}
 
     friend class ptr;
@@ -102,7 +115,11 @@ private:
     using pointer = typename std::conditional<is_const, const char*, char *>::type;
     pointer get_pos_add(size_t n) {
       auto r = pos;
-      *this += n;
+      if (trusted) {
+        pos += n;
+      } else {
+        *this += n;
+      }
       return r;
     }
     ptr get_ptr(size_t len) {
@@ -131,6 +148,10 @@ private:
     bool end() const {
       return pos == end_ptr;
     }
+
+    bool is_trusted() const {
+      return trusted;
+    }
   };
 public:
   using const_iterator = iterator_impl<true>;
@@ -170,6 +191,11 @@ public:
   const_iterator begin_deep(size_t offset=0) const {
     return const_iterator(this, offset, true);
   }
+  // for contents whose integrity is already established (e.g. by crc):
+  // reads are not bounds checked, only DENC_START struct lengths are.
+  const_iterator begin_trusted(size_t offset=0) const {
+    return const_iterator(this, offset, false, true);
+  }
 
   // misc
   bool is_aligned(unsigned align) const {
@@ -187,6 +213,8 @@ public:
   int get_mempool() const;
   void reassign_to_mempool(int pool);
   void try_assign_to_mempool(int pool);
+  /// see raw::set_thread_local()
+  void set_thread_local(bool on);
 
   // accessors
   const char *c_str() const;
@@ -293,6 +321,18 @@ private:
   create_hypercombined(unique_leakable_ptr<raw> r);
 };
 
+// Which segments list::compact() copies out.  A segment is poor when it is
+// short, or when the list uses only a small part of its raw buffer.
+struct compact_policy_t {
+  unsigned small_segment = 512;        // bytes
+  unsigned min_utilization = 50;       // percent of the raw in use
+  unsigned max_merge = 64 * 1024;      // largest merged segment
+  // list::maybe_compact() triggers
+  uint64_t max_wasted = 64 * 1024;     // bytes pinned but unused
+  unsigned max_wasted_ratio = 100;     // percent of length()
+  unsigned max_small_segments = 16;
+};
+
 class list {
 public:
   // this the very low-level implementation of singly linked list
@@ -509,6 +549,38 @@ private:
   ptr_node* _carriage;
   unsigned _len, _num;
 
+  // Cumulative offsets of the segments, built lazily on long lists so
+  // that seeks are a binary search.  Appending keeps it valid as a
+  // prefix; any other change to the chain of segments drops it.
+  struct segment_index_t {
+    std::vector<ptr_node*> nodes;
+    std::vector<unsigned> starts;
+
+    // the last indexed segment starting at or before off
+    size_t find(unsigned off) const {
+      return std::upper_bound(starts.begin(), starts.end(), off) -
+        starts.begin() - 1;
+    }
+  };
+  mutable std::atomic<segment_index_t*> _index = {nullptr};
+
+  const segment_index_t* get_segment_index() const;
+  void drop_segment_index() {
+    delete _index.exchange(nullptr, std::memory_order_relaxed);
+  }
+  void invalidate_segment_index() {
+    if (_index.load(std::memory_order_relaxed)) {
+      drop_segment_index();
+    }
+  }
+  // rebuild once the list has doubled, so walks past the prefix stay short
+  void note_append() {
+    if (auto i = _index.load(std::memory_order_relaxed);
+        i && _num > 2 * i->nodes.size()) {
+      drop_segment_index();
+    }
+  }
+
   template <bool is_const>
   class iterator_impl {
   protected:
@@ -808,15 +880,18 @@ public:
     : _buffers(std::move(other._buffers)),
       _carriage(other._carriage),
       _len(other._len),
-      _num(other._num) {
+      _num(other._num),
+      _index(other._index.exchange(nullptr, std::memory_order_relaxed)) {
     other.clear();
   }
   ~list() {
+    drop_segment_index();
     _buffers.clear_and_dispose();
   }
 
   list& operator= (const list& other) {
     if (this != &other) {
+      invalidate_segment_index();
       _carriage = &always_empty_bptr;
       _buffers.clone_from(other._buffers);
       _len = other._len;
@@ -825,6 +900,9 @@ public:
     return *this;
   }
   list& operator= (list&& other) noexcept {
+    invalidate_segment_index();
+    _index.store(other._index.exchange(nullptr, std::memory_order_relaxed),
+                 std::memory_order_relaxed);
     _buffers = std::move(other._buffers);
     _carriage = other._carriage;
     _len = other._len;
@@ -841,13 +919,18 @@ public:
   int get_mempool() const;
   void reassign_to_mempool(int pool);
   void try_assign_to_mempool(int pool);
+  /// confine every buffer to the calling thread, or share them again
+  void set_thread_local(bool on);
 
   size_t get_append_buffer_unused_tail_length() const {
     return _carriage->unused_tail_length();
   }
 
   const buffers_t& buffers() const { return _buffers; }
-  buffers_t& mut_buffers() { return _buffers; }
+  buffers_t& mut_buffers() {
+    invalidate_segment_index();
+    return _buffers;
+  }
   void swap(list& other) noexcept;
   unsigned length() const {
     return _len;
@@ -867,6 +950,7 @@ public:
 
   // modifiers
   void clear() noexcept {
+    invalidate_segment_index();
     _carriage = &always_empty_bptr;
     _buffers.clear_and_dispose();
     _len = 0;
@@ -878,6 +962,7 @@ public:
     _buffers.push_back(*ptr_node::create(bp).release());
     _len += bp.length();
     _num += 1;
+    note_append();
   }
   void push_back(ptr&& bp) {
     if (bp.length() == 0)
@@ -886,6 +971,7 @@ public:
     _num += 1;
     _buffers.push_back(*ptr_node::create(std::move(bp)).release());
     _carriage = &always_empty_bptr;
+    note_append();
   }
   void push_back(const ptr_node&) = delete;
   void push_back(ptr_node&) = delete;
@@ -895,6 +981,7 @@ public:
     _len += bp->length();
     _num += 1;
     _buffers.push_back(*bp.release());
+    note_append();
   }
   void push_back(raw* const r) = delete;
   void push_back(unique_leakable_ptr<raw> r) {
@@ -902,6 +989,7 @@ public:
     _carriage = &_buffers.back();
     _len += _buffers.back().length();
     _num += 1;
+    note_append();
   }
 
   void zero();
@@ -919,6 +1007,21 @@ public:
   bool rebuild_page_aligned();
   void reserve(size_t prealloc);
 
+  /// copy poor segments out, merging adjacent ones; well utilised large
+  /// segments and the append buffer are left alone.  Returns the drop
+  /// in wasted space.
+  uint64_t compact(const compact_policy_t& policy = compact_policy_t());
+  /// whether the list pins or fragments enough to be worth compacting
+  bool should_compact(const compact_policy_t& policy = compact_policy_t()) const;
+  /// for long-lived holders (caches) to call as they retain a list
+  bool maybe_compact(const compact_policy_t& policy = compact_policy_t()) {
+    if (!should_compact(policy)) {
+      return false;
+    }
+    compact(policy);
+    return true;
+  }
+
   [[deprecated("in favor of operator=(list&&)")]] void claim(list& bl) {
     *this = std::move(bl);
   }
@@ -1037,6 +1140,9 @@ public:
   iov_vec_t prepare_iovs() const;
 
   uint32_t crc32c(uint32_t crc) const;
+  /// the same, split over pool when the list is long enough to pay off;
+  /// doesn't use or fill the raws' crc caches
+  uint32_t crc32c(uint32_t crc, work_pool_t *pool) const;
   void invalidate_crc();
 
   // These functions return a bufferlist with a pointer to a single
@@ -6,7 +6,7 @@
 #include <utility>
 #include <type_traits>
 
-#include "spinlock.h"
+#include "seqlock.h"
 #include "mempool.h"
 #include "unique_leakable_ptr.h"
 #include "buffer.h"
@@ -24,25 +24,31 @@ protected:
 public:
   std::atomic<unsigned> nref { 0 };
   int mempool;
+  // every ptr to us lives on one thread: count without lock-prefixed RMWs
+  bool thread_local_refs = false;
 
-  // crc
-  std::pair<size_t, size_t> last_crc_offset {
-    std::numeric_limits<size_t>::max(),
-    std::numeric_limits<size_t>::max()
+  // crc of the last range hashed; readers don't take a lock
+  struct crc_cache_t {
+    size_t from = std::numeric_limits<size_t>::max();
+    size_t to = std::numeric_limits<size_t>::max();
+    uint32_t crc_in = 0;
+    uint32_t crc_out = 0;
   };
-  std::pair<uint32_t, uint32_t> last_crc_val;
-  mutable spinlock crc_spinlock;
+  seqlock<crc_cache_t> last_crc;
 
   // 构造函数
   explicit raw(unsigned l, int mempool=mempool::mempool_buffer_anon)
     : data(nullptr), len(l), nref(0), mempool(mempool) {
     mempool::get_pool(mempool::pool_index_t(mempool)).adjust_count(1, len);
+    mempool::heap_profile_note_alloc(mempool::pool_index_t(mempool), this, len);
   }
   raw(char *c, unsigned l, int mempool=mempool::mempool_buffer_anon)
     : data(c), len(l), nref(0), mempool(mempool) {
     mempool::get_pool(mempool::pool_index_t(mempool)).adjust_count(1, len);
+    mempool::heap_profile_note_alloc(mempool::pool_index_t(mempool), this, len);
   }
   virtual ~raw() {
+    mempool::heap_profile_note_free(mempool::pool_index_t(mempool), this);
     mempool::get_pool(mempool::pool_index_t(mempool)).adjust_count(-1, -(int)len);
   }
   void _set_len(unsigned l) {
@@ -56,6 +62,8 @@ public:
       return;
     }
     mempool::get_pool(mempool::pool_index_t(mempool)).adjust_count(-1, -(int)len);
+    mempool::heap_profile_note_move(mempool::pool_index_t(mempool),
+                                    mempool::pool_index_t(pool), this);
     mempool = pool;
     mempool::get_pool(mempool::pool_index_t(pool)).adjust_count(1, len);
   }
@@ -66,6 +74,24 @@ public:
     }
   }
 
+  void get_ref() {
+    if (thread_local_refs) {
+      nref.store(nref.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+    } else {
+      nref++;
+    }
+  }
+
+  /**
+   * Confine (or release) this buffer to the calling thread.  Must be
+   * called by the thread holding every reference; handing a confined
+   * buffer to another thread requires clearing it first.
+   */
+  void set_thread_local(bool on) {
+    thread_local_refs = on;
+  }
+
 private:
   /**
    * no copying.
@@ -90,23 +116,20 @@ public:
 
   bool get_crc(const std::pair<size_t, size_t> &fromto,
                std::pair<uint32_t, uint32_t> *crc) const {
-    std::lock_guard lg(crc_spinlock);
-    if (last_crc_offset == fromto) {
-      *crc = last_crc_val;
+    crc_cache_t c = last_crc.load();
+    if (c.from == fromto.first && c.to == fromto.second) {
+      *crc = std::make_pair(c.crc_in, c.crc_out);
       return true;
     }
     return false;
   }
   void set_crc(const std::pair<size_t, size_t> &fromto,
                const std::pair<uint32_t, uint32_t> &crc) {
-    std::lock_guard lg(crc_spinlock);
-    last_crc_offset = fromto;
-    last_crc_val = crc;
+    last_crc.store(crc_cache_t{fromto.first, fromto.second,
+                               crc.first, crc.second});
   }
   void invalidate_crc() {
-    std::lock_guard lg(crc_spinlock);
-    last_crc_offset.first = std::numeric_limits<size_t>::max();
-    last_crc_offset.second = std::numeric_limits<size_t>::max();
+    last_crc.store(crc_cache_t());
   }
 };
 
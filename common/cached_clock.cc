@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <sys/prctl.h>
+
+#include "cached_clock.h"
+
+cached_clock::stamps_t cached_clock::stamps;
+
+namespace {
+
+struct updater_t {
+  // serializes start() and stop(), which joins without holding lock
+  std::mutex control;
+  std::mutex lock;
+  std::condition_variable cond;
+  bool stopping = false;
+  std::chrono::microseconds interval{0};
+  std::thread thread;
+};
+
+updater_t& updater()
+{
+  // leaked: readers may outlive static destruction
+  static updater_t *u = new updater_t;
+  return *u;
+}
+
+void update()
+{
+  using namespace cached_clock;
+  stamps.mono_ns.store(mono_clock::now().time_since_epoch().count(),
+                       std::memory_order_relaxed);
+  stamps.real_ns.store(real_clock::now().time_since_epoch().count(),
+                       std::memory_order_relaxed);
+}
+
+void run()
+{
+  // the default 50us of timer slack would swamp short intervals
+  prctl(PR_SET_TIMERSLACK, 1000);
+  auto& u = updater();
+  std::unique_lock l(u.lock);
+  // on a fixed schedule, so a late wakeup doesn't push the next one out
+  auto next = std::chrono::steady_clock::now();
+  while (!u.stopping) {
+    l.unlock();
+    update();
+    l.lock();
+    next += u.interval;
+    auto now = std::chrono::steady_clock::now();
+    if (next < now) {
+      next = now;
+    }
+    u.cond.wait_until(l, next, [&u] { return u.stopping; });
+  }
+}
+
+} // anonymous namespace
+
+void cached_clock::start(std::chrono::microseconds interval)
+{
+  auto& u = updater();
+  std::lock_guard c(u.control);
+  std::lock_guard l(u.lock);
+  u.interval = std::max(interval, std::chrono::microseconds(1));
+  if (u.thread.joinable()) {
+    return;
+  }
+  // valid before anyone can see we're running
+  update();
+  u.stopping = false;
+  u.thread = std::thread(run);
+}
+
+void cached_clock::stop()
+{
+  auto& u = updater();
+  std::lock_guard c(u.control);
+  {
+    std::lock_guard l(u.lock);
+    if (!u.thread.joinable()) {
+      return;
+    }
+    u.stopping = true;
+  }
+  u.cond.notify_all();
+  u.thread.join();
+  // back to reading the real clocks
+  stamps.mono_ns.store(0, std::memory_order_relaxed);
+  stamps.real_ns.store(0, std::memory_order_relaxed);
+}
+
+bool cached_clock::is_running()
+{
+  auto& u = updater();
+  std::lock_guard c(u.control);
+  return u.thread.joinable();
+}
+
+std::chrono::microseconds cached_clock::get_interval()
+{
+  auto& u = updater();
+  std::lock_guard l(u.lock);
+  return u.thread.joinable() ? u.interval : std::chrono::microseconds(0);
+}
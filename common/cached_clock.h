@@ -0,0 +1,116 @@
+#ifndef CACHED_CLOCK_H
+#define CACHED_CLOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "likely.h"
+#include "time.h"
+
+/**
+ * Clocks read from a timestamp a background thread keeps fresh, for
+ * stamping cache entries, log records and the like: a read is a
+ * relaxed load and a compare against a thread-local.
+ *
+ * Opt in with cached_clock::start(interval); the stamps are then at
+ * most about interval (plus scheduling delay) behind, never ahead.
+ * Until started, or once stopped, the clocks read mono_clock and
+ * real_clock directly.
+ *
+ * cached_mono_clock never goes back on any one thread, start() and
+ * stop() included: a thread that read mono_clock just before start()
+ * could otherwise see the first, older, stamp next, so each thread
+ * holds on to the latest time it has returned.
+ */
+namespace cached_clock {
+
+struct alignas(64) stamps_t {
+  // 0 while not running
+  std::atomic<uint64_t> mono_ns = {0};
+  std::atomic<uint64_t> real_ns = {0};
+};
+
+extern stamps_t stamps;
+
+// the latest cached_mono_clock time this thread has returned
+inline thread_local uint64_t last_mono_ns
+  __attribute__((tls_model("initial-exec"))) = 0;
+
+/// start refreshing every interval, or change the interval if running
+void start(std::chrono::microseconds interval = std::chrono::milliseconds(1));
+void stop();
+
+bool is_running();
+std::chrono::microseconds get_interval();
+
+} // namespace cached_clock
+
+class cached_mono_clock {
+public:
+  typedef timespan duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<cached_mono_clock> time_point;
+  static constexpr const bool is_steady = true;
+
+  static time_point now() noexcept {
+    uint64_t ns = cached_clock::stamps.mono_ns.load(std::memory_order_relaxed);
+    if (unlikely(!ns)) {
+      ns = mono_clock::now().time_since_epoch().count();
+    }
+    uint64_t& last = cached_clock::last_mono_ns;
+    if (unlikely(ns < last)) {
+      ns = last;
+    } else {
+      last = ns;
+    }
+    return time_point(duration(ns));
+  }
+
+  static mono_time to_mono(const time_point& t) {
+    return mono_time(t.time_since_epoch());
+  }
+
+  static bool is_zero(const time_point& t) {
+    return (t == time_point::min());
+  }
+
+  static time_point zero() {
+    return time_point::min();
+  }
+};
+
+class cached_real_clock {
+public:
+  typedef timespan duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<cached_real_clock> time_point;
+  static constexpr const bool is_steady = false;
+
+  static time_point now() noexcept {
+    uint64_t ns = cached_clock::stamps.real_ns.load(std::memory_order_relaxed);
+    if (unlikely(!ns)) {
+      return time_point(real_clock::now().time_since_epoch());
+    }
+    return time_point(duration(ns));
+  }
+
+  static real_time to_real(const time_point& t) {
+    return real_time(t.time_since_epoch());
+  }
+
+  static bool is_zero(const time_point& t) {
+    return (t == time_point::min());
+  }
+
+  static time_point zero() {
+    return time_point::min();
+  }
+};
+
+typedef cached_mono_clock::time_point cached_mono_time;
+typedef cached_real_clock::time_point cached_real_time;
+
+#endif // CACHED_CLOCK_H
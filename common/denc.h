@@ -2,13 +2,16 @@
 #define DENC_H
 
 #include <inttypes.h>
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <map>
 #include <optional>
 #include <set>
 #include <string>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <boost/container/flat_map.hpp>
@@ -20,11 +23,13 @@
 
 #include "compat.h"
 #include "intarith.h"
+#include "likely.h"
 #include "scope_guard.h"
 #include "byteorder.h"
 #include "convenience.h"
 #include "error_code.h"
 #include "buffer.h"
+#include "mempool.h"
 
 template<typename T, typename=void>
 struct denc_traits {
@@ -259,12 +264,62 @@ struct denc_traits<T, std::enable_if_t<!std::is_void_v<_denc::ExtType_t<T>>>>
   }
 };
 
+// exact sizing
+//
+// bound_encode() reports the worst case for the variable-length integer
+// encodings below, and bounded containers multiply the size of their
+// first element by the element count.  While a denc_exact_size guard is
+// alive on the current thread, the varints report the bytes they will
+// really take and bounded containers visit every element, so the result
+// is the precise encoded length.  The top-level encode wrappers switch to
+// it on their own when the estimate exceeds DENC_EXACT_SIZE_THRESHOLD
+// and some encoding in it reported a worst case.
+#ifndef DENC_EXACT_SIZE_THRESHOLD
+#define DENC_EXACT_SIZE_THRESHOLD (8u << 10)
+#endif
+
+namespace _denc {
+// initial-exec keeps the check a plain %fs-relative load rather than a
+// __tls_get_addr() call per varint.
+inline thread_local unsigned exact_size_depth
+  __attribute__((tls_model("initial-exec"))) = 0;
+// set by a bound pass that took a worst case rather than the real length;
+// a bound without it is already exact, and bounded containers of such
+// elements extrapolate exactly too.
+inline thread_local bool bound_inexact
+  __attribute__((tls_model("initial-exec"))) = false;
+}
+
+struct denc_exact_size {
+  denc_exact_size() {
+    ++_denc::exact_size_depth;
+  }
+  ~denc_exact_size() {
+    --_denc::exact_size_depth;
+  }
+  denc_exact_size(const denc_exact_size&) = delete;
+  denc_exact_size& operator=(const denc_exact_size&) = delete;
+
+  static bool active() {
+    return _denc::exact_size_depth != 0;
+  }
+};
+
+inline size_t denc_varint_size(uint64_t v) {
+  return v ? (cbits(v) + 6) / 7 : 1;
+}
+
 // varint
 //
 // high bit of each byte indicates another byte follows.
 template<typename T>
 inline void denc_varint(T v, size_t& p) {
-  p += sizeof(T) + 1;
+  if (unlikely(denc_exact_size::active())) {
+    p += denc_varint_size(static_cast<uint64_t>(v));
+  } else {
+    _denc::bound_inexact = true;
+    p += sizeof(T) + 1;
+  }
 }
 
 template<typename T>
@@ -297,7 +352,12 @@ inline void denc_varint(T& v, buffer::ptr::const_iterator& p) {
 // low bit = 1 = negative, 0 = positive
 // high bit of every byte indicates whether another byte follows.
 inline void denc_signed_varint(int64_t v, size_t& p) {
-  p += sizeof(v) + 2;
+  if (unlikely(denc_exact_size::active())) {
+    p += denc_varint_size(v < 0 ? (-v << 1) | 1 : v << 1);
+  } else {
+    _denc::bound_inexact = true;
+    p += sizeof(v) + 2;
+  }
 }
 template<class It>
 inline std::enable_if_t<!is_const_iterator_v<It>>
@@ -329,7 +389,13 @@ denc_signed_varint(T& v, It& p)
 // high bit of each byte = another byte follows
 // (so, 5 bits data in first byte, 7 bits data thereafter)
 inline void denc_varint_lowz(uint64_t v, size_t& p) {
-  p += sizeof(v) + 2;
+  if (unlikely(denc_exact_size::active())) {
+    int lowznib = v ? std::min(ctz(v) / 4, 3u) : 0;
+    p += denc_varint_size((v >> (lowznib * 4)) << 2);
+  } else {
+    _denc::bound_inexact = true;
+    p += sizeof(v) + 2;
+  }
 }
 inline void denc_varint_lowz(uint64_t v,
                              buffer::list::contiguous_appender& p) {
@@ -360,7 +426,15 @@ inline void denc_varint_lowz(T& v, buffer::ptr::const_iterator& p)
 // high bit of each byte = another byte follows
 // (so, 4 bits data in first byte, 7 bits data thereafter)
 inline void denc_signed_varint_lowz(int64_t v, size_t& p) {
-  p += sizeof(v) + 2;
+  if (unlikely(denc_exact_size::active())) {
+    if (v < 0)
+      v = -v;
+    unsigned lowznib = v ? std::min(ctz(v) / 4, 3u) : 0u;
+    p += denc_varint_size((v >> (lowznib * 4)) << 3);
+  } else {
+    _denc::bound_inexact = true;
+    p += sizeof(v) + 2;
+  }
 }
 template<class It>
 inline std::enable_if_t<!is_const_iterator_v<It>>
@@ -409,7 +483,21 @@ denc_signed_varint_lowz(T& v, It& p)
 // then last bit = another byte follows
 // high bit of each subsequent byte = another byte follows
 inline void denc_lba(uint64_t v, size_t& p) {
-  p += sizeof(v) + 2;
+  if (unlikely(denc_exact_size::active())) {
+    int low_zero_nibbles = v ? (int)(ctz(v) / 4) : 0;
+    int t = low_zero_nibbles - 3;
+    if (t < 0) {
+      v >>= 31 - 3;
+    } else if (t < 3) {
+      v >>= (low_zero_nibbles * 4) + 31 - (t + 1);
+    } else {
+      v >>= 20 + 31 - 3;
+    }
+    p += sizeof(uint32_t) + (v ? denc_varint_size(v) : 0);
+  } else {
+    _denc::bound_inexact = true;
+    p += sizeof(v) + 2;
+  }
 }
 
 template<class It>
@@ -784,6 +872,16 @@ namespace _denc {
     static void bound_encode(const container& s, size_t& p, uint64_t f = 0) {
       p += sizeof(uint32_t);
       if constexpr (traits::bounded) {
+        if (unlikely(denc_exact_size::active())) {
+          for (const T& e : s) {
+            if constexpr (traits::featured) {
+              denc(e, p, f);
+            } else {
+              denc(e, p);
+            }
+          }
+          return;
+        }
 #if _GLIBCXX_USE_CXX11_ABI
         // intensionally not calling container's empty() method to not prohibit
         // compiler from optimizing the check if it and the ::size() operate on
@@ -948,7 +1046,15 @@ public:
   static void bound_encode(const container& s, size_t& p, uint64_t f = 0) {
     p += sizeof(uint32_t);
     if constexpr (traits::bounded) {
-      if (!s.empty()) {
+      if (unlikely(denc_exact_size::active())) {
+        for (const T& e : s) {
+          if constexpr (traits::featured) {
+            denc(e, p, f);
+          } else {
+            denc(e, p);
+          }
+        }
+      } else if (!s.empty()) {
         const auto elem_num = s.size();
         size_t elem_size = 0;
         if constexpr (traits::featured) {
@@ -1105,7 +1211,15 @@ public:
 
   static void bound_encode(const container& s, size_t& p, uint64_t f = 0) {
     if constexpr (traits::bounded) {
-      if constexpr (traits::featured) {
+      if (unlikely(denc_exact_size::active())) {
+        for (const auto& e : s) {
+          if constexpr (traits::featured) {
+            denc(e, p, f);
+          } else {
+            denc(e, p);
+          }
+        }
+      } else if constexpr (traits::featured) {
         if (!s.empty()) {
           size_t elem_size = 0;
           denc(*s.begin(), elem_size, f);
@@ -1504,6 +1618,34 @@ encoded_sizeof(const T &t) {
   return p;
 }
 
+template <typename T, typename traits=denc_traits<T>>
+std::enable_if_t<traits::supported, size_t>
+encoded_sizeof_exact(const T &t, uint64_t features=0) {
+  size_t p = 0;
+  denc_exact_size exact;
+  denc(t, p, features);
+  return p;
+}
+
+namespace _denc {
+// how much contiguous space to reserve for encoding o: the cheap upper
+// bound, or the exact length when the bound is a worst case and large
+// enough that over-reserving would waste a noticeable allocation.
+template<typename T, typename traits=denc_traits<T>>
+inline size_t appender_reserve(const T& o, uint64_t features) {
+  const bool outer = _denc::bound_inexact;
+  _denc::bound_inexact = false;
+  size_t len = 0;
+  denc(o, len, features);
+  if (_denc::bound_inexact && len > DENC_EXACT_SIZE_THRESHOLD &&
+      !denc_exact_size::active()) {
+    len = encoded_sizeof_exact(o, features);
+  }
+  _denc::bound_inexact |= outer;
+  return len;
+}
+}
+
 // ----------------------------------------------------------------------
 // encode/decode wrappers
 template<typename T, typename traits=denc_traits<T>>
@@ -1512,8 +1654,7 @@ inline std::enable_if_t<traits::supported && !traits::featured> encode(
   buffer::list& bl,
   uint64_t features_unused=0)
 {
-  size_t len = 0;
-  traits::bound_encode(o, len);
+  size_t len = _denc::appender_reserve(o, 0);
   auto a = bl.get_contiguous_appender(len);
   traits::encode(o, a);
 }
@@ -1523,8 +1664,7 @@ inline std::enable_if_t<traits::supported && traits::featured> encode(
   const T& o, buffer::list& bl,
   uint64_t features)
 {
-  size_t len = 0;
-  traits::bound_encode(o, len, features);
+  size_t len = _denc::appender_reserve(o, features);
   auto a = bl.get_contiguous_appender(len);
   traits::encode(o, a, features);
 }
@@ -1576,6 +1716,63 @@ inline std::enable_if_t<traits::supported && traits::need_contiguous> decode(
   p += cp.get_offset();
 }
 
+// Trusted decode: for buffers whose integrity has already been verified
+// (e.g. by a crc).  The contiguous iterator skips its per-read bounds
+// checks and only each DENC_START header and struct length is validated
+// against the remaining bytes.  Nothing else is: a top-level value that
+// isn't a DENC struct, or a container whose element count overstates
+// what's there, is read past the end of the buffer.  Only use it on
+// encodings this code produced.  Opt in per call with
+// decode(o, p, denc_trusted).
+struct denc_trusted_t {};
+inline constexpr denc_trusted_t denc_trusted{};
+
+template<typename T,
+         typename traits=denc_traits<T>>
+inline std::enable_if_t<traits::supported> decode(
+  T& o,
+  buffer::list::const_iterator& p,
+  denc_trusted_t)
+{
+  if (p.end())
+    throw buffer::end_of_buffer();
+  const auto& bl = p.get_bl();
+  const auto remaining = bl.length() - p.get_off();
+  if constexpr (!traits::need_contiguous) {
+    // same trade-off as the checked variant: rebuilding a large
+    // fragmented tail costs more than the bounds checks it saves.
+    if (!p.is_pointing_same_raw(bl.back()) && remaining > GLOBAL_PAGE_SIZE) {
+      traits::decode(o, p);
+      return;
+    }
+  }
+  buffer::ptr tmp;
+  auto t = p;
+  t.copy_shallow(remaining, tmp);
+  auto cp = tmp.begin_trusted();
+  traits::decode(o, cp);
+  p += cp.get_offset();
+}
+
+// Arena decode: o must be a container or string whose allocator is a
+// mempool::arena_allocator.  It is rebound to the arena, and everything
+// decoded into it (nested containers and strings included) is bump
+// allocated from there, so nothing is freed per element; the memory goes
+// back when the arena is released.
+template<typename T,
+         typename traits=denc_traits<T>>
+inline std::enable_if_t<traits::supported &&
+                        mempool::is_arena_allocator_v<typename T::allocator_type>>
+decode(
+  T& o,
+  buffer::list::const_iterator& p,
+  mempool::arena_t& arena)
+{
+  mempool::arena_t::scope s(arena);
+  o = T(typename T::allocator_type(&arena));
+  decode(o, p);
+}
+
 // nohead variants
 template<typename T, typename traits=denc_traits<T>>
 inline std::enable_if_t<traits::supported &&
@@ -1583,8 +1780,7 @@ inline std::enable_if_t<traits::supported &&
   const T& o,
   buffer::list& bl)
 {
-  size_t len = 0;
-  traits::bound_encode(o, len);
+  size_t len = _denc::appender_reserve(o, 0);
   auto a = bl.get_contiguous_appender(len);
   traits::encode_nohead(o, a);
 }
@@ -1657,7 +1853,7 @@ inline std::enable_if_t<traits::supported && !traits::featured> decode_nohead(
                __u8 *struct_compat,                                             \
                char **len_pos,                                                  \
                uint32_t *start_oob_off) {                                       \
-    *(cpputils_le32*)*len_pos = p.get_pos() - *len_pos - sizeof(uint32_t) +     \
+    *(common_le32*)*len_pos = p.get_pos() - *len_pos - sizeof(uint32_t) +     \
       p.get_out_of_band_offset() - *start_oob_off;                              \
   }                                                                             \
   /* decode */                                                                  \
@@ -1666,9 +1862,18 @@ inline std::enable_if_t<traits::supported && !traits::featured> decode_nohead(
                           __u8 *struct_compat,                                  \
                           char **start_pos,                                     \
                           uint32_t *struct_len) {                               \
+    /* the header is read unchecked too */                                      \
+    if (p.is_trusted() &&                                                       \
+        p.get_end() - p.get_pos() < (std::ptrdiff_t)(2 + sizeof(uint32_t))) {   \
+      throw buffer::end_of_buffer();                                            \
+    }                                                                           \
     denc(*struct_v, p);                                                         \
     denc(*struct_compat, p);                                                    \
     denc(*struct_len, p);                                                       \
+    if (p.is_trusted() &&                                                       \
+        p.get_end() - p.get_pos() < (std::ptrdiff_t)*struct_len) {              \
+      throw buffer::end_of_buffer();                                            \
+    }                                                                           \
     *start_pos = const_cast<char*>(p.get_pos());                                \
   }                                                                             \
   static void _denc_finish(buffer::ptr::const_iterator& p,                      \
@@ -1743,4 +1948,247 @@ inline std::enable_if_t<traits::supported && !traits::featured> decode_nohead(
                           std::is_same_v<T, const Type>>                        \
   _denc_friend(T& v, P& p, uint64_t f)
 
+// ----------------------------------------------------------------------
+// columnar encoding
+//
+// A std::vector<S> normally encodes each element with its own DENC_START
+// header and interleaved fields.  For flat structs whose fields are all
+// bounded denc types, WRITE_CLASS_DENC_COLUMNS(S, &S::a, &S::b, ...)
+// enables encode_columnar()/decode_columnar(), which write one header and
+// then each field as a contiguous column:
+//
+//   u8 struct_v, u8 struct_compat, u32 len, u32 count, u8 ncolumns
+//   per column: u8 codec, u32 column_len, column_len bytes
+//
+// Integer columns pick the smallest of the raw, varint and delta codecs.
+// The decoder can skip columns it is not asked for, leaves columns the
+// encoder did not write default-initialized, and ignores columns it does
+// not know about.
+
+template<typename S>
+struct denc_columns {
+  static constexpr bool supported = false;
+};
+
+#define WRITE_CLASS_DENC_COLUMNS(S, ...)                                        \
+  template<> struct denc_columns<S> {                                           \
+    static constexpr bool supported = true;                                     \
+    static constexpr auto fields = std::make_tuple(__VA_ARGS__);                \
+  };
+
+enum class denc_column_codec : uint8_t {
+  raw = 0,     ///< denc of each element
+  varint = 1,  ///< varint, zigzag for signed types
+  delta = 2,   ///< zigzag varint of the difference to the previous element
+};
+
+namespace _denc {
+template<typename M> struct member_type;
+template<typename S, typename F> struct member_type<F S::*> {
+  using type = F;
+};
+
+template<typename S, typename F, size_t... Is>
+inline void for_each_column(F&& f, std::index_sequence<Is...>) {
+  (f(std::integral_constant<size_t, Is>{},
+     std::get<Is>(denc_columns<S>::fields)), ...);
+}
+template<typename S, typename F>
+inline void for_each_column(F&& f) {
+  constexpr size_t n = std::tuple_size_v<decltype(denc_columns<S>::fields)>;
+  static_assert(n > 0 && n < 64, "1..63 columns are supported");
+  for_each_column<S>(std::forward<F>(f), std::make_index_sequence<n>{});
+}
+
+template<typename F>
+inline constexpr bool is_varint_column =
+  std::is_integral_v<F> && !std::is_same_v<F, bool> && sizeof(F) <= 8;
+
+inline uint64_t zigzag(uint64_t v) {
+  return (v << 1) ^ (uint64_t)((int64_t)v >> 63);
+}
+inline uint64_t unzigzag(uint64_t v) {
+  return (v >> 1) ^ -(v & 1);
+}
+template<typename F>
+inline uint64_t column_varint(F v) {
+  return std::is_signed_v<F> ? zigzag((uint64_t)(int64_t)v) : (uint64_t)v;
+}
+}
+
+template<typename S, typename Alloc>
+std::enable_if_t<denc_columns<S>::supported>
+encode_columnar(const std::vector<S, Alloc>& v, buffer::list& bl)
+{
+  // choose the codecs and reserve the worst case up front
+  uint8_t codecs[64];
+  size_t len = 2 + 4 + 4 + 1;
+  _denc::for_each_column<S>([&](auto i, auto m) {
+    using F = typename _denc::member_type<decltype(m)>::type;
+    static_assert(denc_traits<F>::supported && denc_traits<F>::bounded &&
+                  !denc_traits<F>::featured,
+                  "columns must be bounded, unfeatured denc types");
+    size_t raw = 0;
+    for (const auto& e : v) {
+      denc(e.*m, raw);
+    }
+    auto codec = denc_column_codec::raw;
+    if constexpr (_denc::is_varint_column<F>) {
+      size_t varint = 0, delta = 0;
+      uint64_t prev = 0;
+      for (const auto& e : v) {
+        varint += denc_varint_size(_denc::column_varint(e.*m));
+        delta += denc_varint_size(_denc::zigzag((uint64_t)(e.*m) - prev));
+        prev = (uint64_t)(e.*m);
+      }
+      if (varint < raw) {
+        codec = denc_column_codec::varint;
+        raw = varint;
+      }
+      if (delta < raw) {
+        codec = denc_column_codec::delta;
+        raw = delta;
+      }
+    }
+    codecs[i] = (uint8_t)codec;
+    len += 1 + 4 + raw;
+  });
+
+  auto a = bl.get_contiguous_appender(len);
+  denc((uint8_t)1, a);
+  denc((uint8_t)1, a);
+  char *len_pos = a.get_pos_add(4);
+  const char *start = a.get_pos();
+  denc((uint32_t)v.size(), a);
+  denc((uint8_t)std::tuple_size_v<decltype(denc_columns<S>::fields)>, a);
+  _denc::for_each_column<S>([&](auto i, auto m) {
+    using F = typename _denc::member_type<decltype(m)>::type;
+    denc(codecs[i], a);
+    char *column_len_pos = a.get_pos_add(4);
+    const char *column_start = a.get_pos();
+    switch ((denc_column_codec)codecs[i]) {
+    case denc_column_codec::raw:
+      for (const auto& e : v) {
+        denc(e.*m, a);
+      }
+      break;
+    case denc_column_codec::varint:
+      if constexpr (_denc::is_varint_column<F>) {
+        for (const auto& e : v) {
+          denc_varint(_denc::column_varint(e.*m), a);
+        }
+      }
+      break;
+    case denc_column_codec::delta:
+      if constexpr (_denc::is_varint_column<F>) {
+        uint64_t prev = 0;
+        for (const auto& e : v) {
+          denc_varint(_denc::zigzag((uint64_t)(e.*m) - prev), a);
+          prev = (uint64_t)(e.*m);
+        }
+      }
+      break;
+    }
+    *(common_le32*)column_len_pos = a.get_pos() - column_start;
+  });
+  *(common_le32*)len_pos = a.get_pos() - start;
+}
+
+// columns is a bitmask of the columns to decode, in declaration order.
+template<typename S, typename Alloc>
+std::enable_if_t<denc_columns<S>::supported>
+decode_columnar(std::vector<S, Alloc>& v, buffer::list::const_iterator& p,
+                uint64_t columns = ~0ull)
+{
+  uint8_t struct_v, struct_compat;
+  uint32_t len;
+  denc(struct_v, p);
+  denc(struct_compat, p);
+  denc(len, p);
+  if (struct_compat > 1) {
+    throw buffer::malformed_input(__PRETTY_FUNCTION__);
+  }
+  buffer::ptr tmp;
+  p.copy_shallow(len, tmp);
+  auto cp = std::cbegin(tmp);
+
+  uint32_t count;
+  uint8_t ncolumns;
+  denc(count, cp);
+  denc(ncolumns, cp);
+  // every column holds at least a byte per element; don't let a bad count
+  // allocate before the columns are read
+  if (count > (size_t)(cp.get_end() - cp.get_pos())) {
+    throw buffer::malformed_input(__PRETTY_FUNCTION__);
+  }
+  v.clear();
+  v.resize(count);
+
+  unsigned column = 0;
+  auto next_column = [&](uint8_t& codec, const char*& end) {
+    uint32_t column_len;
+    denc(codec, cp);
+    denc(column_len, cp);
+    end = cp.get_pos() + column_len;
+    if (end > cp.get_end()) {
+      throw buffer::end_of_buffer();
+    }
+  };
+  _denc::for_each_column<S>([&](auto i, auto m) {
+    using F = typename _denc::member_type<decltype(m)>::type;
+    if (i >= ncolumns) {
+      return;
+    }
+    ++column;
+    uint8_t codec;
+    const char *end;
+    next_column(codec, end);
+    if (!(columns & (1ull << i))) {
+      cp += end - cp.get_pos();
+      return;
+    }
+    switch ((denc_column_codec)codec) {
+    case denc_column_codec::raw:
+      for (auto& e : v) {
+        denc(e.*m, cp);
+      }
+      break;
+    case denc_column_codec::varint:
+      if constexpr (_denc::is_varint_column<F>) {
+        for (auto& e : v) {
+          uint64_t x;
+          denc_varint(x, cp);
+          e.*m = (F)(std::is_signed_v<F> ? _denc::unzigzag(x) : x);
+        }
+        break;
+      }
+      [[fallthrough]];
+    case denc_column_codec::delta:
+      if constexpr (_denc::is_varint_column<F>) {
+        uint64_t prev = 0;
+        for (auto& e : v) {
+          uint64_t x;
+          denc_varint(x, cp);
+          prev += _denc::unzigzag(x);
+          e.*m = (F)prev;
+        }
+        break;
+      }
+      [[fallthrough]];
+    default:
+      throw buffer::malformed_input(__PRETTY_FUNCTION__);
+    }
+    if (cp.get_pos() != end) {
+      throw buffer::malformed_input(__PRETTY_FUNCTION__);
+    }
+  });
+  // columns appended by a newer encoder
+  for (; column < ncolumns; ++column) {
+    uint8_t codec;
+    const char *end;
+    next_column(codec, end);
+    cp += end - cp.get_pos();
+  }
+}
+
 #endif // DENC_H
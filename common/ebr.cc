@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ebr.h"
+#include "mempool.h"
+
+using namespace ebr;
+
+std::atomic<uint64_t> ebr::global_epoch = {2};
+
+namespace ebr {
+
+struct retired_t {
+  void *p;
+  void (*deleter)(void*);
+  size_t bytes;
+};
+
+struct bucket_t {
+  uint64_t epoch = 0;
+  std::vector<retired_t> items;
+};
+
+// three buckets are enough: by the time the epoch comes round to a
+// bucket again, what's in it is two epochs old
+struct limbo_t {
+  bucket_t buckets[3];
+  unsigned since_collect = 0;
+};
+
+} // namespace ebr
+
+namespace {
+
+// retires between attempts to move the epoch on
+constexpr unsigned collect_every = 64;
+
+struct registry_t {
+  std::mutex lock;
+  std::vector<thread_t*> threads;
+  limbo_t orphans;   // left behind by exited threads
+};
+
+registry_t& registry()
+{
+  // leaked: threads may exit during static destruction
+  static registry_t *r = new registry_t;
+  return *r;
+}
+
+mempool::pool_t& pending_pool()
+{
+  return mempool::get_pool(mempool::mempool_ebr);
+}
+
+// take the buckets that are two epochs behind; the caller frees them
+// with reclaim() once it holds no locks
+void collect(limbo_t *l, uint64_t epoch, std::vector<retired_t> *out)
+{
+  for (auto& b : l->buckets) {
+    if (b.items.empty() || b.epoch + 2 > epoch) {
+      continue;
+    }
+    out->insert(out->end(), b.items.begin(), b.items.end());
+    b.items.clear();
+  }
+}
+
+// deleters may retire, synchronize or take locks of their own
+void reclaim(std::vector<retired_t>& v)
+{
+  if (v.empty()) {
+    return;
+  }
+  ssize_t bytes = 0;
+  for (auto& r : v) {
+    r.deleter(r.p);
+    bytes += r.bytes;
+  }
+  pending_pool().adjust_count(-(ssize_t)v.size(), -bytes);
+  v.clear();
+}
+
+void add(limbo_t *l, uint64_t epoch, const retired_t& r,
+         std::vector<retired_t> *expired)
+{
+  bucket_t& b = l->buckets[epoch % 3];
+  if (b.epoch != epoch) {
+    // collect() emptied it unless it's two epochs old.  An exiting
+    // thread's items may be older than what's left, and the bucket goes
+    // when its newest item can
+    collect(l, epoch, expired);
+    b.epoch = b.items.empty() ? epoch : std::max(b.epoch, epoch);
+  }
+  b.items.push_back(r);
+}
+
+// move the global epoch on if every thread in a critical section is in
+// the current one
+bool try_advance()
+{
+  uint64_t e = global_epoch.load(std::memory_order_seq_cst);
+  auto& reg = registry();
+  std::vector<retired_t> expired;
+  {
+    std::lock_guard l(reg.lock);
+    for (auto t : reg.threads) {
+      uint64_t te = t->epoch.load(std::memory_order_seq_cst);
+      if ((te & 1) && (te >> 1) != e) {
+        return false;
+      }
+    }
+    if (!global_epoch.compare_exchange_strong(e, e + 1,
+                                              std::memory_order_seq_cst)) {
+      return true;   // someone else did it
+    }
+    collect(&reg.orphans, e + 1, &expired);
+  }
+  reclaim(expired);
+  return true;
+}
+
+// set by the exit hook.  thread_local destructors that run after it may
+// still read and retire: they get a record for each critical section,
+// and what they retire is orphaned straight away
+thread_local bool exited = false;
+
+// runs on thread exit; the user-provided constructor makes it
+// dynamically initialised, so its destructor is registered on first use
+struct exit_hook_t {
+  exit_hook_t() noexcept {}
+  void arm() {}
+  ~exit_hook_t() {
+    thread_t *t = current_thread;
+    if (!t) {
+      return;
+    }
+    auto& reg = registry();
+    std::vector<retired_t> expired;
+    {
+      std::lock_guard l(reg.lock);
+      for (auto& b : t->limbo->buckets) {
+        for (auto& r : b.items) {
+          add(&reg.orphans, b.epoch, r, &expired);
+        }
+        b.items.clear();
+      }
+      t->epoch = 0;
+      t->nesting = 0;
+      t->in_use = false;
+      current_thread = nullptr;
+      exited = true;
+    }
+    reclaim(expired);
+  }
+};
+
+thread_local exit_hook_t exit_hook;
+
+} // anonymous namespace
+
+thread_t *ebr::register_thread()
+{
+  if (!exited) {
+    exit_hook.arm();
+  }
+  auto& reg = registry();
+  std::lock_guard l(reg.lock);
+  thread_t *t = nullptr;
+  for (auto i : reg.threads) {
+    if (!i->in_use) {
+      t = i;
+      break;
+    }
+  }
+  if (!t) {
+    t = new thread_t;
+    t->limbo = new limbo_t;
+    reg.threads.push_back(t);
+  }
+  t->in_use = true;
+  t->late = exited;
+  return t;
+}
+
+void ebr::release_late(thread_t *t)
+{
+  auto& reg = registry();
+  std::lock_guard l(reg.lock);
+  t->late = false;
+  t->in_use = false;
+  current_thread = nullptr;
+}
+
+void ebr::retire(void *p, void (*deleter)(void*), size_t bytes)
+{
+  pending_pool().adjust_count(1, bytes);
+  std::vector<retired_t> expired;
+  if (unlikely(exited)) {
+    {
+      auto& reg = registry();
+      std::lock_guard l(reg.lock);
+      add(&reg.orphans, global_epoch.load(std::memory_order_seq_cst),
+          retired_t{p, deleter, bytes}, &expired);
+    }
+    reclaim(expired);
+    return;
+  }
+  thread_t *t = get_thread();
+  add(t->limbo, global_epoch.load(std::memory_order_seq_cst),
+      retired_t{p, deleter, bytes}, &expired);
+  if (++t->limbo->since_collect >= collect_every) {
+    t->limbo->since_collect = 0;
+    try_advance();
+    collect(t->limbo, global_epoch.load(std::memory_order_acquire), &expired);
+  }
+  reclaim(expired);
+}
+
+void ebr::synchronize()
+{
+  uint64_t target = global_epoch.load(std::memory_order_seq_cst) + 2;
+  while (global_epoch.load(std::memory_order_seq_cst) < target) {
+    if (!try_advance()) {
+      std::this_thread::yield();
+    }
+  }
+  std::vector<retired_t> expired;
+  if (likely(!exited)) {
+    collect(get_thread()->limbo, global_epoch.load(std::memory_order_acquire),
+            &expired);
+  }
+  {
+    auto& reg = registry();
+    std::lock_guard l(reg.lock);
+    collect(&reg.orphans, global_epoch.load(std::memory_order_acquire),
+            &expired);
+  }
+  reclaim(expired);
+}
+
+void ebr::get_pending(size_t *items, size_t *bytes)
+{
+  *items = pending_pool().allocated_items();
+  *bytes = pending_pool().allocated_bytes();
+}
@@ -0,0 +1,162 @@
+#ifndef EBR_H
+#define EBR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "likely.h"
+
+namespace ebr {
+
+/**
+ * Epoch-based reclamation.
+ *
+ * Readers bracket their accesses with enter()/exit() (or a guard_t):
+ * that publishes the global epoch they saw in a per-thread slot, with
+ * no shared writes.  Writers unlink an object and retire() it; it is
+ * freed once every thread in a critical section has seen the epoch move
+ * on twice, so no reader can still hold it.  Freeing happens in batches
+ * on the retiring thread, and synchronize() forces it.
+ *
+ * Critical sections nest and must not block for long: a stalled reader
+ * holds back every retired object.  Memory waiting to be freed is
+ * counted in mempool::mempool_ebr.  thread_local destructors may still
+ * read and retire after the thread's own ebr state is torn down.
+ */
+
+extern std::atomic<uint64_t> global_epoch;
+
+struct limbo_t;
+
+struct thread_t {
+  // epoch seen on entry << 1 | 1 while in a critical section, else 0
+  alignas(64) std::atomic<uint64_t> epoch = {0};
+  unsigned nesting = 0;
+  limbo_t *limbo = nullptr;    // retired by this thread, by epoch
+  bool in_use = false;         // records of exited threads are reused
+  bool late = false;           // taken after thread exit, for one section
+};
+
+thread_t *register_thread();
+void release_late(thread_t *t);
+
+inline thread_local thread_t *current_thread = nullptr;
+
+inline thread_t *get_thread() {
+  if (unlikely(!current_thread)) {
+    current_thread = register_thread();
+  }
+  return current_thread;
+}
+
+inline void enter(thread_t *t) {
+  if (t->nesting++ == 0) {
+    t->epoch.store(global_epoch.load(std::memory_order_relaxed) << 1 | 1,
+                   std::memory_order_relaxed);
+    // the epoch we're in must be visible before we read anything shared
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+inline void exit(thread_t *t) {
+  if (--t->nesting == 0) {
+    t->epoch.store(0, std::memory_order_release);
+    if (unlikely(t->late)) {
+      release_late(t);
+    }
+  }
+}
+
+inline void enter() {
+  enter(get_thread());
+}
+inline void exit() {
+  exit(get_thread());
+}
+
+class guard_t {
+  thread_t *t;
+public:
+  guard_t() : t(get_thread()) {
+    enter(t);
+  }
+  ~guard_t() {
+    exit(t);
+  }
+  guard_t(const guard_t&) = delete;
+  guard_t& operator=(const guard_t&) = delete;
+};
+
+/// free p with deleter once no reader can see it; bytes is what it pins
+void retire(void *p, void (*deleter)(void*), size_t bytes);
+
+template <class T>
+void retire(T *p, size_t bytes = sizeof(T)) {
+  retire(p, [](void *q) { delete static_cast<T*>(q); }, bytes);
+}
+
+/// wait until everything retired so far, by any thread, can be freed,
+/// and free the caller's.  Not from inside a critical section.
+void synchronize();
+
+/// objects and bytes waiting to be freed
+void get_pending(size_t *items, size_t *bytes);
+
+} // namespace ebr
+
+/**
+ * Pointer to an immutable snapshot, replaced wholesale.
+ *
+ * Readers get() inside an ebr critical section and never block or
+ * write shared memory; writers publish a new snapshot and the old one
+ * is retired.  Good for configuration and placement maps.
+ */
+template <class T>
+class rcu_ptr {
+  std::atomic<T*> p;
+
+public:
+  explicit rcu_ptr(std::unique_ptr<T> init = nullptr) : p(init.release()) {}
+  ~rcu_ptr() {
+    // no readers may be left by now
+    delete p.load(std::memory_order_relaxed);
+  }
+  rcu_ptr(const rcu_ptr&) = delete;
+  rcu_ptr& operator=(const rcu_ptr&) = delete;
+
+  /// valid until the enclosing critical section ends
+  const T *get() const {
+    return p.load(std::memory_order_acquire);
+  }
+
+  /// publish next; bytes is what the old snapshot pins
+  void update(std::unique_ptr<T> next, size_t bytes = sizeof(T)) {
+    T *old = p.exchange(next.release(), std::memory_order_acq_rel);
+    if (old) {
+      ebr::retire(old, bytes);
+    }
+  }
+
+  /// copy, change and publish, retrying if another writer got in first
+  template <class F>
+  void modify(F&& f, size_t bytes = sizeof(T)) {
+    ebr::guard_t g;
+    T *cur = p.load(std::memory_order_acquire);
+    for (;;) {
+      auto next = cur ? std::make_unique<T>(*cur) : std::make_unique<T>();
+      f(*next);
+      if (p.compare_exchange_weak(cur, next.get(), std::memory_order_acq_rel,
+                                  std::memory_order_acquire)) {
+        next.release();
+        if (cur) {
+          ebr::retire(cur, bytes);
+        }
+        return;
+      }
+    }
+  }
+};
+
+#endif // EBR_H
@@ -4,6 +4,7 @@
 #include <set>
 #include <map>
 #include <deque>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <string_view>
@@ -1308,6 +1309,123 @@ decode(std::array<T, N>& v, bufferlist::const_iterator& p)
     decode(e, p);
 }
 
+// -----------------------------
+// cached_encoding
+//
+// Holds a value that is encoded many times without changing, e.g.
+// metadata broadcast to every peer.  The first encode() for a feature set
+// encodes into a single buffer::ptr; later ones append that ptr by
+// reference, sharing the raw.  Changes go through mutate() or a
+// get_mutable() guard, which hold the lock while the value changes and
+// drop the cache once it has, so no encode() can cache the old value.
+// Neither may encode this object while it holds the lock.
+
+template<class T>
+class cached_encoding {
+  T value;
+  mutable std::mutex lock;
+  mutable std::vector<std::pair<uint64_t, buffer::ptr>> cache;
+
+public:
+  class write_guard_t {
+    cached_encoding *c;
+    std::unique_lock<std::mutex> l;
+  public:
+    explicit write_guard_t(cached_encoding *c) : c(c), l(c->lock) {}
+    write_guard_t(write_guard_t&&) = default;
+    ~write_guard_t() {
+      if (l.owns_lock()) {
+        c->cache.clear();
+      }
+    }
+    T& operator*() {
+      return c->value;
+    }
+    T* operator->() {
+      return &c->value;
+    }
+  };
+
+  cached_encoding() = default;
+  explicit cached_encoding(T v) : value(std::move(v)) {}
+  cached_encoding(const cached_encoding& o) : value(o.value) {}
+  cached_encoding& operator=(const cached_encoding& o) {
+    if (this != &o) {
+      mutate([&o](T& v) { v = o.value; });
+    }
+    return *this;
+  }
+
+  const T& get() const {
+    return value;
+  }
+  /// locked, and invalidates once it goes out of scope
+  write_guard_t get_mutable() {
+    return write_guard_t(this);
+  }
+  template<typename F>
+  void mutate(F&& f) {
+    std::lock_guard l(lock);
+    f(value);
+    cache.clear();
+  }
+
+  void invalidate() {
+    std::lock_guard l(lock);
+    cache.clear();
+  }
+
+  /// the encoding of value for features, encoding it if not cached
+  buffer::ptr encoded(uint64_t features) const {
+    std::lock_guard l(lock);
+    for (auto& [f, bp] : cache) {
+      if (f == features) {
+        return bp;
+      }
+    }
+    using ::encode;
+    using common::encode;
+    bufferlist bl;
+    encode(value, bl, features);
+    if (bl.get_num_buffers() != 1 || bl.get_wasted_space() > 0) {
+      // the cached copy is long-lived; don't pin a half-empty
+      // append buffer.
+      bl.rebuild();
+    }
+    cache.emplace_back(features,
+                       bl.length() ? buffer::ptr(bl.front()) : buffer::ptr());
+    return cache.back().second;
+  }
+
+  bool is_cached(uint64_t features) const {
+    std::lock_guard l(lock);
+    for (auto& i : cache) {
+      if (i.first == features) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+template<class T>
+inline void encode(const cached_encoding<T>& c, bufferlist& bl,
+                   uint64_t features=0)
+{
+  auto bp = c.encoded(features);
+  if (bp.length()) {
+    bl.append(std::move(bp));
+  }
+}
+template<class T>
+inline void decode(cached_encoding<T>& c, bufferlist::const_iterator& p)
+{
+  using ::decode;
+  using common::decode;
+  auto v = c.get_mutable();
+  decode(*v, p);
+}
+
 }
 
 /*
@@ -0,0 +1,24 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Process private futex calls on a 32-bit atomic.
+
+// sleep while *addr == val; spurious wakeups are possible
+inline void futex_wait(std::atomic<uint32_t> *addr, uint32_t val,
+                       const struct timespec *timeout = nullptr) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t> *addr, int n = 1) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+}
+
+#endif // FUTEX_H
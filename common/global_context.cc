@@ -4,6 +4,7 @@
 #include "global_definition.h"
 #include "code_environment.h"
 #include "global_context.h"
+#include "perf_counters.h"
 
 using namespace std;
 
@@ -34,6 +35,10 @@ void InitGlobalContext(const std::map<std::string, std::string> &args)
   map<string, string> cfg = {
     { KEY_LOG_PATH, log_file_path }
   };
+  it = args.find(KEY_PERF_PREFIX);
+  if (it != args.end()) {
+    cfg[KEY_PERF_PREFIX] = it->second;
+  }
 
   g_context = new GlobalContext(cfg);
 }
@@ -53,4 +58,20 @@ GlobalContext::GlobalContext(const std::map<std::string, std::string>& cfg)
 {
   string log = cfg.find(KEY_LOG_PATH)->second;
   init_logger(log);
+  auto it = cfg.find(KEY_PERF_PREFIX);
+  if (it != cfg.end()) {
+    perf_prefix = it->second;
+  }
+}
+
+void GlobalContext::dump_perf_counters(Formatter *f) const
+{
+  f->open_object_section("perf_counters");
+  perf::dump(f);
+  f->close_section();
+}
+
+void GlobalContext::dump_perf_counters(std::ostream& out) const
+{
+  perf::dump_prometheus(out, perf_prefix);
 }
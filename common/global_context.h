@@ -6,8 +6,11 @@
 #include <spdlog/sinks/rotating_file_sink.h>
 
 #include <map>
+#include <ostream>
 #include <boost/noncopyable.hpp>
 
+class Formatter;
+
 class GlobalContext;
 
 extern GlobalContext *g_context;
@@ -19,7 +22,12 @@ public:
 private:
   void init_logger(const std::string& log_path);
 public:
+  /// perf counters, as JSON (or whatever f is) or Prometheus text
+  void dump_perf_counters(Formatter *f) const;
+  void dump_perf_counters(std::ostream& out) const;
+
   std::shared_ptr<spdlog::logger> logger = nullptr;
+  std::string perf_prefix;   // prepended to Prometheus metric names
 };
 
 void InitGlobalContext(const std::map<std::string, std::string>& args);
@@ -10,6 +10,7 @@ typedef unsigned uint128_t __attribute__ ((mode (TI)));
  */
 #define KEY_LOG_DIR   "log_dir"
 #define KEY_LOG_PATH  "log_path"
+#define KEY_PERF_PREFIX "perf_prefix"
 
 /**
  * 默认配置
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include <execinfo.h>
+
+#include "backtrace.h"
+#include "environment.h"
+#include "heap_profiler.h"
+
+using namespace mempool;
+
+std::atomic<bool> mempool::heap_profiling = {false};
+std::atomic<size_t> mempool::heap_profile_rate = {0};
+std::atomic<uint32_t> mempool::heap_sample_filter[1 << heap_sample_filter_bits];
+
+namespace {
+
+// countdown while profiling is off, so threads notice it being enabled
+constexpr int64_t heap_recheck = 1ll << 30;
+constexpr int max_frames = 32;
+// heap_profile_alloc itself; heap_profile_note_alloc is always inlined
+constexpr int skip_frames = 1;
+
+struct site_counts_t {
+  size_t live_bytes = 0;
+  size_t live_objects = 0;
+  size_t alloc_bytes = 0;
+  size_t alloc_objects = 0;
+};
+
+// frees take back the live counts holding only their shard's lock
+struct site_t {
+  std::atomic<size_t> live_bytes = {0};
+  std::atomic<size_t> live_objects = {0};
+  size_t alloc_bytes = 0;
+  size_t alloc_objects = 0;
+
+  site_counts_t counts() const {
+    return site_counts_t{live_bytes, live_objects, alloc_bytes, alloc_objects};
+  }
+};
+
+typedef std::pair<pool_index_t, std::vector<void*>> site_key_t;
+typedef std::pair<pool_index_t, const void*> sample_key_t;
+
+struct sample_key_hash {
+  size_t operator()(const sample_key_t& k) const {
+    return std::hash<const void*>()(k.second) ^ k.first;
+  }
+};
+
+struct sample_t {
+  site_t *site;
+  size_t bytes;
+  size_t objects;
+
+  void take_back() const {
+    site->live_bytes -= bytes;
+    site->live_objects -= objects;
+  }
+};
+
+// live samples, sharded by address so that frees of sampled pointers
+// on different threads rarely meet; a move stays in its shard
+constexpr int shard_bits = 6;
+
+struct alignas(64) shard_t {
+  std::mutex lock;
+  std::unordered_map<sample_key_t, sample_t, sample_key_hash> live;
+};
+
+// the sites lock is taken before any shard lock
+struct profiler_t {
+  std::mutex lock;
+  std::map<site_key_t, site_t> sites;
+  shard_t shards[1 << shard_bits];
+
+  shard_t& shard(const void *p) {
+    return shards[heap_sample_slot(p) >>
+                  (heap_sample_filter_bits - shard_bits)];
+  }
+};
+
+profiler_t& profiler()
+{
+  // leaked: frees keep arriving during static destruction
+  static profiler_t *p = new profiler_t;
+  return *p;
+}
+
+std::vector<std::pair<site_key_t, site_counts_t>> get_sites()
+{
+  auto& prof = profiler();
+  std::lock_guard l(prof.lock);
+  std::vector<std::pair<site_key_t, site_counts_t>> sites;
+  sites.reserve(prof.sites.size());
+  for (auto& [key, site] : prof.sites) {
+    sites.emplace_back(key, site.counts());
+  }
+  return sites;
+}
+
+} // anonymous namespace
+
+void mempool::heap_profile_alloc(pool_index_t ix, const void *p, size_t bytes)
+{
+  size_t rate = heap_profile_rate.load(std::memory_order_relaxed);
+  if (!heap_profiling.load(std::memory_order_relaxed) || !rate) {
+    heap_sample_countdown = heap_recheck;
+    return;
+  }
+  heap_sample_countdown = sample_interval(rate);
+
+  void *frames[max_frames];
+  int n = backtrace(frames, max_frames);
+  int skip = std::min(n, skip_frames);
+  site_key_t key(ix, std::vector<void*>(frames + skip, frames + n));
+
+  // an allocation of b bytes is sampled with probability 1 - exp(-b/rate)
+  double w = 1.0 / -std::expm1(-(double)bytes / rate);
+  size_t est_bytes = bytes * w;
+  size_t est_objects = std::max<size_t>(1, std::lround(w));
+
+  auto& prof = profiler();
+  std::lock_guard l(prof.lock);
+  site_t& site = prof.sites[key];
+  site.live_bytes += est_bytes;
+  site.live_objects += est_objects;
+  site.alloc_bytes += est_bytes;
+  site.alloc_objects += est_objects;
+  sample_t s{&site, est_bytes, est_objects};
+  auto& shard = prof.shard(p);
+  std::lock_guard sl(shard.lock);
+  auto [i, fresh] = shard.live.try_emplace(sample_key_t(ix, p), s);
+  if (fresh) {
+    ++heap_sample_filter[heap_sample_slot(p)];
+  } else {
+    // freed behind our back, e.g. by a path without the free hook
+    i->second.take_back();
+    i->second = s;
+  }
+}
+
+void mempool::heap_profile_free(pool_index_t ix, const void *p)
+{
+  auto& shard = profiler().shard(p);
+  std::lock_guard l(shard.lock);
+  auto i = shard.live.find(sample_key_t(ix, p));
+  if (i == shard.live.end()) {
+    return;
+  }
+  i->second.take_back();
+  shard.live.erase(i);
+  --heap_sample_filter[heap_sample_slot(p)];
+}
+
+void mempool::heap_profile_move(pool_index_t from, pool_index_t to,
+                                const void *p)
+{
+  auto& shard = profiler().shard(p);
+  std::lock_guard l(shard.lock);
+  auto i = shard.live.find(sample_key_t(from, p));
+  if (i == shard.live.end()) {
+    return;
+  }
+  // still charged to the site that allocated it
+  sample_t s = i->second;
+  shard.live.erase(i);
+  auto [j, fresh] = shard.live.try_emplace(sample_key_t(to, p), s);
+  if (!fresh) {
+    j->second.take_back();
+    j->second = s;
+    --heap_sample_filter[heap_sample_slot(p)];
+  }
+}
+
+void mempool::set_heap_profile_rate(size_t rate)
+{
+  auto& prof = profiler();
+  std::lock_guard l(prof.lock);
+  heap_profile_rate.store(rate, std::memory_order_relaxed);
+  heap_profiling.store(rate > 0, std::memory_order_relaxed);
+  if (rate) {
+    heap_sample_countdown = sample_interval(rate);
+    return;
+  }
+  heap_sample_countdown = heap_recheck;
+  for (auto& shard : prof.shards) {
+    std::lock_guard sl(shard.lock);
+    shard.live.clear();
+  }
+  prof.sites.clear();
+  for (auto& f : heap_sample_filter) {
+    f = 0;
+  }
+}
+
+static struct heap_profile_init_t {
+  heap_profile_init_t() {
+    if (int rate = get_env_int("MEMPOOL_HEAP_PROFILE"); rate > 0) {
+      mempool::set_heap_profile_rate(rate);
+    }
+  }
+} heap_profile_init;
+
+void mempool::get_heap_profile_stats(pool_index_t ix,
+                                     heap_profile_stats_t *stats)
+{
+  for (auto& [key, site] : get_sites()) {
+    if (key.first != ix) {
+      continue;
+    }
+    stats->sites++;
+    stats->live_bytes += site.live_bytes;
+    stats->live_objects += site.live_objects;
+    stats->alloc_bytes += site.alloc_bytes;
+    stats->alloc_objects += site.alloc_objects;
+  }
+}
+
+void mempool::dump_heap_profile(Formatter *f)
+{
+  auto sites = get_sites();
+  std::sort(sites.begin(), sites.end(), [](auto& a, auto& b) {
+    return a.second.live_bytes > b.second.live_bytes;
+  });
+
+  f->dump_unsigned("rate", heap_profile_rate);
+  f->open_array_section("sites");
+  for (auto& [key, site] : sites) {
+    f->open_object_section("site");
+    f->dump_string("pool", get_pool_name(key.first));
+    f->dump_unsigned("live_bytes", site.live_bytes);
+    f->dump_unsigned("live_objects", site.live_objects);
+    f->dump_unsigned("alloc_bytes", site.alloc_bytes);
+    f->dump_unsigned("alloc_objects", site.alloc_objects);
+    f->open_array_section("stack");
+    auto& frames = key.second;
+    char **names = backtrace_symbols(frames.data(), frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+      f->dump_string("frame", names ? ClibBackTrace::demangle(names[i]) : "?");
+    }
+    free(names);
+    f->close_section();
+    f->close_section();
+  }
+  f->close_section();
+}
+
+void mempool::dump_heap_profile_pprof(std::ostream& out)
+{
+  auto sites = get_sites();
+  site_counts_t total;
+  for (auto& [key, site] : sites) {
+    total.live_bytes += site.live_bytes;
+    total.live_objects += site.live_objects;
+    total.alloc_bytes += site.alloc_bytes;
+    total.alloc_objects += site.alloc_objects;
+  }
+  auto counts = [&out](const site_counts_t& s) {
+    out << s.live_objects << ": " << s.live_bytes << " ["
+        << s.alloc_objects << ": " << s.alloc_bytes << "] @";
+  };
+  // the counts are already scaled, so report them as unsampled
+  out << "heap profile: ";
+  counts(total);
+  out << " heapprofile\n";
+  for (auto& [key, site] : sites) {
+    counts(site);
+    for (void *frame : key.second) {
+      out << " " << frame;
+    }
+    out << "\n";
+  }
+  out << "\nMAPPED_LIBRARIES:\n";
+  std::ifstream maps("/proc/self/maps");
+  out << maps.rdbuf();
+}
@@ -0,0 +1,46 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+
+#include <ostream>
+
+#include "formatter.h"
+#include "mempool.h"
+
+namespace mempool {
+
+/**
+ * Sampling heap profiler for pool_allocator and buffer::raw.
+ *
+ * On average one allocation per `rate` bytes is sampled: its stack is
+ * captured with backtrace(3) and charged, scaled to an unbiased estimate,
+ * to its call site until it is freed.  Sampling points are exponentially
+ * distributed so periodic allocation patterns are not aliased.
+ *
+ * Threads pick up a new rate the next time their countdown runs out; the
+ * thread calling set_heap_profile_rate() picks it up at once.
+ */
+extern std::atomic<size_t> heap_profile_rate;
+
+/// start sampling every `rate` bytes on average; 0 stops and forgets
+/// all samples.  Defaults to $MEMPOOL_HEAP_PROFILE, or off.
+void set_heap_profile_rate(size_t rate);
+
+struct heap_profile_stats_t {
+  size_t sites = 0;
+  size_t live_bytes = 0;     // estimates
+  size_t live_objects = 0;
+  size_t alloc_bytes = 0;    // since profiling started
+  size_t alloc_objects = 0;
+};
+
+void get_heap_profile_stats(pool_index_t ix, heap_profile_stats_t *stats);
+
+/// call sites by live bytes, with symbolized stacks
+void dump_heap_profile(Formatter *f);
+
+/// legacy gperftools heap profile, readable by pprof
+void dump_heap_profile_pprof(std::ostream& out);
+
+} // namespace mempool
+
+#endif // HEAP_PROFILER_H
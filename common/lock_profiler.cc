@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "environment.h"
+#include "lock_profiler.h"
+
+using namespace lockprof;
+
+std::atomic<bool> lockprof::enabled = {false};
+
+namespace {
+
+// owned by one thread; others only read, so plain relaxed bumps do
+struct counters_t {
+  std::atomic<uint64_t> acquisitions = {0};
+  std::atomic<uint64_t> contended = {0};
+  std::atomic<uint64_t> wait_ns = {0};
+  std::atomic<uint64_t> hold_ns = {0};
+  std::atomic<uint64_t> hold_hist[hold_buckets] = {};
+};
+
+struct thread_table_t {
+  counters_t counters[max_locks];
+};
+
+struct registry_t {
+  std::mutex lock;
+  std::map<std::string, uint32_t> ids;
+  std::vector<std::string> names = {""};   // id 0 is "not profiled"
+  std::set<thread_table_t*> threads;
+  lock_stats_t retired[max_locks];
+};
+
+registry_t& registry()
+{
+  // leaked: locks are registered and threads exit during static init/fini
+  static registry_t *r = new registry_t;
+  return *r;
+}
+
+std::atomic<double> ns_per_tick = {1.0};
+
+void calibrate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  auto t0 = std::chrono::steady_clock::now();
+  uint64_t c0 = ticks();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  uint64_t c1 = ticks();
+  auto t1 = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+  if (c1 > c0) {
+    ns_per_tick.store(ns / (c1 - c0), std::memory_order_relaxed);
+  }
+#endif
+}
+
+// set_enabled() stores with release, after calibrating, so a thread
+// that has seen it sees the calibration
+double tick_ns()
+{
+  (void)enabled.load(std::memory_order_acquire);
+  return ns_per_tick.load(std::memory_order_relaxed);
+}
+
+inline void bump(std::atomic<uint64_t>& c, uint64_t v)
+{
+  c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+void add(lock_stats_t *s, const counters_t& c)
+{
+  s->acquisitions += c.acquisitions.load(std::memory_order_relaxed);
+  s->contended += c.contended.load(std::memory_order_relaxed);
+  s->wait_ns += c.wait_ns.load(std::memory_order_relaxed);
+  s->hold_ns += c.hold_ns.load(std::memory_order_relaxed);
+  for (unsigned b = 0; b < hold_buckets; ++b) {
+    s->hold_hist[b] += c.hold_hist[b].load(std::memory_order_relaxed);
+  }
+}
+
+// set once this thread's table is retired; thread_local dtors that run
+// later (e.g. the slab thread cache draining) may still take profiled locks
+thread_local bool thread_stats_gone = false;
+
+struct thread_stats_t {
+  thread_table_t *table = nullptr;
+
+  thread_table_t *get() {
+    if (unlikely(!table)) {
+      table = new thread_table_t;
+      auto& r = registry();
+      std::lock_guard l(r.lock);
+      r.threads.insert(table);
+    }
+    return table;
+  }
+
+  ~thread_stats_t() {
+    if (!table) {
+      return;
+    }
+    auto& r = registry();
+    std::lock_guard l(r.lock);
+    for (unsigned id = 0; id < max_locks; ++id) {
+      add(&r.retired[id], table->counters[id]);
+    }
+    r.threads.erase(table);
+    delete table;
+    table = nullptr;
+    thread_stats_gone = true;
+  }
+};
+
+thread_local thread_stats_t thread_stats;
+
+} // anonymous namespace
+
+void lockprof::set_enabled(bool on)
+{
+  static std::once_flag calibrated;
+  if (on) {
+    std::call_once(calibrated, calibrate);
+  }
+  enabled.store(on, std::memory_order_release);
+}
+
+uint32_t lockprof::register_lock(const char *name)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  auto [i, fresh] = r.ids.try_emplace(name, r.names.size());
+  if (fresh) {
+    if (r.names.size() == max_locks) {
+      r.ids.erase(i);
+      return 0;
+    }
+    r.names.push_back(name);
+  }
+  return i->second;
+}
+
+void lockprof::record_acquire(uint32_t id, bool contended, uint64_t wait_ticks)
+{
+  if (unlikely(thread_stats_gone)) {
+    return;
+  }
+  counters_t& c = thread_stats.get()->counters[id];
+  bump(c.acquisitions, 1);
+  if (contended) {
+    bump(c.contended, 1);
+    bump(c.wait_ns, wait_ticks * tick_ns());
+  }
+}
+
+void lockprof::record_hold(uint32_t id, uint64_t hold_ticks)
+{
+  if (unlikely(thread_stats_gone)) {
+    return;
+  }
+  counters_t& c = thread_stats.get()->counters[id];
+  uint64_t ns = hold_ticks * tick_ns();
+  bump(c.hold_ns, ns);
+  unsigned b = ns ? 64 - __builtin_clzll(ns) : 0;
+  bump(c.hold_hist[std::min(b, hold_buckets - 1)], 1);
+}
+
+void lockprof::get_stats(std::map<std::string, lock_stats_t> *stats)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  for (uint32_t id = 1; id < r.names.size(); ++id) {
+    lock_stats_t s = r.retired[id];
+    for (auto t : r.threads) {
+      add(&s, t->counters[id]);
+    }
+    (*stats)[r.names[id]] = s;
+  }
+}
+
+void lockprof::reset()
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  for (auto& s : r.retired) {
+    s = lock_stats_t();
+  }
+  // racing bumps from the owners may survive; good enough for a profile
+  for (auto t : r.threads) {
+    for (auto& c : t->counters) {
+      c.acquisitions = 0;
+      c.contended = 0;
+      c.wait_ns = 0;
+      c.hold_ns = 0;
+      for (auto& h : c.hold_hist) {
+        h = 0;
+      }
+    }
+  }
+}
+
+void lockprof::dump(Formatter *f)
+{
+  std::map<std::string, lock_stats_t> stats;
+  get_stats(&stats);
+  std::vector<std::pair<std::string, lock_stats_t>> ranked(stats.begin(),
+                                                           stats.end());
+  std::stable_sort(ranked.begin(), ranked.end(), [](auto& a, auto& b) {
+    return a.second.wait_ns > b.second.wait_ns;
+  });
+
+  f->dump_bool("enabled", enabled.load());
+  f->open_array_section("locks");
+  for (auto& [name, s] : ranked) {
+    f->open_object_section("lock");
+    f->dump_string("name", name);
+    f->dump_unsigned("acquisitions", s.acquisitions);
+    f->dump_unsigned("contended", s.contended);
+    f->dump_float("contention_ratio",
+                  s.acquisitions ? (double)s.contended / s.acquisitions : 0);
+    f->dump_unsigned("wait_ns", s.wait_ns);
+    f->dump_unsigned("avg_wait_ns", s.contended ? s.wait_ns / s.contended : 0);
+    f->dump_unsigned("hold_ns", s.hold_ns);
+    f->dump_unsigned("avg_hold_ns",
+                     s.acquisitions ? s.hold_ns / s.acquisitions : 0);
+    f->open_array_section("hold_histogram");
+    for (unsigned b = 0; b < hold_buckets; ++b) {
+      if (!s.hold_hist[b]) {
+        continue;
+      }
+      f->open_object_section("bucket");
+      f->dump_unsigned("lt_ns", 1ull << b);
+      f->dump_unsigned("count", s.hold_hist[b]);
+      f->close_section();
+    }
+    f->close_section();
+    f->close_section();
+  }
+  f->close_section();
+}
+
+static struct lock_profile_init_t {
+  lock_profile_init_t() {
+    if (get_env_bool("LOCK_PROFILE")) {
+      lockprof::set_enabled(true);
+    }
+  }
+} lock_profile_init;
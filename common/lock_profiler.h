@@ -0,0 +1,124 @@
+#ifndef LOCK_PROFILER_H
+#define LOCK_PROFILER_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "formatter.h"
+#include "likely.h"
+#include "spinlock.h"
+
+namespace lockprof {
+
+/**
+ * Lock contention profiler.
+ *
+ * Locks opt in by being a profiled_lock<> with a name; locks sharing a
+ * name are profiled as one.  While profiling is on, each acquisition
+ * is timed with the cpu timestamp counter, and counted in a per-thread
+ * table, so the hot path takes no shared cachelines.  Tables of live and
+ * exited threads are summed when stats are read.
+ *
+ * Off by default; $LOCK_PROFILE=1 turns it on at startup.
+ */
+extern std::atomic<bool> enabled;
+
+constexpr unsigned max_locks = 256;     // distinct names
+constexpr unsigned hold_buckets = 32;   // log2 ns
+
+void set_enabled(bool on);
+
+/// id for name, shared by every lock of that name; 0 once full
+uint32_t register_lock(const char *name);
+
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void record_acquire(uint32_t id, bool contended, uint64_t wait_ticks);
+void record_hold(uint32_t id, uint64_t hold_ticks);
+
+struct lock_stats_t {
+  uint64_t acquisitions = 0;
+  uint64_t contended = 0;
+  uint64_t wait_ns = 0;
+  uint64_t hold_ns = 0;
+  uint64_t hold_hist[hold_buckets] = {};   // [i] counts holds < 2^i ns
+};
+
+void get_stats(std::map<std::string, lock_stats_t> *stats);
+
+/// forget everything counted so far
+void reset();
+
+/// locks ranked by total wait time
+void dump(Formatter *f);
+
+/**
+ * A lock that reports to the profiler.  Free of charge beyond a flag
+ * test while profiling is off.
+ */
+template <class Lock>
+class profiled_lock {
+  Lock l;
+  const uint32_t id;
+  uint64_t acquired_at = 0;   // written by the holder only
+
+public:
+  explicit profiled_lock(const char *name) : id(register_lock(name)) {}
+
+  void lock() {
+    if (likely(!enabled.load(std::memory_order_relaxed)) || !id) {
+      l.lock();
+      acquired_at = 0;
+      return;
+    }
+    uint64_t start = ticks();
+    bool contended = !l.try_lock();
+    if (contended) {
+      l.lock();
+    }
+    acquired_at = ticks();
+    record_acquire(id, contended, contended ? acquired_at - start : 0);
+  }
+
+  bool try_lock() {
+    if (!l.try_lock()) {
+      return false;
+    }
+    acquired_at = enabled.load(std::memory_order_relaxed) && id ? ticks() : 0;
+    if (acquired_at) {
+      record_acquire(id, false, 0);
+    }
+    return true;
+  }
+
+  void unlock() {
+    uint64_t since = acquired_at;
+    uint64_t now = since ? ticks() : 0;
+    l.unlock();
+    if (unlikely(since)) {
+      record_hold(id, now - since);
+    }
+  }
+};
+
+typedef profiled_lock<spinlock> profiled_spinlock;
+typedef profiled_lock<std::mutex> profiled_mutex;
+
+} // namespace lockprof
+
+#endif // LOCK_PROFILER_H
@@ -0,0 +1,139 @@
+#include <thread>
+
+#include <sched.h>
+
+#include "assertion.h"
+#include "futex.h"
+#include "mcs_lock.h"
+#include "numa.h"
+
+namespace {
+
+constexpr unsigned spin_budget = 4096;
+
+struct node_pool_t {
+  mcs_lock::node_t nodes[mcs_lock::max_held];
+  unsigned used = 0;   // bitmap
+
+  node_pool_t() {
+    for (int i = 0; i < mcs_lock::max_held; ++i) {
+      nodes[i].slot = i;
+    }
+  }
+};
+
+thread_local node_pool_t node_pool;
+
+// getcpu is a syscall; threads rarely move between nodes
+thread_local int cached_node = 0;
+thread_local unsigned node_recheck = 0;
+
+int local_node(int nodes)
+{
+  if (nodes == 1) {
+    return 0;
+  }
+  if (node_recheck-- == 0) {
+    cached_node = numa::current_node() % nodes;
+    node_recheck = 1024;
+  }
+  return cached_node;
+}
+
+bool single_cpu()
+{
+  static bool single = std::thread::hardware_concurrency() <= 1;
+  return single;
+}
+
+} // anonymous namespace
+
+mcs_lock::node_t *mcs_lock::get_node()
+{
+  unsigned free = ~node_pool.used & ((1u << max_held) - 1);
+  common_assert(free != 0);   // too many queued locks held
+  int slot = __builtin_ctz(free);
+  node_pool.used |= 1u << slot;
+  return &node_pool.nodes[slot];
+}
+
+void mcs_lock::put_node(node_t *n)
+{
+  node_pool.used &= ~(1u << n->slot);
+}
+
+void mcs_lock::wait_for(node_t *prev, node_t *n)
+{
+  prev->next.store(n, std::memory_order_release);
+  unsigned budget = single_cpu() ? 0 : spin_budget;
+  for (unsigned i = 0; i < budget; ++i) {
+    if (n->wait.load(std::memory_order_acquire) == 0) {
+      return;
+    }
+    cpu_relax();
+  }
+  uint32_t w = 1;
+  if (n->wait.compare_exchange_strong(w, 2, std::memory_order_acquire)) {
+    while (n->wait.load(std::memory_order_acquire) != 0) {
+      futex_wait(&n->wait, 2);
+    }
+  }
+}
+
+void mcs_lock::hand_off(node_t *n)
+{
+  // a successor swapped itself into the tail but may not have linked
+  // yet; if it was preempted in between, let it run
+  node_t *next;
+  unsigned budget = single_cpu() ? 0 : spin_budget;
+  for (unsigned i = 0; !(next = n->next.load(std::memory_order_acquire)); ++i) {
+    if (i < budget) {
+      cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+  if (next->wait.exchange(0, std::memory_order_release) == 2) {
+    futex_wake(&next->wait);
+  }
+}
+
+cohort_lock::cohort_lock(unsigned max_batch)
+  : max_batch(max_batch),
+    nodes(numa::num_nodes()),
+    cohorts(new cohort_t[nodes])
+{
+}
+
+void cohort_lock::lock()
+{
+  int c = local_node(nodes);
+  cohort_t& cohort = cohorts[c];
+  cohort.local.lock();
+  if (nodes == 1) {
+    return;
+  }
+  if (!cohort.global_owned) {
+    global.lock();
+    cohort.global_owned = true;
+    cohort.batch = 0;
+  }
+  owner_cohort = c;
+}
+
+void cohort_lock::unlock()
+{
+  cohort_t& cohort = cohorts[owner_cohort];
+  if (nodes == 1) {
+    cohort.local.unlock();
+    return;
+  }
+  if (cohort.local.has_waiters() && ++cohort.batch < max_batch) {
+    // pass the global lock along with the local one
+    cohort.local.unlock();
+    return;
+  }
+  cohort.global_owned = false;
+  global.unlock();
+  cohort.local.unlock();
+}
@@ -0,0 +1,120 @@
+#ifndef MCS_LOCK_H
+#define MCS_LOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "likely.h"
+#include "spinlock.h"
+
+/**
+ * MCS queued lock.
+ *
+ * Waiters queue up and each one spins on its own node rather than on
+ * the lock word, so a handoff touches one remote cacheline no matter
+ * how many cores are waiting, and the lock is granted in FIFO order.
+ * After a spin budget a waiter parks on a futex in its node.
+ *
+ * Queue nodes come from a small per-thread array, so lock()/unlock()
+ * have the usual signatures and work with std::lock_guard; a thread can
+ * hold up to max_held queued locks at once, in any unlock order.
+ */
+class mcs_lock final
+{
+public:
+  static constexpr int max_held = 8;
+
+  struct alignas(64) node_t {
+    std::atomic<node_t*> next = {nullptr};
+    // 1 waiting, 2 waiting and parked, 0 granted
+    std::atomic<uint32_t> wait = {0};
+    int slot = 0;
+  };
+
+  void lock() {
+    node_t *n = get_node();
+    n->next.store(nullptr, std::memory_order_relaxed);
+    n->wait.store(1, std::memory_order_relaxed);
+    node_t *prev = tail.exchange(n, std::memory_order_acq_rel);
+    if (unlikely(prev != nullptr)) {
+      wait_for(prev, n);
+    }
+    owner = n;
+  }
+
+  bool try_lock() {
+    node_t *n = get_node();
+    n->next.store(nullptr, std::memory_order_relaxed);
+    node_t *expected = nullptr;
+    if (!tail.compare_exchange_strong(expected, n, std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
+      put_node(n);
+      return false;
+    }
+    owner = n;
+    return true;
+  }
+
+  void unlock() {
+    node_t *n = owner;
+    node_t *expected = n;
+    if (!tail.compare_exchange_strong(expected, nullptr,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+      hand_off(n);
+    }
+    put_node(n);
+  }
+
+  bool is_locked() const {
+    return tail.load(std::memory_order_relaxed) != nullptr;
+  }
+
+  /// only meaningful to the holder: whether anyone is queued behind it
+  bool has_waiters() const {
+    return tail.load(std::memory_order_relaxed) != owner;
+  }
+
+private:
+  std::atomic<node_t*> tail = {nullptr};
+  node_t *owner = nullptr;   // written by the holder only
+
+  static node_t *get_node();
+  static void put_node(node_t *n);
+  void wait_for(node_t *prev, node_t *n);
+  void hand_off(node_t *n);
+};
+
+/**
+ * NUMA-aware cohort lock.
+ *
+ * Threads first take a queued lock for their node; the winner then
+ * takes a global lock, which is passed along the node's queue for up to
+ * max_batch acquisitions before being released to other nodes.  This
+ * keeps the protected data in one node's caches for longer at some cost
+ * in fairness.  With one node it behaves as an mcs_lock.
+ */
+class cohort_lock final
+{
+public:
+  explicit cohort_lock(unsigned max_batch = 64);
+
+  void lock();
+  void unlock();
+
+private:
+  struct alignas(64) cohort_t {
+    mcs_lock local;
+    bool global_owned = false;   // protected by local
+    unsigned batch = 0;
+  };
+
+  const unsigned max_batch;
+  const int nodes;
+  std::unique_ptr<cohort_t[]> cohorts;
+  spinlock global;          // may be released by a thread that didn't take it
+  int owner_cohort = 0;     // written by the holder only
+};
+
+#endif // MCS_LOCK_H
@@ -1,4 +1,13 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
 #include "demangle.h"
+#include "environment.h"
+#include "likely.h"
 #include "mempool.h"
 
 // default to debug_mode off
@@ -8,14 +17,122 @@ void mempool::set_debug_mode(bool d)
   debug_mode = d;
 }
 
+std::atomic<size_t> mempool::percpu_shards = {0};
+std::atomic<size_t> mempool::shards_in_use = {mempool::num_shards};
+std::atomic<unsigned> mempool::count_allocations = {0};
+
+void mempool::set_percpu_shards(bool on)
+{
+  size_t n = 0;
+  if (on) {
+    n = 1;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    while (n < (size_t)cpus && n < max_shards) {
+      n <<= 1;
+    }
+    // readers sum every shard that may have been touched
+    size_t used = shards_in_use.load();
+    while (used < n && !shards_in_use.compare_exchange_weak(used, n))
+      ;
+  }
+  percpu_shards = n;
+}
+
+static struct percpu_shards_init_t {
+  percpu_shards_init_t() {
+    if (get_env_bool("MEMPOOL_PERCPU")) {
+      mempool::set_percpu_shards(true);
+    }
+  }
+} percpu_shards_init;
+
+static size_t default_sample_rate()
+{
+  return getenv("MEMPOOL_SAMPLE_RATE") ?
+    std::max(get_env_int("MEMPOOL_SAMPLE_RATE"), 0) : 256 * 1024;
+}
+
+std::atomic<size_t> mempool::sample_rate = {default_sample_rate()};
+std::atomic<uint32_t> mempool::sample_filter[1 << sample_filter_bits];
+
+// countdown while sampling is off, so threads notice it being enabled
+static constexpr int64_t sample_recheck = 1ll << 30;
+
+namespace {
+
+struct sample_t {
+  mempool::type_t *type;
+  ssize_t items;
+  ssize_t bytes;
+};
+
+// live samples, sharded by address so that frees of sampled pointers
+// on different threads rarely meet
+constexpr int sampler_shard_bits = 6;
+
+struct alignas(64) sampler_t {
+  std::mutex lock;
+  std::unordered_map<const void*, sample_t> live;
+};
+
+sampler_t& sampler(const void *p)
+{
+  // leaked: frees keep arriving during static destruction
+  static sampler_t *s = new sampler_t[1 << sampler_shard_bits];
+  return s[mempool::heap_sample_slot(p) >>
+           (mempool::sample_filter_bits - sampler_shard_bits)];
+}
+
+thread_local uint64_t rng_state = 0;
+
+} // anonymous namespace
+
+int64_t mempool::sample_interval(size_t rate)
+{
+  uint64_t& x = rng_state;
+  if (!x) {
+    x = (uintptr_t)&x ^ 0x2545f4914f6cdd1dull;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  // uniform in (0, 1]
+  double u = ((x >> 11) + 1) * (1.0 / (1ull << 53));
+  return std::max<int64_t>(1, -std::log(u) * rate);
+}
+
+void mempool::set_sample_rate(size_t n)
+{
+  sample_rate.store(n, std::memory_order_relaxed);
+  sample_countdown = n ? sample_interval(n) : sample_recheck;
+}
+
 // --------------------------------------------------------------
 
+static void init_slab_from_env(mempool::pool_t *table)
+{
+  const char *env = getenv("MEMPOOL_SLAB");
+  if (!env) {
+    return;
+  }
+  std::string pools = std::string(",") + env + ",";
+  for (size_t i = 0; i < mempool::num_pools; ++i) {
+    auto ix = (mempool::pool_index_t)i;
+    std::string name = std::string(",") + mempool::get_pool_name(ix) + ",";
+    if (pools == ",all," || pools.find(name) != std::string::npos) {
+      table[i].set_slab(ix, true);
+    }
+  }
+}
+
 mempool::pool_t& mempool::get_pool(mempool::pool_index_t ix)
 {
   // We rely on this array being initialized before any invocation of
   // this function, even if it is called by ctors in other compilation
   // units that are being initialized before this compilation unit.
   static mempool::pool_t table[num_pools];
+  static bool slab_init = (init_slab_from_env(table), true);
+  (void)slab_init;
   return table[ix];
 }
 
@@ -55,7 +172,7 @@ void mempool::dump(Formatter *f)
 size_t mempool::pool_t::allocated_bytes() const
 {
   ssize_t result = 0;
-  for (size_t i = 0; i < num_shards; ++i) {
+  for (size_t i = 0, n = shards_in_use; i < n; ++i) {
     result += shard[i].bytes;
   }
   if (result < 0) {
@@ -68,7 +185,7 @@ size_t mempool::pool_t::allocated_bytes() const
 size_t mempool::pool_t::allocated_items() const
 {
   ssize_t result = 0;
-  for (size_t i = 0; i < num_shards; ++i) {
+  for (size_t i = 0, n = shards_in_use; i < n; ++i) {
     result += shard[i].items;
   }
   if (result < 0) {
@@ -78,28 +195,155 @@ size_t mempool::pool_t::allocated_items() const
   return (size_t) result;
 }
 
+size_t mempool::pool_t::allocated_total() const
+{
+  size_t result = 0;
+  for (size_t i = 0, n = shards_in_use; i < n; ++i) {
+    result += shard[i].allocated;
+  }
+  return result;
+}
+
 void mempool::pool_t::adjust_count(ssize_t items, ssize_t bytes)
 {
   shard_t *shard = pick_a_shard();
   shard->items += items;
   shard->bytes += bytes;
+  if (items > 0) {
+    note_allocated(shard, items);
+  }
+}
+
+mempool::type_t *mempool::pool_t::get_type(const std::type_info& ti,
+                                           size_t size)
+{
+  type_t *head = types.load(std::memory_order_acquire);
+  for (type_t *t = head; t; t = t->next) {
+    if (strcmp(t->type_name, ti.name()) == 0) {
+      return t;
+    }
+  }
+  type_t *n = new type_t;
+  n->type_name = ti.name();
+  n->item_size = size;
+  type_t *scanned = head;
+  for (;;) {
+    n->next = head;
+    if (types.compare_exchange_weak(head, n, std::memory_order_release,
+                                    std::memory_order_acquire)) {
+      return n;
+    }
+    // somebody else appended; they may have registered the same type
+    for (type_t *t = head; t != scanned; t = t->next) {
+      if (strcmp(t->type_name, ti.name()) == 0) {
+        delete n;
+        return t;
+      }
+    }
+    scanned = head;
+  }
+}
+
+void mempool::pool_t::sample_alloc(type_t *t, const void *p, size_t items,
+                                   size_t bytes)
+{
+  size_t rate = sample_rate.load(std::memory_order_relaxed);
+  if (!rate) {
+    sample_countdown = sample_recheck;
+    return;
+  }
+  sample_countdown = sample_interval(rate);
+
+  // an allocation of b bytes is sampled with probability 1 - exp(-b/rate)
+  double w = 1.0 / -std::expm1(-(double)bytes / rate);
+  sample_t s{t, std::llround(items * w), std::llround(bytes * w)};
+
+  auto& smp = sampler(p);
+  std::lock_guard l(smp.lock);
+  auto [i, fresh] = smp.live.try_emplace(p, s);
+  if (fresh) {
+    ++sample_filter[heap_sample_slot(p)];
+  } else {
+    // freed behind our back, e.g. by a path without the free hook
+    i->second.type->sampled_items -= i->second.items;
+    i->second.type->sampled_bytes -= i->second.bytes;
+    i->second = s;
+  }
+  t->sampled_items += s.items;
+  t->sampled_bytes += s.bytes;
+}
+
+void mempool::pool_t::sample_free(const void *p)
+{
+  auto& smp = sampler(p);
+  std::lock_guard l(smp.lock);
+  auto i = smp.live.find(p);
+  if (i == smp.live.end()) {
+    return;
+  }
+  i->second.type->sampled_items -= i->second.items;
+  i->second.type->sampled_bytes -= i->second.bytes;
+  smp.live.erase(i);
+  --sample_filter[heap_sample_slot(p)];
 }
 
 void mempool::pool_t::get_stats(stats_t *total,
                                 std::map<std::string, stats_t> *by_type) const
 {
-  for (size_t i = 0; i < num_shards; ++i) {
+  for (size_t i = 0, n = shards_in_use; i < n; ++i) {
     total->items += shard[i].items;
     total->bytes += shard[i].bytes;
   }
   if (debug_mode) {
-    std::lock_guard shard_lock(lock);
-    for (auto &p : type_map) {
-      std::string n = cpputils_demangle(p.second.type_name);
+    for (type_t *t = types.load(std::memory_order_acquire); t; t = t->next) {
+      std::string n = cpputils_demangle(t->type_name);
       stats_t &s = (*by_type)[n];
-      s.bytes = p.second.items * p.second.item_size;
-      s.items = p.second.items;
+      s.bytes = t->items * t->item_size;
+      s.items = t->items;
+    }
+  }
+}
+
+void mempool::pool_t::get_sampled_stats(
+  std::map<std::string, stats_t> *by_type) const
+{
+  for (type_t *t = types.load(std::memory_order_acquire); t; t = t->next) {
+    if (!t->sampled_items && !t->sampled_bytes) {
+      continue;
     }
+    std::string n = cpputils_demangle(t->type_name);
+    stats_t &s = (*by_type)[n];
+    s.items += t->sampled_items;
+    s.bytes += t->sampled_bytes;
+  }
+}
+
+bool mempool::pool_t::set_slab(pool_index_t ix, bool on)
+{
+  std::lock_guard l(lock);
+  if (on == (active_slab.load() != nullptr)) {
+    return true;
+  }
+  if (allocated_items() != 0) {
+    return false;
+  }
+  if (on && !slab.load()) {
+    slab.store(slab_t::create(ix), std::memory_order_release);
+  }
+  // release: a thread that sees the pointer sees the slab constructed
+  active_slab.store(on ? slab.load() : nullptr, std::memory_order_release);
+  return true;
+}
+
+void mempool::pool_t::adjust_node_bytes(int node, ssize_t bytes)
+{
+  if (node >= 0) {
+    node_bytes[node] += bytes;
+    return;
+  }
+  int n = numa::num_nodes();
+  for (int i = 0; i < n; ++i) {
+    node_bytes[i] += bytes / n + (i == 0 ? bytes % n : 0);
   }
 }
 
@@ -122,4 +366,285 @@ void mempool::pool_t::dump(Formatter *f, stats_t *ptotal) const
     }
     f->close_section();
   }
+  std::map<std::string, stats_t> sampled;
+  get_sampled_stats(&sampled);
+  if (!sampled.empty()) {
+    f->open_object_section("by_type_sampled");
+    for (auto &i : sampled) {
+      f->open_object_section(i.first.c_str());
+      i.second.dump(f);
+      f->close_section();
+    }
+    f->close_section();
+  }
+  int node;
+  numa::policy_t policy = get_numa_policy(&node);
+  bool placed = policy != numa::POLICY_NONE;
+  for (int i = 0; i < numa::max_nodes && !placed; ++i) {
+    placed = node_bytes[i] != 0;
+  }
+  if (placed) {
+    f->open_object_section("numa");
+    f->dump_string("policy", numa::policy_name(policy));
+    if (policy == numa::POLICY_NODE) {
+      f->dump_int("node", node);
+    }
+    f->open_array_section("by_node");
+    for (int i = 0; i < numa::num_nodes(); ++i) {
+      f->open_object_section("node");
+      f->dump_int("node", i);
+      f->dump_int("bytes", node_bytes[i]);
+      f->close_section();
+    }
+    f->close_section();
+    f->close_section();
+  }
+  if (slab_t *s = slab.load(std::memory_order_acquire)) {
+    s->dump(f);
+  }
+}
+
+// --------------------------------------------------------------
+// arena_t
+
+mempool::arena_t::arena_t(pool_index_t ix, size_t initial)
+  : pool(&get_pool(ix)),
+    initial_chunk_size(std::max(initial, min_chunk_size)),
+    next_chunk_size(initial_chunk_size)
+{
+}
+
+void *mempool::arena_t::allocate_slow(size_t size, size_t align)
+{
+  // oversized requests get a chunk of their own so the current one
+  // keeps serving small allocations.
+  size_t need = sizeof(chunk_t) + size + align;
+  size_t len = std::max(next_chunk_size, need);
+  chunk_t *c = reinterpret_cast<chunk_t*>(new char[len]);
+  c->size = len;
+  ++num_chunks;
+  chunk_bytes += len;
+  pool->adjust_count(1, len);
+
+  char *data = reinterpret_cast<char*>(c + 1);
+  uintptr_t p = ((uintptr_t)data + align - 1) & ~(uintptr_t)(align - 1);
+  if (len > next_chunk_size && chunks) {
+    c->next = chunks->next;
+    chunks->next = c;
+  } else {
+    c->next = chunks;
+    chunks = c;
+    pos = (char*)(p + size);
+    end = reinterpret_cast<char*>(c) + len;
+    next_chunk_size = std::min(next_chunk_size * 2, max_chunk_size);
+  }
+  used += size;
+  return (void*)p;
+}
+
+void mempool::arena_t::release()
+{
+  while (chunks) {
+    chunk_t *next = chunks->next;
+    delete[] reinterpret_cast<char*>(chunks);
+    chunks = next;
+  }
+  pool->adjust_count(-(ssize_t)num_chunks, -(ssize_t)chunk_bytes);
+  pos = end = nullptr;
+  num_chunks = 0;
+  chunk_bytes = 0;
+  used = 0;
+  next_chunk_size = initial_chunk_size;
+}
+
+// --------------------------------------------------------------
+// slab_t
+
+namespace {
+
+// every slab ever created, so that exiting threads can drain into them
+std::atomic<mempool::slab_t*> slab_table[mempool::num_pools];
+
+// per-thread free object caches, drained back to their slabs on exit
+struct thread_cache_t {
+  struct bin_t {
+    mempool::slab_t::free_t *head = nullptr;
+    unsigned count = 0;
+    ssize_t requested = 0;
+  };
+  bin_t bins[mempool::num_pools][mempool::slab_t::num_classes];
+
+  ~thread_cache_t();
+};
+
+thread_local thread_cache_t thread_cache;
+// set once thread_cache is gone; frees after that go to the central lists
+thread_local bool thread_cache_gone = false;
+
+thread_cache_t::~thread_cache_t()
+{
+  for (size_t i = 0; i < mempool::num_pools; ++i) {
+    for (size_t c = 0; c < mempool::slab_t::num_classes; ++c) {
+      auto& bin = bins[i][c];
+      if (bin.count) {
+        slab_table[i].load()->drain(c, bin.head, bin.count, bin.requested);
+      }
+    }
+  }
+  thread_cache_gone = true;
+}
+
+}
+
+mempool::slab_t *mempool::slab_t::create(pool_index_t ix)
+{
+  slab_t *s = new slab_t(ix);
+  slab_table[ix] = s;
+  return s;
+}
+
+unsigned mempool::slab_t::refill(size_t c, free_t **head, unsigned max,
+                                 ssize_t requested)
+{
+  class_t& cl = classes[c];
+  const size_t size = class_size(c);
+  unsigned n = 0;
+  std::lock_guard l(cl.lock);
+  while (n < max && cl.free) {
+    free_t *f = cl.free;
+    cl.free = f->next;
+    f->next = *head;
+    *head = f;
+    ++n;
+  }
+  while (n < max) {
+    if (cl.bump + size > cl.bump_end) {
+      void *chunk = aligned_alloc(GLOBAL_PAGE_SIZE, chunk_size);
+      if (!chunk) {
+        if (n) {
+          break;
+        }
+        throw std::bad_alloc();
+      }
+      cl.bump = (char*)chunk;
+      cl.bump_end = cl.bump + chunk_size;
+      cl.chunk_bytes += chunk_size;
+    }
+    free_t *f = (free_t*)cl.bump;
+    cl.bump += size;
+    f->next = *head;
+    *head = f;
+    ++n;
+  }
+  cl.out += n;
+  cl.requested += requested;
+  return n;
+}
+
+void mempool::slab_t::drain(size_t c, free_t *head, unsigned count,
+                            ssize_t requested)
+{
+  class_t& cl = classes[c];
+  free_t *tail = head;
+  for (unsigned i = 1; i < count; ++i) {
+    tail = tail->next;
+  }
+  std::lock_guard l(cl.lock);
+  tail->next = cl.free;
+  cl.free = head;
+  cl.out -= count;
+  cl.requested += requested;
+}
+
+void *mempool::slab_t::allocate(size_t size)
+{
+  size_t c = class_of(size);
+  if (unlikely(thread_cache_gone)) {
+    free_t *f = nullptr;
+    refill(c, &f, 1, size);
+    return f;
+  }
+  auto& bin = thread_cache.bins[ix][c];
+  if (unlikely(!bin.head)) {
+    bin.count = refill(c, &bin.head, batch, bin.requested);
+    bin.requested = 0;
+  }
+  free_t *f = bin.head;
+  bin.head = f->next;
+  --bin.count;
+  bin.requested += size;
+  return f;
+}
+
+void mempool::slab_t::deallocate(void *p, size_t size)
+{
+  size_t c = class_of(size);
+  free_t *f = (free_t*)p;
+  if (unlikely(thread_cache_gone)) {
+    f->next = nullptr;
+    drain(c, f, 1, -(ssize_t)size);
+    return;
+  }
+  auto& bin = thread_cache.bins[ix][c];
+  f->next = bin.head;
+  bin.head = f;
+  ++bin.count;
+  bin.requested -= size;
+  if (unlikely(bin.count > cache_max)) {
+    free_t *head = bin.head;
+    free_t *tail = head;
+    for (unsigned i = 1; i < batch; ++i) {
+      tail = tail->next;
+    }
+    bin.head = tail->next;
+    tail->next = nullptr;
+    bin.count -= batch;
+    drain(c, head, batch, bin.requested);
+    bin.requested = 0;
+  }
+}
+
+void mempool::slab_t::get_stats(size_t *chunk_bytes, size_t *out_bytes,
+                                size_t *requested_bytes) const
+{
+  *chunk_bytes = *out_bytes = *requested_bytes = 0;
+  for (size_t c = 0; c < num_classes; ++c) {
+    auto& cl = classes[c];
+    std::lock_guard l(cl.lock);
+    *chunk_bytes += cl.chunk_bytes;
+    *out_bytes += cl.out * class_size(c);
+    *requested_bytes += std::max<ssize_t>(cl.requested, 0);
+  }
+}
+
+void mempool::slab_t::dump(Formatter *f) const
+{
+  size_t chunk_bytes, out_bytes, requested_bytes;
+  get_stats(&chunk_bytes, &out_bytes, &requested_bytes);
+  f->open_object_section("slab");
+  f->dump_unsigned("chunk_bytes", chunk_bytes);
+  f->dump_unsigned("out_bytes", out_bytes);
+  f->dump_unsigned("requested_bytes", requested_bytes);
+  // requested vs. chunk memory, and the share of handed out memory lost
+  // to size-class rounding.  Requested bytes are published per batch,
+  // so both are estimates.
+  f->dump_float("utilization",
+                chunk_bytes ? (double)requested_bytes / chunk_bytes : 0);
+  f->dump_float("fragmentation",
+                out_bytes ? 1.0 - std::min(1.0, (double)requested_bytes / out_bytes) : 0);
+  f->open_array_section("classes");
+  for (size_t c = 0; c < num_classes; ++c) {
+    auto& cl = classes[c];
+    std::lock_guard l(cl.lock);
+    if (!cl.chunk_bytes) {
+      continue;
+    }
+    f->open_object_section("class");
+    f->dump_unsigned("size", class_size(c));
+    f->dump_unsigned("chunk_bytes", cl.chunk_bytes);
+    f->dump_unsigned("out_bytes", cl.out * class_size(c));
+    f->close_section();
+  }
+  f->close_section();
+  f->close_section();
 }
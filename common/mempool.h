@@ -11,12 +11,22 @@
 #include <cassert>
 #include <unordered_map>
 #include <typeinfo>
+#include <string>
 #include <boost/container/flat_set.hpp>
 #include <boost/container/flat_map.hpp>
+#include <sched.h>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MEMPOOL_HAVE_RSEQ 1
+#endif
 
 #include "formatter.h"
 #include "page.h"
 #include "assert.h"
+#include "likely.h"
+#include "numa.h"
+#include "spinlock.h"
+#include "lock_profiler.h"
 
 namespace mempool {
 
@@ -29,6 +39,8 @@ extern void set_debug_mode(bool d);
 #define DEFINE_MEMORY_POOLS_HELPER(f)     \
   f(buffer_anon)                          \
   f(buffer_meta)                          \
+  f(arena)                                \
+  f(ebr)                                  \
   f(unittest)
 
 // give them integer ids
@@ -53,6 +65,47 @@ enum {
   num_shards = 1 << num_shard_bits
 };
 
+// Alternatively stats are sharded by CPU, which avoids the collisions
+// of hashing thread ids.  The shard count is then the CPU count rounded
+// up to a power of two, capped at max_shards.  Enabled with
+// set_percpu_shards() or by $MEMPOOL_PERCPU at startup.
+enum {
+  max_shard_bits = 7
+};
+enum {
+  max_shards = 1 << max_shard_bits
+};
+
+// the shard count (a power of two) while sharding by CPU, else 0; one
+// word, so a reader never sees a mode without its mask
+extern std::atomic<size_t> percpu_shards;
+extern std::atomic<size_t> shards_in_use;
+extern void set_percpu_shards(bool on);
+
+// the CPU we are running on, read from the rseq area glibc registers
+// for each thread; otherwise sched_getcpu(), re-queried every 64 calls.
+inline unsigned current_cpu() {
+#ifdef MEMPOOL_HAVE_RSEQ
+  if (__rseq_size > 0) {
+    auto rs = reinterpret_cast<const volatile struct rseq*>(
+      reinterpret_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+    int cpu = (int)rs->cpu_id;
+    if (cpu >= 0) {
+      return cpu;
+    }
+  }
+#endif
+  static thread_local struct {
+    unsigned cpu;
+    unsigned uses;
+  } cached = {0, 0};
+  if (cached.uses++ % 64 == 0) {
+    int cpu = sched_getcpu();
+    cached.cpu = cpu < 0 ? 0 : cpu;
+  }
+  return cached.cpu;
+}
+
 //
 // Align shard to a cacheline.
 //
@@ -67,11 +120,24 @@ enum {
 struct shard_t {
   std::atomic<size_t> bytes = {0};
   std::atomic<size_t> items = {0};
-  char __padding[128 - sizeof(std::atomic<size_t>)*2];
+  std::atomic<size_t> allocated = {0};  // see count_allocations
+  char __padding[128 - sizeof(std::atomic<size_t>)*3];
 } __attribute__ ((aligned (128)));
 
 static_assert(sizeof(shard_t) == 128, "shard_t should be cacheline-sized");
 
+// Number of stats samplers alive.  Only while there are any do
+// allocations bump shard_t::allocated, which the samplers need for
+// allocation rates; otherwise the hot path would pay for one more
+// locked instruction nobody reads.
+extern std::atomic<unsigned> count_allocations;
+
+inline void note_allocated(shard_t *shard, size_t n) {
+  if (unlikely(count_allocations.load(std::memory_order_relaxed))) {
+    shard->allocated.fetch_add(n, std::memory_order_relaxed);
+  }
+}
+
 struct stats_t {
   ssize_t items = 0;
   ssize_t bytes = 0;
@@ -91,19 +157,174 @@ struct type_t {
   const char *type_name;
   size_t      item_size;
   std::atomic<ssize_t> items = {0};  // signed
+  // estimates from sampled allocations, already scaled by the sample rate
+  std::atomic<ssize_t> sampled_items = {0};
+  std::atomic<ssize_t> sampled_bytes = {0};
+  type_t *next = nullptr;
 };
 
+// Sampled per-type accounting, always on: on average one allocation
+// per sample_rate bytes on a thread is charged, scaled up, to its type,
+// at exponentially distributed points so that periodic patterns don't
+// alias.  The sampled pointers are remembered, and freeing one takes
+// back exactly what its allocation added.  0 stops sampling (samples
+// already taken are still taken back).  Defaults to $MEMPOOL_SAMPLE_RATE,
+// or 256 KiB.
+extern std::atomic<size_t> sample_rate;
+extern void set_sample_rate(size_t n);
+
+inline thread_local int64_t sample_countdown
+  __attribute__((tls_model("initial-exec"))) = 0;
+
+// live samples hashing to each slot, as for the heap profiler below
+constexpr int sample_filter_bits = 16;
+extern std::atomic<uint32_t> sample_filter[1 << sample_filter_bits];
+
+/// exponentially distributed, with mean rate; from a per-thread rng
+int64_t sample_interval(size_t rate);
+
+// Sampling heap profiler hooks; see heap_profiler.h.  An allocation is
+// handed to the profiler each time a thread's countdown of bytes runs out.
+// Samples are keyed by pool and address: a buffer::raw's own allocation
+// and its data are both noted at the raw's address.
+extern std::atomic<bool> heap_profiling;
+extern void heap_profile_alloc(pool_index_t ix, const void *p, size_t bytes);
+extern void heap_profile_free(pool_index_t ix, const void *p);
+extern void heap_profile_move(pool_index_t from, pool_index_t to,
+                              const void *p);
+
+// number of live samples hashing to each slot, so that frees of anything
+// unsampled get by with one load
+constexpr int heap_sample_filter_bits = 16;
+extern std::atomic<uint32_t> heap_sample_filter[1 << heap_sample_filter_bits];
+
+inline size_t heap_sample_slot(const void *p) {
+  return ((uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ull >>
+    (64 - heap_sample_filter_bits);
+}
+
+static_assert(sample_filter_bits == heap_sample_filter_bits);
+
+inline thread_local int64_t heap_sample_countdown
+  __attribute__((tls_model("initial-exec"))) = 0;
+
+// always inlined, even unoptimized, so that the profiler knows how many
+// frames of its own to skip
+__attribute__((always_inline))
+inline void heap_profile_note_alloc(pool_index_t ix, const void *p,
+                                    size_t bytes) {
+  if (unlikely((heap_sample_countdown -= bytes) < 0)) {
+    heap_profile_alloc(ix, p, bytes);
+  }
+}
+
+inline bool heap_profile_maybe_sampled(const void *p) {
+  return unlikely(heap_profiling.load(std::memory_order_relaxed)) &&
+    unlikely(heap_sample_filter[heap_sample_slot(p)].load(
+               std::memory_order_relaxed));
+}
+
+inline void heap_profile_note_free(pool_index_t ix, const void *p) {
+  if (heap_profile_maybe_sampled(p)) {
+    heap_profile_free(ix, p);
+  }
+}
+
+/// p, sampled as allocated from pool from, now belongs to pool to
+inline void heap_profile_note_move(pool_index_t from, pool_index_t to,
+                                   const void *p) {
+  if (heap_profile_maybe_sampled(p)) {
+    heap_profile_move(from, to, p);
+  }
+}
+
 struct type_info_hash {
   std::size_t operator()(const std::type_info& k) const {
     return k.hash_code();
   }
 };
 
+// --------------------------------------------------------------
+// slab_t: optional size-class allocator behind a pool.
+//
+// Requests up to max_size bytes are rounded up to one of num_classes
+// size classes and carved out of chunk_size chunks.  Each thread keeps a
+// small cache of free objects per pool and class; the central free lists
+// are only locked to refill or drain those caches in batches.  Chunks
+// are never returned to the system.
+
+class slab_t {
+public:
+  static constexpr size_t num_classes = 16;
+  static constexpr size_t max_size = 512;
+  static constexpr size_t min_align = 16;
+  static constexpr size_t chunk_size = 64 << 10;
+  static constexpr unsigned cache_max = 64;   ///< per thread and class
+  static constexpr unsigned batch = cache_max / 2;
+
+  struct free_t {
+    free_t *next;
+  };
+
+  static size_t class_of(size_t size) {
+    // 16..128 in steps of 16, then 176..512 in steps of 48
+    if (size <= 128)
+      return size ? (size - 1) / 16 : 0;
+    return 8 + (size - 129) / 48;
+  }
+  static size_t class_size(size_t c) {
+    return c < 8 ? (c + 1) * 16 : 128 + (c - 7) * 48;
+  }
+
+  static slab_t *create(pool_index_t ix);
+
+  void *allocate(size_t size);
+  void deallocate(void *p, size_t size);
+
+  /// hand back a thread cache's objects (count of them, linked from head)
+  void drain(size_t c, free_t *head, unsigned count, ssize_t requested);
+
+  /// slab memory, bytes handed out (and still out) and bytes requested
+  void get_stats(size_t *chunk_bytes, size_t *out_bytes,
+                 size_t *requested_bytes) const;
+  void dump(Formatter *f) const;
+
+private:
+  struct class_t {
+    mutable lockprof::profiled_spinlock lock{"mempool::slab"};
+    free_t *free = nullptr;
+    char *bump = nullptr;        ///< uncarved tail of the newest chunk
+    char *bump_end = nullptr;
+    size_t chunk_bytes = 0;
+    size_t out = 0;              ///< objects outside the central list
+    ssize_t requested = 0;       ///< bytes asked for, published per batch
+  } __attribute__ ((aligned (128)));
+
+  const pool_index_t ix;
+  class_t classes[num_classes];
+
+  explicit slab_t(pool_index_t ix) : ix(ix) {}
+  unsigned refill(size_t c, free_t **head, unsigned max, ssize_t requested);
+};
+
 class pool_t {
-  shard_t shard[num_shards];
+  shard_t shard[max_shards];
+
+  mutable std::mutex lock;  // only used for slab switching
 
-  mutable std::mutex lock;  // only used for types list
-  std::unordered_map<const char *, type_t> type_map;
+  // append-only, lock-free list of the types allocated from this pool
+  std::atomic<type_t*> types = {nullptr};
+
+  // slab is created once and kept, for its stats; allocators use
+  // active_slab, which is slab while it's switched on
+  std::atomic<slab_t*> slab = {nullptr};
+  std::atomic<slab_t*> active_slab = {nullptr};
+
+  // placement of the pool's large buffers, and bytes placed per node:
+  // exact for POLICY_NODE until the node fills, an estimate otherwise
+  std::atomic<int> numa_policy = {numa::POLICY_NONE};
+  std::atomic<int> numa_node = {-1};
+  std::atomic<ssize_t> node_bytes[numa::max_nodes] = {};
 
 public:
   /**
@@ -111,10 +332,17 @@ public:
    */
   size_t allocated_bytes() const;
   size_t allocated_items() const;
+  /// items allocated while a stats sampler was alive; between two of its
+  /// samples, those freed are this less allocated_items()
+  size_t allocated_total() const;
 
   void adjust_count(ssize_t items, ssize_t bytes);
 
   static size_t pick_a_shard_int() {
+    size_t n = percpu_shards.load(std::memory_order_relaxed);
+    if (n) {
+      return current_cpu() & (n - 1);
+    }
     size_t me = (size_t)pthread_self();
     size_t i = (me >> GLOBAL_PAGE_SHIFT) & ((1 << num_shard_bits) - 1);
     return i;
@@ -125,20 +353,53 @@ public:
     return &shard[i];
   }
 
-  type_t *get_type(const std::type_info& ti, size_t size) {
-    std::lock_guard<std::mutex> l(lock);
-    auto p = type_map.find(ti.name());
-    if (p != type_map.end()) {
-      return &p->second;
-    }
-    type_t &t = type_map[ti.name()];
-    t.type_name = ti.name();
-    t.item_size = size;
-    return &t;
+  /// find or register a type; entries are never removed
+  type_t *get_type(const std::type_info& ti, size_t size);
+  type_t *first_type() const {
+    return types.load(std::memory_order_acquire);
+  }
+
+  /// slow paths of the sampled accounting; sample_alloc rearms this
+  /// thread's countdown
+  static void sample_alloc(type_t *t, const void *p, size_t items,
+                           size_t bytes);
+  static void sample_free(const void *p);
+
+  /**
+   * Route small allocations through a slab_t.  Only possible while the
+   * pool holds nothing, since frees must go back where they came from.
+   * Also enabled at startup for the pools listed in $MEMPOOL_SLAB
+   * (comma separated, or "all").
+   *
+   * Must not race allocations or frees from the pool: switch it before
+   * the pool is used, or while its users are quiesced.  The emptiness
+   * check catches misuse but can't make a race safe.
+   */
+  bool set_slab(pool_index_t ix, bool on);
+  slab_t *get_slab() const {
+    return active_slab.load(std::memory_order_acquire);
   }
 
   // get pool stats.  by_type is not populated if !debug
   void get_stats(stats_t *total, std::map<std::string, stats_t> *by_type) const;
+  void set_numa_policy(numa::policy_t policy, int node = -1) {
+    numa_node = node;
+    numa_policy = policy;
+  }
+  numa::policy_t get_numa_policy(int *node = nullptr) const {
+    if (node) {
+      *node = numa_node;
+    }
+    return (numa::policy_t)numa_policy.load(std::memory_order_relaxed);
+  }
+  /// charge bytes placed on node; -1 spreads them over all nodes
+  void adjust_node_bytes(int node, ssize_t bytes);
+  ssize_t get_node_bytes(int node) const {
+    return node_bytes[node];
+  }
+
+  // per-type estimates from sampling
+  void get_sampled_stats(std::map<std::string, stats_t> *by_type) const;
   void dump(Formatter *f, stats_t *ptotal = 0) const;
 };
 
@@ -167,10 +428,16 @@ public:
     typedef pool_allocator<pool_ix,U> other;
   };
 
+  // resolved once per instantiation
+  static type_t *registered_type() {
+    static type_t *t = get_pool(pool_ix).get_type(typeid(T), sizeof(T));
+    return t;
+  }
+
   void init(bool force_register) {
     pool = &get_pool(pool_ix);
     if (debug_mode || force_register) {
-      type = pool->get_type(typeid(T), sizeof(T));
+      type = registered_type();
     }
   }
 
@@ -188,14 +455,32 @@ public:
     shard_t *shard = pool->pick_a_shard();
     shard->bytes += total;
     shard->items += n;
+    note_allocated(shard, n);
     if (type) {
       type->items += n;
     }
-    T* r = reinterpret_cast<T*>(new char[total]);
+    T* r = nullptr;
+    if constexpr (alignof(T) <= slab_t::min_align) {
+      if (slab_t *slab = pool->get_slab(); slab && total <= slab_t::max_size) {
+        r = reinterpret_cast<T*>(slab->allocate(total));
+      }
+    }
+    if (!r) {
+      r = reinterpret_cast<T*>(new char[total]);
+    }
+    if (unlikely((sample_countdown -= total) < 0)) {
+      pool_t::sample_alloc(registered_type(), r, n, total);
+    }
+    heap_profile_note_alloc(pool_ix, r, total);
     return r;
   }
 
   void deallocate(T* p, size_t n) {
+    if (unlikely(sample_filter[heap_sample_slot(p)].load(
+                   std::memory_order_relaxed))) {
+      pool_t::sample_free(p);
+    }
+    heap_profile_note_free(pool_ix, p);
     size_t total = sizeof(T) * n;
     shard_t *shard = pool->pick_a_shard();
     shard->bytes -= total;
@@ -203,6 +488,12 @@ public:
     if (type) {
       type->items -= n;
     }
+    if constexpr (alignof(T) <= slab_t::min_align) {
+      if (slab_t *slab = pool->get_slab(); slab && total <= slab_t::max_size) {
+        slab->deallocate(p, total);
+        return;
+      }
+    }
     delete[] reinterpret_cast<char*>(p);
   }
 
@@ -211,6 +502,7 @@ public:
     shard_t *shard = pool->pick_a_shard();
     shard->bytes += total;
     shard->items += n;
+    note_allocated(shard, n);
     if (type) {
       type->items += n;
     }
@@ -219,10 +511,12 @@ public:
     if (rc)
       throw std::bad_alloc();
     T* r = reinterpret_cast<T*>(ptr);
+    heap_profile_note_alloc(pool_ix, r, total);
     return r;
   }
 
   void deallocate_aligned(T* p, size_t n) {
+    heap_profile_note_free(pool_ix, p);
     size_t total = sizeof(T) * n;
     shard_t *shard = pool->pick_a_shard();
     shard->bytes -= total;
@@ -306,6 +600,179 @@ DEFINE_MEMORY_POOLS_HELPER(P)
 
 #undef P
 
+// --------------------------------------------------------------
+// arena_t: a monotonic allocator.
+//
+// Memory is bump-allocated out of chunks that are charged to a pool
+// (one item per chunk) and is only given back, all at once, by release()
+// or the destructor.  Meant for bulk decodes whose results are dropped
+// together: the per-element frees disappear.  Everything allocated from
+// an arena must be destroyed before the arena is.
+
+class arena_t {
+  struct chunk_t {
+    chunk_t *next;
+    size_t size;
+  };
+
+  pool_t *pool;
+  chunk_t *chunks = nullptr;
+  char *pos = nullptr;
+  char *end = nullptr;
+  const size_t initial_chunk_size;
+  size_t next_chunk_size;
+  size_t num_chunks = 0;
+  size_t chunk_bytes = 0;
+  size_t used = 0;
+
+  static inline thread_local arena_t *current_arena
+    __attribute__((tls_model("initial-exec"))) = nullptr;
+
+  void *allocate_slow(size_t size, size_t align);
+
+public:
+  static constexpr size_t min_chunk_size = 4096;
+  static constexpr size_t max_chunk_size = 1 << 20;
+
+  explicit arena_t(pool_index_t ix = mempool_arena,
+                   size_t initial = min_chunk_size);
+  ~arena_t() {
+    release();
+  }
+  arena_t(const arena_t&) = delete;
+  arena_t& operator=(const arena_t&) = delete;
+
+  void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    uintptr_t p = ((uintptr_t)pos + align - 1) & ~(uintptr_t)(align - 1);
+    if (pos && p + size <= (uintptr_t)end) {
+      pos = (char*)(p + size);
+      used += size;
+      return (void*)p;
+    }
+    return allocate_slow(size, align);
+  }
+
+  /// free every chunk; the arena can be reused afterwards
+  void release();
+
+  /// bytes held in chunks, as charged to the pool
+  size_t allocated_bytes() const {
+    return chunk_bytes;
+  }
+  /// bytes handed out by allocate()
+  size_t used_bytes() const {
+    return used;
+  }
+
+  /// the arena default-constructed arena_allocators bind to
+  static arena_t *current() {
+    return current_arena;
+  }
+
+  class scope {
+    arena_t *prev;
+  public:
+    explicit scope(arena_t& a) : prev(current_arena) {
+      current_arena = &a;
+    }
+    ~scope() {
+      current_arena = prev;
+    }
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+  };
+};
+
+// STL allocator on top of an arena_t.  A default-constructed allocator
+// binds to arena_t::current(); without an arena it falls back to the
+// heap, accounted to the arena pool.  Moving or swapping a container
+// moves its arena along with it.
+
+template<typename T>
+class arena_allocator {
+  arena_t *arena;
+
+  template<typename U> friend class arena_allocator;
+
+public:
+  typedef T value_type;
+  typedef value_type *pointer;
+  typedef const value_type * const_pointer;
+  typedef value_type& reference;
+  typedef const value_type& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  template<typename U> struct rebind {
+    typedef arena_allocator<U> other;
+  };
+
+  arena_allocator() : arena(arena_t::current()) {}
+  // cppcheck-suppress noExplicitConstructor
+  arena_allocator(arena_t *a) : arena(a) {}
+  template<typename U>
+  arena_allocator(const arena_allocator<U>& o) : arena(o.arena) {}
+
+  T* allocate(size_t n) {
+    size_t total = sizeof(T) * n;
+    if (arena) {
+      return reinterpret_cast<T*>(arena->allocate(total, alignof(T)));
+    }
+    get_pool(mempool_arena).adjust_count(n, total);
+    return reinterpret_cast<T*>(new char[total]);
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (!arena) {
+      get_pool(mempool_arena).adjust_count(-(ssize_t)n,
+                                           -(ssize_t)(sizeof(T) * n));
+      delete[] reinterpret_cast<char*>(p);
+    }
+  }
+
+  arena_t *get_arena() const {
+    return arena;
+  }
+
+  template<typename U>
+  bool operator==(const arena_allocator<U>& o) const {
+    return arena == o.arena;
+  }
+  template<typename U>
+  bool operator!=(const arena_allocator<U>& o) const {
+    return arena != o.arena;
+  }
+};
+
+template<typename A> struct is_arena_allocator : std::false_type {};
+template<typename T>
+struct is_arena_allocator<arena_allocator<T>> : std::true_type {};
+template<typename A>
+inline constexpr bool is_arena_allocator_v = is_arena_allocator<A>::value;
+
+using arena_string =
+  std::basic_string<char, std::char_traits<char>, arena_allocator<char>>;
+
+template<typename k, typename v, typename cmp = std::less<k> >
+using arena_map = std::map<k, v, cmp, arena_allocator<std::pair<const k, v>>>;
+
+template<typename k, typename cmp = std::less<k> >
+using arena_set = std::set<k, cmp, arena_allocator<k>>;
+
+template<typename v>
+using arena_list = std::list<v, arena_allocator<v>>;
+
+template<typename v>
+using arena_vector = std::vector<v, arena_allocator<v>>;
+
+template<typename k, typename v,
+         typename h = std::hash<k>,
+         typename eq = std::equal_to<k>>
+using arena_unordered_map =
+  std::unordered_map<k, v, h, eq, arena_allocator<std::pair<const k, v>>>;
+
 }
 
 // the elements allocated by mempool is in the same memory space as the ones
@@ -0,0 +1,316 @@
+#include <algorithm>
+
+#include "mempool_budget.h"
+
+using namespace mempool;
+
+// the trimmer whose callback this thread is in, so that it can remove
+// itself without waiting for itself
+static thread_local const void *current_trimmer = nullptr;
+
+budget_manager_t::budget_manager_t() = default;
+
+budget_manager_t::~budget_manager_t()
+{
+  stop();
+}
+
+void budget_manager_t::set_limits(pool_index_t ix, size_t soft, size_t hard)
+{
+  std::lock_guard l(lock);
+  pools[ix].soft = soft;
+  pools[ix].hard = hard;
+}
+
+budget_manager_t::limits_t budget_manager_t::get_limits(pool_index_t ix) const
+{
+  limits_t r;
+  r.soft = pools[ix].soft;
+  r.hard = pools[ix].hard;
+  return r;
+}
+
+void budget_manager_t::set_target(size_t bytes)
+{
+  target = bytes;
+}
+
+void budget_manager_t::set_balanced(pool_index_t ix, size_t min_bytes,
+                                    size_t max_bytes)
+{
+  std::lock_guard l(lock);
+  auto& p = pools[ix];
+  p.balanced = true;
+  p.min_bytes = min_bytes;
+  p.max_bytes = max_bytes;
+}
+
+void budget_manager_t::clear_balanced(pool_index_t ix)
+{
+  std::lock_guard l(lock);
+  pools[ix].balanced = false;
+  pools[ix].weight = 0;
+}
+
+uint64_t budget_manager_t::add_trimmer(pool_index_t ix, trim_fn_t fn)
+{
+  std::lock_guard l(lock);
+  uint64_t id = next_id++;
+  trimmers.push_back(std::make_shared<trimmer_t>(
+    trimmer_t{id, ix, std::move(fn)}));
+  return id;
+}
+
+void budget_manager_t::remove_trimmer(uint64_t id)
+{
+  std::unique_lock l(lock);
+  auto i = std::find_if(trimmers.begin(), trimmers.end(),
+                        [id](auto& t) { return t->id == id; });
+  if (i == trimmers.end()) {
+    return;
+  }
+  auto t = *i;
+  trimmers.erase(i);
+  t->removed = true;
+  // wait out calls in flight, bar our own caller's
+  unsigned self = current_trimmer == t.get();
+  trim_done.wait(l, [&] { return t->running == self; });
+}
+
+size_t budget_manager_t::trim(pool_index_t ix, size_t bytes, bool urgent)
+{
+  // callbacks run unlocked; they may well allocate or remove themselves
+  std::vector<std::shared_ptr<trimmer_t>> ts;
+  {
+    std::lock_guard l(lock);
+    for (auto& t : trimmers) {
+      if (t->ix == ix) {
+        ts.push_back(t);
+      }
+    }
+  }
+  size_t released = 0;
+  for (auto& t : ts) {
+    if (released >= bytes) {
+      break;
+    }
+    {
+      std::lock_guard l(lock);
+      if (t->removed) {
+        continue;
+      }
+      ++t->running;
+    }
+    const void *outer = current_trimmer;
+    current_trimmer = t.get();
+    released += t->fn(bytes - released, urgent);
+    current_trimmer = outer;
+    {
+      std::lock_guard l(lock);
+      --t->running;
+    }
+    trim_done.notify_all();
+  }
+  pools[ix].trimmed += released;
+  return released;
+}
+
+size_t budget_manager_t::enforce()
+{
+  size_t used[num_pools];
+  size_t total = 0;
+  for (size_t ix = 0; ix < num_pools; ++ix) {
+    used[ix] = get_pool((pool_index_t)ix).allocated_bytes();
+    total += used[ix];
+  }
+
+  size_t released = 0;
+  for (size_t ix = 0; ix < num_pools; ++ix) {
+    size_t soft = pools[ix].soft;
+    size_t hard = pools[ix].hard;
+    if (soft && used[ix] > soft) {
+      size_t r = trim((pool_index_t)ix, used[ix] - soft, hard && used[ix] > hard);
+      r = std::min(r, used[ix]);
+      used[ix] -= r;
+      total -= r;
+      released += r;
+    }
+  }
+
+  size_t t = target;
+  if (!t || total <= t) {
+    return released;
+  }
+  // spread the excess over the pools that can trim, by size
+  bool trimmable[num_pools] = {};
+  size_t trimmable_bytes = 0;
+  {
+    std::lock_guard l(lock);
+    for (auto& i : trimmers) {
+      if (!trimmable[i->ix]) {
+        trimmable[i->ix] = true;
+        trimmable_bytes += used[i->ix];
+      }
+    }
+  }
+  size_t excess = total - t;
+  for (size_t ix = 0; ix < num_pools && trimmable_bytes; ++ix) {
+    if (trimmable[ix] && used[ix]) {
+      size_t share = (double)excess * used[ix] / trimmable_bytes;
+      released += trim((pool_index_t)ix, std::max<size_t>(share, 1), false);
+    }
+  }
+  return released;
+}
+
+void budget_manager_t::rebalance()
+{
+  std::lock_guard l(lock);
+  std::vector<size_t> members;
+  size_t unbalanced = 0;
+  for (size_t ix = 0; ix < num_pools; ++ix) {
+    auto& p = pools[ix];
+    if (!p.balanced) {
+      unbalanced += get_pool((pool_index_t)ix).allocated_bytes();
+      continue;
+    }
+    members.push_back(ix);
+    p.last_hits = p.hits.exchange(0);
+    p.last_misses = p.misses.exchange(0);
+    p.weight = (p.weight + p.last_misses) / 2;
+  }
+  size_t t = target;
+  if (!t || members.empty()) {
+    return;
+  }
+
+  // water-fill: split by weight, pin pools that hit their max, then those
+  // under their min, and share what is left among the rest.  The +1 keeps
+  // idle pools in play.
+  const size_t n = members.size();
+  std::vector<double> share(n, 0);
+  std::vector<bool> pinned(n, false);
+  double left = t > unbalanced ? t - unbalanced : 0;
+  for (size_t round = 0; round < n; ++round) {
+    double w = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (!pinned[i]) {
+        w += pools[members[i]].weight + 1;
+      }
+    }
+    bool over = false, under = false;
+    for (size_t i = 0; i < n; ++i) {
+      if (!pinned[i]) {
+        auto& p = pools[members[i]];
+        share[i] = left * (p.weight + 1) / w;
+        over |= p.max_bytes && share[i] > p.max_bytes;
+        under |= share[i] < p.min_bytes;
+      }
+    }
+    if (!over && !under) {
+      break;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      auto& p = pools[members[i]];
+      if (pinned[i]) {
+        continue;
+      }
+      if (over && p.max_bytes && share[i] > p.max_bytes) {
+        share[i] = p.max_bytes;
+      } else if (!over && share[i] < p.min_bytes) {
+        share[i] = p.min_bytes;
+      } else {
+        continue;
+      }
+      pinned[i] = true;
+      left = std::max(0.0, left - share[i]);
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    auto& p = pools[members[i]];
+    size_t cur = p.soft;
+    // move halfway so a single noisy interval cannot swing the split
+    size_t next = cur ? (cur + (size_t)share[i]) / 2 : (size_t)share[i];
+    size_t hard = p.hard;
+    if (hard) {
+      next = std::min(next, hard);
+    }
+    p.soft = std::max<size_t>(next, 1);
+  }
+}
+
+void budget_manager_t::run(std::chrono::milliseconds interval)
+{
+  std::unique_lock l(thread_lock);
+  while (!stopping) {
+    cond.wait_for(l, interval, [this] { return stopping; });
+    if (stopping) {
+      break;
+    }
+    l.unlock();
+    rebalance();
+    enforce();
+    l.lock();
+  }
+}
+
+void budget_manager_t::start(std::chrono::milliseconds interval)
+{
+  std::lock_guard l(thread_lock);
+  if (balancer.joinable()) {
+    return;
+  }
+  stopping = false;
+  balancer = std::thread(&budget_manager_t::run, this, interval);
+}
+
+void budget_manager_t::stop()
+{
+  {
+    std::lock_guard l(thread_lock);
+    if (!balancer.joinable()) {
+      return;
+    }
+    stopping = true;
+  }
+  cond.notify_all();
+  balancer.join();
+}
+
+void budget_manager_t::dump(Formatter *f) const
+{
+  size_t total = 0;
+  f->open_object_section("pools");
+  for (size_t ix = 0; ix < num_pools; ++ix) {
+    size_t used = get_pool((pool_index_t)ix).allocated_bytes();
+    total += used;
+    auto& p = pools[ix];
+    std::lock_guard l(lock);
+    if (!p.soft && !p.hard && !p.balanced) {
+      continue;
+    }
+    f->open_object_section(get_pool_name((pool_index_t)ix));
+    f->dump_unsigned("bytes", used);
+    f->dump_unsigned("soft", p.soft);
+    f->dump_unsigned("hard", p.hard);
+    f->dump_unsigned("trimmed", p.trimmed);
+    if (p.balanced) {
+      f->dump_unsigned("min", p.min_bytes);
+      f->dump_unsigned("max", p.max_bytes);
+      f->dump_unsigned("hits", p.last_hits);
+      f->dump_unsigned("misses", p.last_misses);
+      f->dump_float("weight", p.weight);
+    }
+    f->close_section();
+  }
+  f->close_section();
+  f->dump_unsigned("target", target);
+  f->dump_unsigned("total", total);
+}
+
+budget_manager_t& mempool::get_budget_manager()
+{
+  static budget_manager_t manager;
+  return manager;
+}
@@ -0,0 +1,132 @@
+#ifndef MEMPOOL_BUDGET_H
+#define MEMPOOL_BUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "formatter.h"
+#include "mempool.h"
+
+namespace mempool {
+
+/**
+ * Memory budgets for pools.
+ *
+ * Every pool may have a soft budget (the size it is trimmed back to) and
+ * a hard budget (the size admit() refuses to grow past); 0 means none.
+ * A process-wide target caps the sum of all pools.  Owners of the memory,
+ * usually caches, register trim callbacks which enforce() invokes with the
+ * number of bytes they are asked to release.
+ *
+ * Pools marked balanced share whatever the target leaves over after the
+ * unbalanced pools.  rebalance() moves their soft budgets towards a split
+ * proportional to each pool's recent misses, as reported through
+ * record_access(); misses are what more memory could have saved.
+ */
+class budget_manager_t {
+public:
+  /// asked to free about `bytes`; urgent when over the hard budget.
+  /// Returns the number of bytes actually released.
+  typedef std::function<size_t(size_t bytes, bool urgent)> trim_fn_t;
+
+  struct limits_t {
+    size_t soft = 0;
+    size_t hard = 0;
+  };
+
+  budget_manager_t();
+  ~budget_manager_t();
+
+  void set_limits(pool_index_t ix, size_t soft, size_t hard);
+  limits_t get_limits(pool_index_t ix) const;
+
+  void set_target(size_t bytes);
+  size_t get_target() const {
+    return target;
+  }
+
+  /// let the balancer own the soft budget of ix, within [min, max]
+  void set_balanced(pool_index_t ix, size_t min_bytes, size_t max_bytes);
+  void clear_balanced(pool_index_t ix);
+
+  uint64_t add_trimmer(pool_index_t ix, trim_fn_t fn);
+  /// once this returns the callback is not running and won't be called
+  /// again; a callback may remove itself
+  void remove_trimmer(uint64_t id);
+
+  /// may ix grow by bytes without crossing its hard budget?
+  bool admit(pool_index_t ix, size_t bytes) const {
+    size_t hard = pools[ix].hard.load(std::memory_order_relaxed);
+    return !hard || get_pool(ix).allocated_bytes() + bytes <= hard;
+  }
+
+  /// cache feedback for the balancer
+  void record_access(pool_index_t ix, uint64_t hits, uint64_t misses) {
+    pools[ix].hits.fetch_add(hits, std::memory_order_relaxed);
+    pools[ix].misses.fetch_add(misses, std::memory_order_relaxed);
+  }
+
+  /// run trim callbacks for every pool, and the process, over budget.
+  /// Returns the bytes the callbacks reported releasing.
+  size_t enforce();
+
+  /// redistribute the target between balanced pools
+  void rebalance();
+
+  /// rebalance() and enforce() every interval on a background thread
+  void start(std::chrono::milliseconds interval);
+  void stop();
+
+  void dump(Formatter *f) const;
+
+private:
+  struct pool_budget_t {
+    std::atomic<size_t> soft = {0};
+    std::atomic<size_t> hard = {0};
+    std::atomic<uint64_t> hits = {0};
+    std::atomic<uint64_t> misses = {0};
+    bool balanced = false;
+    size_t min_bytes = 0;
+    size_t max_bytes = 0;
+    double weight = 0;        // moving average of misses per interval
+    uint64_t last_hits = 0;   // of the previous interval, for dump
+    uint64_t last_misses = 0;
+    std::atomic<uint64_t> trimmed = {0};
+  };
+
+  struct trimmer_t {
+    uint64_t id;
+    pool_index_t ix;
+    trim_fn_t fn;
+    unsigned running = 0;   // calls in flight; under lock
+    bool removed = false;
+  };
+
+  size_t trim(pool_index_t ix, size_t bytes, bool urgent);
+  void run(std::chrono::milliseconds interval);
+
+  mutable std::mutex lock;
+  std::condition_variable trim_done;   // a callback returned
+  pool_budget_t pools[num_pools];
+  std::atomic<size_t> target = {0};
+  std::vector<std::shared_ptr<trimmer_t>> trimmers;
+  uint64_t next_id = 1;
+
+  std::mutex thread_lock;
+  std::condition_variable cond;
+  bool stopping = false;
+  std::thread balancer;
+};
+
+/// the process-wide budgets
+budget_manager_t& get_budget_manager();
+
+} // namespace mempool
+
+#endif // MEMPOOL_BUDGET_H
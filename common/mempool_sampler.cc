@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cstring>
+
+#include "mempool_sampler.h"
+#include "time.h"
+
+using namespace mempool;
+
+static size_t round_up_pow2(size_t n)
+{
+  size_t r = 1;
+  while (r < n) {
+    r <<= 1;
+  }
+  return r;
+}
+
+stats_sampler_t::stats_sampler_t(size_t capacity)
+  : mask(round_up_pow2(std::max<size_t>(capacity, 2)) - 1),
+    ring(new slot_t[mask + 1])
+{
+  ++count_allocations;
+}
+
+stats_sampler_t::~stats_sampler_t()
+{
+  stop();
+  --count_allocations;
+}
+
+void stats_sampler_t::sample()
+{
+  sample_t s;
+  s.stamp = mono_clock::now().time_since_epoch().count();
+  for (size_t ix = 0; ix < num_pools; ++ix) {
+    auto& pool = get_pool((pool_index_t)ix);
+    auto& p = s.pools[ix];
+    // allocated first, so frees derived from it never go negative
+    p.allocated = pool.allocated_total();
+    p.items = pool.allocated_items();
+    p.bytes = pool.allocated_bytes();
+    ssize_t hw = high_water_bytes[ix];
+    while (p.bytes > hw && !high_water_bytes[ix].compare_exchange_weak(hw, p.bytes))
+      ;
+    hw = high_water_items[ix];
+    while (p.items > hw && !high_water_items[ix].compare_exchange_weak(hw, p.items))
+      ;
+  }
+
+  std::lock_guard l(write_lock);
+  uint64_t n = head.load(std::memory_order_relaxed);
+  slot_t& slot = ring[n & mask];
+  slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&slot.sample, &s, sizeof(s));
+  slot.seq.store(2 * n + 2, std::memory_order_release);
+  head.store(n + 1, std::memory_order_release);
+}
+
+bool stats_sampler_t::read(uint64_t index, sample_t *out) const
+{
+  const slot_t& slot = ring[index & mask];
+  uint64_t seq = slot.seq.load(std::memory_order_acquire);
+  if (seq != 2 * index + 2) {
+    return false;
+  }
+  memcpy(out, &slot.sample, sizeof(*out));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.seq.load(std::memory_order_relaxed) == seq;
+}
+
+void stats_sampler_t::get_samples(size_t n, std::vector<sample_t> *out) const
+{
+  uint64_t h = head.load(std::memory_order_acquire);
+  n = std::min<uint64_t>({n, h, mask + 1});
+  out->clear();
+  out->reserve(n);
+  sample_t s;
+  for (uint64_t i = h - n; i < h; ++i) {
+    if (read(i, &s)) {
+      out->push_back(s);
+    }
+  }
+}
+
+void stats_sampler_t::run(std::chrono::milliseconds interval)
+{
+  std::unique_lock l(thread_lock);
+  while (!stopping) {
+    l.unlock();
+    sample();
+    l.lock();
+    cond.wait_for(l, interval, [this] { return stopping; });
+  }
+}
+
+void stats_sampler_t::start(std::chrono::milliseconds interval)
+{
+  std::lock_guard l(thread_lock);
+  if (sampler.joinable()) {
+    return;
+  }
+  stopping = false;
+  sampler = std::thread(&stats_sampler_t::run, this, interval);
+}
+
+void stats_sampler_t::stop()
+{
+  {
+    std::lock_guard l(thread_lock);
+    if (!sampler.joinable()) {
+      return;
+    }
+    stopping = true;
+  }
+  cond.notify_all();
+  sampler.join();
+}
+
+void stats_sampler_t::dump(Formatter *f, size_t n) const
+{
+  std::vector<sample_t> samples;
+  get_samples(n + 1, &samples);
+
+  f->open_object_section("high_water");
+  for (size_t ix = 0; ix < num_pools; ++ix) {
+    f->open_object_section(get_pool_name((pool_index_t)ix));
+    f->dump_int("items", high_water_items[ix]);
+    f->dump_int("bytes", high_water_bytes[ix]);
+    f->close_section();
+  }
+  f->close_section();
+
+  f->open_array_section("samples");
+  for (size_t i = samples.size() > n ? 1 : 0; i < samples.size(); ++i) {
+    const sample_t& s = samples[i];
+    const sample_t *prev = i ? &samples[i - 1] : nullptr;
+    double dt = prev ? (s.stamp - prev->stamp) / 1e9 : 0;
+    f->open_object_section("sample");
+    f->dump_float("stamp", s.stamp / 1e9);
+    for (size_t ix = 0; ix < num_pools; ++ix) {
+      const pool_sample_t& p = s.pools[ix];
+      f->open_object_section(get_pool_name((pool_index_t)ix));
+      f->dump_int("items", p.items);
+      f->dump_int("bytes", p.bytes);
+      if (prev && dt > 0) {
+        const pool_sample_t& q = prev->pools[ix];
+        double allocs = p.allocated - q.allocated;
+        double frees = allocs - (p.items - q.items);
+        f->dump_float("alloc_rate", allocs / dt);
+        f->dump_float("free_rate", frees / dt);
+        f->dump_float("bytes_rate", (p.bytes - q.bytes) / dt);
+      }
+      f->close_section();
+    }
+    f->close_section();
+  }
+  f->close_section();
+}
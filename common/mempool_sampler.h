@@ -0,0 +1,91 @@
+#ifndef MEMPOOL_SAMPLER_H
+#define MEMPOOL_SAMPLER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "formatter.h"
+#include "mempool.h"
+
+namespace mempool {
+
+/**
+ * Time series of pool statistics.
+ *
+ * A background thread (or explicit sample() calls) snapshots every pool
+ * into a fixed-size ring.  There is one writer at a time; readers copy
+ * slots out under a per-slot sequence number and never block it, and
+ * snapshots overwritten while being read are skipped.  A snapshot only
+ * sums the shards, so it is much cheaper than dump().
+ *
+ * High-water marks are of the sampled values, so spikes shorter than the
+ * interval may be missed.  Allocations are only counted, for the rates,
+ * while some sampler exists.
+ */
+class stats_sampler_t {
+public:
+  struct pool_sample_t {
+    ssize_t items = 0;
+    ssize_t bytes = 0;
+    size_t allocated = 0;   // items allocated while samplers exist
+  };
+
+  struct sample_t {
+    uint64_t stamp = 0;     // mono_clock, ns
+    pool_sample_t pools[num_pools];
+  };
+
+  /// capacity is rounded up to a power of two
+  explicit stats_sampler_t(size_t capacity = 1024);
+  ~stats_sampler_t();
+
+  void start(std::chrono::milliseconds interval);
+  void stop();
+
+  /// take a snapshot now
+  void sample();
+
+  /// the last n snapshots still in the ring, oldest first
+  void get_samples(size_t n, std::vector<sample_t> *out) const;
+
+  ssize_t get_high_water_bytes(pool_index_t ix) const {
+    return high_water_bytes[ix];
+  }
+  ssize_t get_high_water_items(pool_index_t ix) const {
+    return high_water_items[ix];
+  }
+
+  /// the last n snapshots, with rates against the one before each
+  void dump(Formatter *f, size_t n) const;
+
+private:
+  struct slot_t {
+    std::atomic<uint64_t> seq = {0};  // 2 * index + 2 once written
+    sample_t sample;
+  };
+
+  bool read(uint64_t index, sample_t *out) const;
+  void run(std::chrono::milliseconds interval);
+
+  const size_t mask;
+  std::unique_ptr<slot_t[]> ring;
+  std::atomic<uint64_t> head = {0};   // snapshots written
+  std::mutex write_lock;
+
+  std::atomic<ssize_t> high_water_bytes[num_pools] = {};
+  std::atomic<ssize_t> high_water_items[num_pools] = {};
+
+  std::mutex thread_lock;
+  std::condition_variable cond;
+  bool stopping = false;
+  std::thread sampler;
+};
+
+} // namespace mempool
+
+#endif // MEMPOOL_SAMPLER_H
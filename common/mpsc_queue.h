@@ -0,0 +1,107 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+#include "queue_waiter.h"
+
+/// link for mpsc_queue; items derive from it, as ptr_node does ptr_hook
+struct mpsc_hook_t {
+  std::atomic<mpsc_hook_t*> next = {nullptr};
+};
+
+/**
+ * Intrusive unbounded multi-producer single-consumer queue.
+ *
+ * Vyukov's queue: a producer links its item with one exchange and one
+ * store, never waiting on other producers or the consumer, and nothing
+ * is allocated.  An item must stay alive, and in no other queue, until
+ * it is popped.  The consumer can briefly see the queue as empty while
+ * a producer is between its two steps.
+ */
+template <class T>
+class mpsc_queue {
+public:
+  mpsc_queue() : head(&stub), tail(&stub) {}
+  mpsc_queue(const mpsc_queue&) = delete;
+  mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+  // any thread
+  void push(T *item) {
+    link(item);
+    waiter.notify();
+  }
+
+  // consumer
+  T *pop() {
+    mpsc_hook_t *t = tail;
+    mpsc_hook_t *next = t->next.load(std::memory_order_acquire);
+    if (t == &stub) {
+      if (!next) {
+        return nullptr;
+      }
+      tail = t = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      tail = next;
+      return static_cast<T*>(t);
+    }
+    if (t != head.load(std::memory_order_acquire)) {
+      return nullptr;   // a push is half done
+    }
+    // t is the last one; put the stub behind it so it can be unlinked
+    link(&stub);
+    next = t->next.load(std::memory_order_acquire);
+    if (next) {
+      tail = next;
+      return static_cast<T*>(t);
+    }
+    return nullptr;
+  }
+
+  /// consumer: pop up to max items, calling fn(T*) on each in order
+  template <class F>
+  size_t pop_batch(F&& fn, size_t max = SIZE_MAX) {
+    size_t n = 0;
+    while (n < max) {
+      T *item = pop();
+      if (!item) {
+        break;
+      }
+      fn(item);
+      ++n;
+    }
+    return n;
+  }
+
+  bool empty() const {
+    return tail == &stub &&
+      !stub.next.load(std::memory_order_acquire);
+  }
+
+  /// consumer: sleep until something arrives; false on timeout
+  bool wait(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) {
+    return waiter.wait([this] {
+      return head.load(std::memory_order_acquire) != tail || !empty();
+    }, timeout);
+  }
+  queue_waiter_t& get_waiter() {
+    return waiter;
+  }
+
+private:
+  void link(mpsc_hook_t *item) {
+    item->next.store(nullptr, std::memory_order_relaxed);
+    mpsc_hook_t *prev = head.exchange(item, std::memory_order_acq_rel);
+    prev->next.store(item, std::memory_order_release);
+  }
+
+  alignas(64) std::atomic<mpsc_hook_t*> head;   // producers
+  alignas(64) mpsc_hook_t *tail;                // consumer
+  mpsc_hook_t stub;
+  alignas(64) queue_waiter_t waiter;
+};
+
+#endif // MPSC_QUEUE_H
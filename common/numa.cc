@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "numa.h"
+#include "page.h"
+
+// from <linux/mempolicy.h>
+#define NUMA_MPOL_DEFAULT     0
+#define NUMA_MPOL_PREFERRED   1
+#define NUMA_MPOL_INTERLEAVE  3
+#define NUMA_MPOL_LOCAL       4
+
+const char *numa::policy_name(policy_t p)
+{
+  switch (p) {
+  case POLICY_NONE: return "none";
+  case POLICY_LOCAL: return "local";
+  case POLICY_INTERLEAVE: return "interleave";
+  case POLICY_NODE: return "node";
+  }
+  return "unknown";
+}
+
+static int read_num_nodes()
+{
+  // e.g. "0" or "0-3"
+  std::ifstream f("/sys/devices/system/node/possible");
+  std::string s;
+  if (!(f >> s)) {
+    return 1;
+  }
+  size_t dash = s.find_last_of("-,");
+  int last = std::stoi(dash == std::string::npos ? s : s.substr(dash + 1));
+  return std::clamp(last + 1, 1, numa::max_nodes);
+}
+
+int numa::num_nodes()
+{
+  static int n = read_num_nodes();
+  return n;
+}
+
+int numa::current_node()
+{
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) < 0) {
+    return 0;
+  }
+  return std::min<int>(node, max_nodes - 1);
+}
+
+int numa::bind(void *p, size_t len, policy_t policy, int node)
+{
+  unsigned long mask[max_nodes / (8 * sizeof(unsigned long))] = {};
+  int mode = NUMA_MPOL_DEFAULT;
+  switch (policy) {
+  case POLICY_NONE:
+    return 0;
+  case POLICY_LOCAL:
+    mode = NUMA_MPOL_LOCAL;
+    break;
+  case POLICY_INTERLEAVE:
+    mode = NUMA_MPOL_INTERLEAVE;
+    for (int i = 0; i < num_nodes(); ++i) {
+      mask[i / 64] |= 1ul << (i % 64);
+    }
+    break;
+  case POLICY_NODE:
+    if (node < 0 || node >= num_nodes()) {
+      return -EINVAL;
+    }
+    mode = NUMA_MPOL_PREFERRED;
+    mask[node / 64] |= 1ul << (node % 64);
+    break;
+  }
+  // the kernel reads maxnode - 1 bits
+  if (syscall(SYS_mbind, p, len, mode,
+              mode == NUMA_MPOL_LOCAL ? nullptr : mask,
+              mode == NUMA_MPOL_LOCAL ? 0 : max_nodes + 1, 0) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+void *numa::alloc_pages(size_t len, policy_t policy, int node)
+{
+  len = (len + GLOBAL_PAGE_SIZE - 1) & GLOBAL_PAGE_MASK;
+  void *p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  // placement is best effort; ENOSYS just means no NUMA here
+  bind(p, len, policy, node);
+  return p;
+}
+
+void numa::free_pages(void *p, size_t len)
+{
+  len = (len + GLOBAL_PAGE_SIZE - 1) & GLOBAL_PAGE_MASK;
+  ::munmap(p, len);
+}
@@ -0,0 +1,38 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <cstddef>
+
+// NUMA placement, straight on the syscalls so we don't need libnuma.
+// Without NUMA support in the kernel everything is node 0 and binding
+// is a no-op.
+
+namespace numa {
+
+constexpr int max_nodes = 64;
+
+enum policy_t {
+  POLICY_NONE = 0,     // first touch
+  POLICY_LOCAL,        // the node of the allocating cpu
+  POLICY_INTERLEAVE,   // pages round-robin over all nodes
+  POLICY_NODE,         // a given node, falling back to others when full
+};
+
+const char *policy_name(policy_t p);
+
+/// possible nodes; 1 on a non-NUMA system
+int num_nodes();
+
+/// node of the cpu we're running on
+int current_node();
+
+/// apply policy to the page aligned range [p, p+len); 0 or -errno
+int bind(void *p, size_t len, policy_t policy, int node = -1);
+
+/// map len bytes, rounded up to pages, placed by policy; nullptr on failure
+void *alloc_pages(size_t len, policy_t policy, int node = -1);
+void free_pages(void *p, size_t len);
+
+} // namespace numa
+
+#endif // NUMA_H
@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <pthread.h>
+
+#include "perf_counters.h"
+
+using namespace perf;
+
+namespace {
+
+struct metric_t {
+  std::string name;
+  std::string desc;
+};
+
+struct registry_t {
+  std::mutex lock;
+  std::map<std::string, uint32_t> ids[3];
+  // id 0 of each type is where metrics go once the type is full
+  std::vector<metric_t> metrics[3] = {{{}}, {{}}, {{}}};
+  std::vector<thread_table_t*> threads;
+  uint64_t retired_counters[max_counters] = {};
+  std::unique_ptr<histogram_snapshot_t> retired_hists[max_histograms];
+  std::atomic<int64_t> gauges[max_gauges] = {};
+  pthread_key_t late_key;   // tables taken after a thread's exit hook ran
+
+  registry_t();
+};
+
+registry_t& registry()
+{
+  // leaked: metrics are registered and threads exit during static init/fini
+  static registry_t *r = new registry_t;
+  return *r;
+}
+
+const unsigned type_max[3] = {max_counters, max_gauges, max_histograms};
+
+void add(histogram_snapshot_t *s, const hist_slots_t& h)
+{
+  s->sum += h.sum.load(std::memory_order_relaxed);
+  for (unsigned b = 0; b < hist_buckets; ++b) {
+    uint64_t n = h.buckets[b].load(std::memory_order_relaxed);
+    s->buckets[b] += n;
+    s->count += n;
+  }
+}
+
+void clear(hist_slots_t *h)
+{
+  h->sum.store(0, std::memory_order_relaxed);
+  for (auto& b : h->buckets) {
+    b.store(0, std::memory_order_relaxed);
+  }
+}
+
+// called with the registry locked
+uint64_t sum_counter(registry_t& r, uint32_t id)
+{
+  uint64_t v = r.retired_counters[id];
+  for (auto t : r.threads) {
+    v += t->counters[id].load(std::memory_order_relaxed);
+  }
+  return v;
+}
+
+void sum_histogram(registry_t& r, uint32_t id, histogram_snapshot_t *out)
+{
+  *out = histogram_snapshot_t();
+  if (r.retired_hists[id]) {
+    *out = *r.retired_hists[id];
+  }
+  for (auto t : r.threads) {
+    if (auto h = t->hists[id].load(std::memory_order_acquire)) {
+      add(out, *h);
+    }
+  }
+}
+
+// fold t into what exited threads left behind and free it for reuse;
+// called with the registry locked
+void retire_table(registry_t& r, thread_table_t *t)
+{
+  for (unsigned id = 0; id < max_counters; ++id) {
+    r.retired_counters[id] += t->counters[id].load(std::memory_order_relaxed);
+    t->counters[id].store(0, std::memory_order_relaxed);
+  }
+  for (unsigned id = 0; id < max_histograms; ++id) {
+    if (auto h = t->hists[id].load(std::memory_order_relaxed)) {
+      if (!r.retired_hists[id]) {
+        r.retired_hists[id] = std::make_unique<histogram_snapshot_t>();
+      }
+      add(r.retired_hists[id].get(), *h);
+      clear(h);
+    }
+  }
+  t->in_use = false;
+}
+
+// set by the exit hook; a thread_local destructor that runs after it and
+// records a metric takes a table that late_key retires instead
+thread_local bool exited = false;
+
+// runs on thread exit; the user-provided constructor makes it
+// dynamically initialised, so its destructor is registered on first use
+struct exit_hook_t {
+  exit_hook_t() noexcept {}
+  void arm() {}
+  ~exit_hook_t() {
+    exited = true;
+    thread_table_t *t = current_table;
+    if (!t) {
+      return;
+    }
+    auto& r = registry();
+    std::lock_guard l(r.lock);
+    retire_table(r, t);
+    current_table = nullptr;
+  }
+};
+
+thread_local exit_hook_t exit_hook;
+
+registry_t::registry_t()
+{
+  // key destructors run after every thread_local destructor
+  pthread_key_create(&late_key, [](void *p) {
+    auto& r = registry();
+    std::lock_guard l(r.lock);
+    retire_table(r, static_cast<thread_table_t*>(p));
+    current_table = nullptr;
+  });
+}
+
+// Prometheus names are [a-zA-Z_:][a-zA-Z0-9_:]*
+std::string prometheus_name(const std::string& prefix, const std::string& name)
+{
+  std::string s = prefix.empty() ? name : prefix + "_" + name;
+  for (auto& c : s) {
+    if (!isalnum((unsigned char)c) && c != '_' && c != ':') {
+      c = '_';
+    }
+  }
+  if (s.empty() || isdigit((unsigned char)s[0])) {
+    s.insert(0, "_");
+  }
+  return s;
+}
+
+// HELP text may not hold raw backslashes or newlines
+std::string prometheus_help(const std::string& desc)
+{
+  std::string s;
+  for (char c : desc) {
+    if (c == '\\') {
+      s += "\\\\";
+    } else if (c == '\n') {
+      s += "\\n";
+    } else {
+      s += c;
+    }
+  }
+  return s;
+}
+
+} // anonymous namespace
+
+uint64_t perf::hist_bucket_floor(unsigned b)
+{
+  if (b < hist_sub) {
+    return b;
+  }
+  unsigned major = b / hist_sub;
+  return (uint64_t)(hist_sub + b % hist_sub) << (major - 1);
+}
+
+uint64_t histogram_snapshot_t::percentile(double p) const
+{
+  if (!count) {
+    return 0;
+  }
+  uint64_t want = std::max<uint64_t>(1, count * p / 100.0 + 0.5);
+  uint64_t seen = 0;
+  for (unsigned b = 0; b < hist_buckets; ++b) {
+    seen += buckets[b];
+    if (seen >= want) {
+      return b + 1 < hist_buckets ? hist_bucket_floor(b + 1) - 1 : UINT64_MAX;
+    }
+  }
+  return UINT64_MAX;
+}
+
+uint32_t perf::register_metric(const char *name, const char *desc, type_t t)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  auto [i, fresh] = r.ids[t].try_emplace(name, r.metrics[t].size());
+  if (fresh) {
+    if (r.metrics[t].size() == type_max[t]) {
+      r.ids[t].erase(i);
+      return 0;
+    }
+    r.metrics[t].push_back(metric_t{name, desc});
+  }
+  return i->second;
+}
+
+gauge_t::gauge_t(const char *name, const char *desc)
+  : v(&registry().gauges[register_metric(name, desc, TYPE_GAUGE)])
+{
+}
+
+thread_table_t *perf::register_thread()
+{
+  if (!exited) {
+    exit_hook.arm();
+  }
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  thread_table_t *t = nullptr;
+  for (auto i : r.threads) {
+    if (!i->in_use) {
+      t = i;
+      break;
+    }
+  }
+  if (!t) {
+    t = new thread_table_t;
+    r.threads.push_back(t);
+  }
+  t->in_use = true;
+  if (exited) {
+    pthread_setspecific(r.late_key, t);
+  }
+  return t;
+}
+
+hist_slots_t *perf::add_histogram(thread_table_t *t, uint32_t id)
+{
+  auto h = new hist_slots_t;
+  // readers may be summing; publish it whole
+  t->hists[id].store(h, std::memory_order_release);
+  return h;
+}
+
+uint64_t perf::get_counter(const std::string& name)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  auto i = r.ids[TYPE_COUNTER].find(name);
+  return i == r.ids[TYPE_COUNTER].end() ? 0 : sum_counter(r, i->second);
+}
+
+int64_t perf::get_gauge(const std::string& name)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  auto i = r.ids[TYPE_GAUGE].find(name);
+  return i == r.ids[TYPE_GAUGE].end() ? 0 : r.gauges[i->second].load();
+}
+
+bool perf::get_histogram(const std::string& name, histogram_snapshot_t *out)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+  auto i = r.ids[TYPE_HISTOGRAM].find(name);
+  if (i == r.ids[TYPE_HISTOGRAM].end()) {
+    *out = histogram_snapshot_t();
+    return false;
+  }
+  sum_histogram(r, i->second, out);
+  return true;
+}
+
+void perf::dump(Formatter *f)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+
+  f->open_object_section("counters");
+  for (auto& [name, id] : r.ids[TYPE_COUNTER]) {
+    f->dump_unsigned(name, sum_counter(r, id));
+  }
+  f->close_section();
+
+  f->open_object_section("gauges");
+  for (auto& [name, id] : r.ids[TYPE_GAUGE]) {
+    f->dump_int(name, r.gauges[id].load());
+  }
+  f->close_section();
+
+  f->open_object_section("histograms");
+  auto h = std::make_unique<histogram_snapshot_t>();
+  for (auto& [name, id] : r.ids[TYPE_HISTOGRAM]) {
+    sum_histogram(r, id, h.get());
+    f->open_object_section(name);
+    f->dump_unsigned("count", h->count);
+    f->dump_unsigned("sum", h->sum);
+    f->dump_float("avg", h->count ? (double)h->sum / h->count : 0);
+    f->dump_unsigned("p50", h->percentile(50));
+    f->dump_unsigned("p90", h->percentile(90));
+    f->dump_unsigned("p99", h->percentile(99));
+    f->dump_unsigned("p999", h->percentile(99.9));
+    f->open_array_section("buckets");
+    for (unsigned b = 0; b < hist_buckets; ++b) {
+      if (!h->buckets[b]) {
+        continue;
+      }
+      f->open_object_section("bucket");
+      f->dump_unsigned("floor", hist_bucket_floor(b));
+      f->dump_unsigned("count", h->buckets[b]);
+      f->close_section();
+    }
+    f->close_section();
+    f->close_section();
+  }
+  f->close_section();
+}
+
+void perf::dump_prometheus(std::ostream& out, const std::string& prefix)
+{
+  auto& r = registry();
+  std::lock_guard l(r.lock);
+
+  auto header = [&](const std::string& n, const metric_t& m,
+                    const char *type) {
+    if (!m.desc.empty()) {
+      out << "# HELP " << n << " " << prometheus_help(m.desc) << "\n";
+    }
+    out << "# TYPE " << n << " " << type << "\n";
+  };
+
+  for (auto& [name, id] : r.ids[TYPE_COUNTER]) {
+    std::string n = prometheus_name(prefix, name);
+    if (n.size() < 6 || n.compare(n.size() - 6, 6, "_total") != 0) {
+      n += "_total";
+    }
+    header(n, r.metrics[TYPE_COUNTER][id], "counter");
+    out << n << " " << sum_counter(r, id) << "\n";
+  }
+  for (auto& [name, id] : r.ids[TYPE_GAUGE]) {
+    std::string n = prometheus_name(prefix, name);
+    header(n, r.metrics[TYPE_GAUGE][id], "gauge");
+    out << n << " " << r.gauges[id].load() << "\n";
+  }
+  auto h = std::make_unique<histogram_snapshot_t>();
+  for (auto& [name, id] : r.ids[TYPE_HISTOGRAM]) {
+    std::string n = prometheus_name(prefix, name);
+    header(n, r.metrics[TYPE_HISTOGRAM][id], "histogram");
+    sum_histogram(r, id, h.get());
+    // the same buckets every time, one per power of two, so series
+    // don't come and go between scrapes; they are cumulative, "le" is
+    // inclusive, and powers of two fall on our bucket boundaries
+    uint64_t seen = 0;
+    unsigned b = 0;
+    for (unsigned k = 0; k < 64; ++k) {
+      for (unsigned end = hist_bucket(1ull << k); b < end; ++b) {
+        seen += h->buckets[b];
+      }
+      out << n << "_bucket{le=\"" << (1ull << k) - 1 << "\"} " << seen
+          << "\n";
+    }
+    out << n << "_bucket{le=\"+Inf\"} " << h->count << "\n";
+    out << n << "_sum " << h->sum << "\n";
+    out << n << "_count " << h->count << "\n";
+  }
+}
@@ -0,0 +1,161 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "formatter.h"
+#include "likely.h"
+
+namespace perf {
+
+/**
+ * Performance counters.
+ *
+ * Metrics are declared where they're used, usually as statics, and are
+ * identified by name; metrics sharing a name are one metric.  Counters
+ * and histograms are recorded into a per-thread table with plain
+ * loads and stores, so the hot path takes no locked instructions and
+ * no shared cachelines.  Reading sums the tables of live threads and
+ * what exited threads left behind.  Gauges are set rather than added
+ * to, so they are a single shared word.
+ *
+ * Histograms are log-linear: values below 2^hist_sub_bits have a bucket
+ * each, and every power of two above that is split into 2^hist_sub_bits
+ * linear buckets, so a bucket is within 12.5% of the values in it.
+ */
+
+enum type_t {
+  TYPE_COUNTER = 0,
+  TYPE_GAUGE,
+  TYPE_HISTOGRAM,
+};
+
+constexpr unsigned max_counters = 1024;
+constexpr unsigned max_gauges = 256;
+constexpr unsigned max_histograms = 128;
+
+constexpr unsigned hist_sub_bits = 3;
+constexpr unsigned hist_sub = 1u << hist_sub_bits;
+constexpr unsigned hist_buckets = (64 - hist_sub_bits + 1) * hist_sub;
+
+/// id for name among metrics of type t, shared by every metric of that
+/// name; 0, which is never reported, once full
+uint32_t register_metric(const char *name, const char *desc, type_t t);
+
+inline unsigned hist_bucket(uint64_t v) {
+  if (v < hist_sub) {
+    return v;
+  }
+  unsigned msb = 63 - __builtin_clzll(v);
+  return (msb - hist_sub_bits + 1) * hist_sub +
+    ((v >> (msb - hist_sub_bits)) & (hist_sub - 1));
+}
+
+/// smallest value in bucket b
+uint64_t hist_bucket_floor(unsigned b);
+
+struct hist_slots_t {
+  std::atomic<uint64_t> sum = {0};
+  std::atomic<uint64_t> buckets[hist_buckets] = {};
+};
+
+// written by its thread only; others read it while summing
+struct thread_table_t {
+  std::atomic<uint64_t> counters[max_counters] = {};
+  std::atomic<hist_slots_t*> hists[max_histograms] = {};
+  bool in_use = false;   // tables of exited threads are reused
+};
+
+thread_table_t *register_thread();
+hist_slots_t *add_histogram(thread_table_t *t, uint32_t id);
+
+inline thread_local thread_table_t *current_table
+  __attribute__((tls_model("initial-exec"))) = nullptr;
+
+inline thread_table_t *get_table() {
+  if (unlikely(!current_table)) {
+    current_table = register_thread();
+  }
+  return current_table;
+}
+
+inline void bump(std::atomic<uint64_t>& c, uint64_t v) {
+  c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+class counter_t {
+  const uint32_t id;
+public:
+  explicit counter_t(const char *name, const char *desc = "")
+    : id(register_metric(name, desc, TYPE_COUNTER)) {}
+
+  void inc(uint64_t v = 1) {
+    bump(get_table()->counters[id], v);
+  }
+};
+
+class gauge_t {
+  std::atomic<int64_t> *v;
+public:
+  explicit gauge_t(const char *name, const char *desc = "");
+
+  void set(int64_t n) {
+    v->store(n, std::memory_order_relaxed);
+  }
+  void inc(int64_t n = 1) {
+    v->fetch_add(n, std::memory_order_relaxed);
+  }
+  void dec(int64_t n = 1) {
+    v->fetch_sub(n, std::memory_order_relaxed);
+  }
+  int64_t get() const {
+    return v->load(std::memory_order_relaxed);
+  }
+};
+
+class histogram_t {
+  const uint32_t id;
+public:
+  explicit histogram_t(const char *name, const char *desc = "")
+    : id(register_metric(name, desc, TYPE_HISTOGRAM)) {}
+
+  /// usually a latency in ns
+  void record(uint64_t v) {
+    thread_table_t *t = get_table();
+    hist_slots_t *h = t->hists[id].load(std::memory_order_relaxed);
+    if (unlikely(!h)) {
+      h = add_histogram(t, id);
+    }
+    bump(h->sum, v);
+    bump(h->buckets[hist_bucket(v)], 1);
+  }
+};
+
+struct histogram_snapshot_t {
+  uint64_t count = 0;   // sum of the buckets
+  uint64_t sum = 0;
+  uint64_t buckets[hist_buckets] = {};
+
+  /// upper bound of the bucket holding the p'th percentile (0-100)
+  uint64_t percentile(double p) const;
+};
+
+/// summed over all threads; 0 or empty if there's no such metric
+uint64_t get_counter(const std::string& name);
+int64_t get_gauge(const std::string& name);
+bool get_histogram(const std::string& name, histogram_snapshot_t *out);
+
+/// everything, with histogram percentiles and non-empty buckets
+void dump(Formatter *f);
+
+/// Prometheus text exposition format, names prefixed with prefix.
+/// Counters get a _total suffix; histograms have a bucket per power of
+/// two, whether or not anything is in it.
+void dump_prometheus(std::ostream& out, const std::string& prefix = "");
+
+} // namespace perf
+
+#endif // PERF_COUNTERS_H
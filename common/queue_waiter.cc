@@ -0,0 +1,74 @@
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "futex.h"
+#include "queue_waiter.h"
+
+queue_waiter_t::~queue_waiter_t()
+{
+  if (int fd = efd.load(); fd >= 0) {
+    ::close(fd);
+  }
+}
+
+void queue_waiter_t::wake()
+{
+  if (armed.exchange(0, std::memory_order_acq_rel) == 0) {
+    return;   // someone else got there
+  }
+  // the consumer set efd before arming, so the exchange made it visible
+  if (int fd = efd.load(std::memory_order_relaxed); fd >= 0) {
+    uint64_t one = 1;
+    ssize_t r = ::write(fd, &one, sizeof(one));
+    (void)r;
+  } else {
+    futex_wake(&armed);
+  }
+}
+
+int queue_waiter_t::event_fd()
+{
+  int fd = efd.load(std::memory_order_relaxed);
+  if (fd < 0) {
+    fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    efd.store(fd, std::memory_order_relaxed);
+  }
+  return fd;
+}
+
+void queue_waiter_t::ack()
+{
+  armed.store(0, std::memory_order_relaxed);
+  uint64_t n;
+  ssize_t r = ::read(efd.load(std::memory_order_relaxed), &n, sizeof(n));
+  (void)r;
+}
+
+void queue_waiter_t::sleep(std::chrono::nanoseconds timeout)
+{
+  bool forever = timeout == std::chrono::nanoseconds::max();
+  if (int fd = efd.load(std::memory_order_relaxed); fd >= 0) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ms = forever ? -1 :
+      std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count();
+    if (::poll(&pfd, 1, ms) <= 0) {
+      if (armed.exchange(0, std::memory_order_acq_rel) != 0) {
+        return;   // nobody is waking us
+      }
+      // a producer disarmed us, and its write is in or on the way; take
+      // it now, so that it can't cut short the next wait
+      pfd.revents = 0;
+      ::poll(&pfd, 1, -1);
+    }
+    ack();
+    return;
+  }
+  struct timespec ts;
+  if (!forever) {
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+  }
+  futex_wait(&armed, 1, forever ? nullptr : &ts);
+  armed.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,74 @@
+#ifndef QUEUE_WAITER_H
+#define QUEUE_WAITER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "likely.h"
+
+/**
+ * Lets an idle queue consumer sleep until a producer has something.
+ *
+ * The consumer arms the waiter and then checks the queue once more
+ * before sleeping; producers call notify() after publishing, which
+ * costs a fence and a load unless the consumer is actually asleep.
+ * The consumer sleeps on a futex, or, once event_fd() has been asked
+ * for, on an eventfd it can also watch with poll/epoll alongside other
+ * descriptors.  One consumer per waiter.
+ */
+class queue_waiter_t {
+  std::atomic<uint32_t> armed = {0};   // futex word
+  std::atomic<int> efd = {-1};
+
+  void wake();
+
+public:
+  queue_waiter_t() = default;
+  ~queue_waiter_t();
+  queue_waiter_t(const queue_waiter_t&) = delete;
+  queue_waiter_t& operator=(const queue_waiter_t&) = delete;
+
+  /// producers, after publishing
+  void notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (unlikely(armed.load(std::memory_order_relaxed))) {
+      wake();
+    }
+  }
+
+  /// consumer: sleep until ready() or timeout; ready() once done
+  template <class Ready>
+  bool wait(Ready&& ready, std::chrono::nanoseconds timeout =
+            std::chrono::nanoseconds::max()) {
+    armed.store(1, std::memory_order_seq_cst);
+    if (ready()) {
+      armed.store(0, std::memory_order_relaxed);
+      return true;
+    }
+    sleep(timeout);
+    return ready();
+  }
+
+  /// consumer: switch to an eventfd, readable while a wakeup is pending.
+  /// Arm with prepare_wait(), and after poll says readable, ack().  Call
+  /// it while not waiting; producers pick it up from the next arming.
+  int event_fd();
+  /// arm, and say whether it's still worth sleeping
+  template <class Ready>
+  bool prepare_wait(Ready&& ready) {
+    armed.store(1, std::memory_order_seq_cst);
+    if (ready()) {
+      armed.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+  void ack();
+
+private:
+  /// returns disarmed, with no wakeup left pending
+  void sleep(std::chrono::nanoseconds timeout);
+};
+
+#endif // QUEUE_WAITER_H
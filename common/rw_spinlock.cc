@@ -0,0 +1,140 @@
+#include <climits>
+#include <thread>
+
+#include <sched.h>
+
+#include "futex.h"
+#include "rw_spinlock.h"
+#include "spinlock.h"
+
+namespace {
+
+constexpr unsigned spin_budget = 4096;
+constexpr unsigned max_slots = 256;
+
+unsigned get_spin_budget()
+{
+  static unsigned budget =
+    std::thread::hardware_concurrency() <= 1 ? 0 : spin_budget;
+  return budget;
+}
+
+} // anonymous namespace
+
+thread_local unsigned rw_spinlock::slot_ix = 0;
+thread_local unsigned rw_spinlock::held_shared = 0;
+thread_local unsigned rw_spinlock::slot_recheck = 0;
+
+rw_spinlock::rw_spinlock()
+{
+  unsigned n = 1;
+  while (n < std::thread::hardware_concurrency() && n < max_slots) {
+    n <<= 1;
+  }
+  mask = n - 1;
+  slots.reset(new slot_t[n]);
+}
+
+void rw_spinlock::refresh_slot()
+{
+  int cpu = sched_getcpu();
+  slot_ix = cpu < 0 ? 0 : cpu;
+  slot_recheck = 256;
+}
+
+bool rw_spinlock::try_lock_shared()
+{
+  auto& slot = slots[reader_slot()];
+  slot.readers.fetch_add(1, std::memory_order_seq_cst);
+  if (writer.load(std::memory_order_seq_cst) != 0) {
+    slot.readers.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+  ++held_shared;
+  return true;
+}
+
+void rw_spinlock::wait_writer()
+{
+  for (unsigned i = 0; i < get_spin_budget(); ++i) {
+    if (writer.load(std::memory_order_acquire) == 0) {
+      return;
+    }
+    cpu_relax();
+  }
+  uint32_t w = writer.load(std::memory_order_relaxed);
+  while (w != 0) {
+    if (w == 2 ||
+        writer.compare_exchange_weak(w, 2, std::memory_order_relaxed)) {
+      futex_wait(&writer, 2);
+    }
+    w = writer.load(std::memory_order_acquire);
+  }
+}
+
+void rw_spinlock::lock_shared_slow()
+{
+  while (!try_lock_shared()) {
+    wait_writer();
+  }
+}
+
+void rw_spinlock::acquire_writer()
+{
+  for (unsigned i = 0; i < get_spin_budget(); ++i) {
+    uint32_t w = writer.load(std::memory_order_relaxed);
+    if (w == 0 &&
+        writer.compare_exchange_weak(w, 1, std::memory_order_seq_cst)) {
+      return;
+    }
+    cpu_relax();
+  }
+  while (writer.exchange(2, std::memory_order_seq_cst) != 0) {
+    futex_wait(&writer, 2);
+  }
+}
+
+bool rw_spinlock::readers_drained() const
+{
+  for (unsigned i = 0; i <= mask; ++i) {
+    if (slots[i].readers.load(std::memory_order_seq_cst) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void rw_spinlock::lock()
+{
+  acquire_writer();
+  // new readers now back off; wait for the ones inside to leave
+  unsigned spun = 0;
+  while (!readers_drained()) {
+    if (spun < get_spin_budget()) {
+      ++spun;
+      cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+bool rw_spinlock::try_lock()
+{
+  uint32_t w = 0;
+  if (!writer.compare_exchange_strong(w, 1, std::memory_order_seq_cst)) {
+    return false;
+  }
+  if (!readers_drained()) {
+    unlock();
+    return false;
+  }
+  return true;
+}
+
+void rw_spinlock::unlock()
+{
+  if (writer.exchange(0, std::memory_order_release) == 2) {
+    futex_wake(&writer, INT_MAX);
+  }
+}
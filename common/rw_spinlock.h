@@ -0,0 +1,76 @@
+#ifndef RW_SPINLOCK_H
+#define RW_SPINLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "likely.h"
+
+/**
+ * Writer-preferring reader-writer spinlock.
+ *
+ * Readers count themselves in a per-cpu slot instead of one shared
+ * word, so concurrent readers on different cpus don't bounce a
+ * cacheline.  A writer announces itself, which turns new readers away,
+ * and then waits for every slot to drain; the cost of a write grows
+ * with the number of slots, so this suits read-mostly data.  Waiters
+ * spin briefly and then park on a futex until the writer is done.
+ *
+ * Works with std::unique_lock and std::shared_lock.  A reader releases
+ * the slot it counted itself in even if it has since moved cpu.
+ */
+class rw_spinlock final
+{
+public:
+  rw_spinlock();
+
+  void lock_shared() {
+    auto& slot = slots[reader_slot()];
+    slot.readers.fetch_add(1, std::memory_order_seq_cst);
+    if (unlikely(writer.load(std::memory_order_seq_cst) != 0)) {
+      slot.readers.fetch_sub(1, std::memory_order_release);
+      lock_shared_slow();
+      return;
+    }
+    ++held_shared;
+  }
+  bool try_lock_shared();
+  void unlock_shared() {
+    --held_shared;
+    slots[slot_ix & mask].readers.fetch_sub(1, std::memory_order_release);
+  }
+
+  void lock();
+  bool try_lock();
+  void unlock();
+
+private:
+  struct alignas(64) slot_t {
+    std::atomic<int> readers = {0};
+  };
+
+  // 0 free, 1 held or wanted by a writer, 2 the same with parked waiters
+  std::atomic<uint32_t> writer = {0};
+  unsigned mask;
+  std::unique_ptr<slot_t[]> slots;
+
+  // per-thread: the slot we count reads in, fixed while any are held
+  static thread_local unsigned slot_ix;
+  static thread_local unsigned held_shared;
+  static thread_local unsigned slot_recheck;
+
+  unsigned reader_slot() {
+    if (held_shared == 0 && slot_recheck-- == 0) {
+      refresh_slot();
+    }
+    return slot_ix & mask;
+  }
+  static void refresh_slot();
+  void lock_shared_slow();
+  void acquire_writer();
+  void wait_writer();
+  bool readers_drained() const;
+};
+
+#endif // RW_SPINLOCK_H
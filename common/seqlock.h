@@ -0,0 +1,102 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "spinlock.h"
+
+/**
+ * Sequence lock around a small trivially copyable record.
+ *
+ * Readers never write shared memory: they copy the record out and retry
+ * if a writer got in meanwhile, so read-mostly data costs readers no
+ * cacheline bouncing.  Writers exclude each other by making the
+ * sequence odd.  The record is kept as relaxed atomic words, so torn
+ * reads are detected rather than being a data race.
+ */
+template <class T>
+class seqlock {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "seqlock records are copied word by word");
+  static constexpr size_t words = (sizeof(T) + 7) / 8;
+
+  std::atomic<uint32_t> seq = {0};   // odd while a write is in progress
+  std::atomic<uint64_t> data[words];
+
+  void copy_in(const T& v) {
+    uint64_t buf[words] = {};
+    memcpy(buf, &v, sizeof(T));
+    for (size_t i = 0; i < words; ++i) {
+      data[i].store(buf[i], std::memory_order_relaxed);
+    }
+  }
+  T copy_out() const {
+    uint64_t buf[words];
+    for (size_t i = 0; i < words; ++i) {
+      buf[i] = data[i].load(std::memory_order_relaxed);
+    }
+    T v;
+    memcpy(&v, buf, sizeof(T));
+    return v;
+  }
+
+  uint32_t write_begin() {
+    uint32_t s = seq.load(std::memory_order_relaxed);
+    while ((s & 1) ||
+           !seq.compare_exchange_weak(s, s + 1, std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
+      cpu_relax();
+      s = seq.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return s;
+  }
+  void write_end(uint32_t s) {
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+public:
+  explicit seqlock(const T& v = T()) {
+    copy_in(v);
+  }
+
+  /// one attempt; false if it raced with a writer
+  bool try_load(T *out) const {
+    uint32_t s = seq.load(std::memory_order_acquire);
+    if (s & 1) {
+      return false;
+    }
+    *out = copy_out();
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq.load(std::memory_order_relaxed) == s;
+  }
+
+  T load() const {
+    T v;
+    while (!try_load(&v)) {
+      cpu_relax();
+    }
+    return v;
+  }
+
+  void store(const T& v) {
+    uint32_t s = write_begin();
+    copy_in(v);
+    write_end(s);
+  }
+
+  /// read-modify-write under the write side
+  template <class F>
+  void update(F&& f) {
+    uint32_t s = write_begin();
+    T v = copy_out();
+    f(v);
+    copy_in(v);
+    write_end(s);
+  }
+};
+
+#endif // SEQLOCK_H
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <thread>
+
+#include <sched.h>
+
+#include "futex.h"
+#include "spinlock.h"
+
+namespace {
+
+// cpu_relax() calls before parking, and the longest run between loads
+constexpr unsigned spin_budget = 4096;
+constexpr unsigned max_backoff = 64;
+constexpr unsigned yields = 4;
+
+bool single_cpu()
+{
+  static bool single = std::thread::hardware_concurrency() <= 1;
+  return single;
+}
+
+} // anonymous namespace
+
+void spinlock::lock_slow()
+{
+  unsigned budget = single_cpu() ? 0 : spin_budget;
+  unsigned backoff = 1;
+  for (unsigned spun = 0; spun < budget; spun += backoff) {
+    uint32_t s = state.load(std::memory_order_relaxed);
+    if (s == 0 &&
+        state.compare_exchange_weak(s, 1, std::memory_order_acquire,
+                                    std::memory_order_relaxed)) {
+      return;
+    }
+    if (s == 2) {
+      // others are already parked; don't jump the queue by spinning
+      break;
+    }
+    for (unsigned i = 0; i < backoff; ++i) {
+      cpu_relax();
+    }
+    backoff = std::min(backoff * 2, max_backoff);
+  }
+
+  // give a preempted holder the chance to run
+  for (unsigned i = 0; i < yields; ++i) {
+    if (try_lock()) {
+      return;
+    }
+    sched_yield();
+  }
+
+  // we can't tell whether others are parked, so take it as contended
+  while (state.exchange(2, std::memory_order_acquire) != 0) {
+    futex_wait(&state, 2);
+  }
+}
+
+void spinlock::wake()
+{
+  futex_wake(&state);
+}
@@ -2,6 +2,9 @@
 #define SPINLOCK_H
 
 #include <atomic>
+#include <cstdint>
+
+#include "likely.h"
 
 class spinlock;
 
@@ -10,24 +13,72 @@ inline void spin_unlock(std::atomic_flag& lock);
 inline void spin_lock(spinlock& lock);
 inline void spin_unlock(spinlock& lock);
 
+// tell the cpu we're spinning (PAUSE / YIELD), so an SMT sibling
+// holding the lock isn't starved
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield" ::: "memory");
+#elif defined(__powerpc__) || defined(__ppc__)
+  asm volatile("or 27,27,27" ::: "memory");
+#else
+  asm volatile("" ::: "memory");
+#endif
+}
+
+/**
+ * Adaptive lock: spin, then park.
+ *
+ * The uncontended path is a single CAS.  Waiters spin reading the lock
+ * word (test and test-and-set) with exponentially growing runs of
+ * cpu_relax(), yield a few times, and then sleep on a futex until the
+ * holder hands the lock back.  On a single cpu there is no point in
+ * spinning, so waiters go straight to yielding.
+ */
 class spinlock final
 {
-  std::atomic_flag af = ATOMIC_FLAG_INIT;
+  // 0 free, 1 held, 2 held and there may be parked waiters
+  std::atomic<uint32_t> state = {0};
+
+  void lock_slow();
+  void wake();
 
   public:
   void lock() {
-    spin_lock(af);
+    uint32_t s = 0;
+    if (likely(state.compare_exchange_strong(s, 1, std::memory_order_acquire,
+                                             std::memory_order_relaxed))) {
+      return;
+    }
+    lock_slow();
+  }
+
+  bool try_lock() {
+    uint32_t s = 0;
+    return state.load(std::memory_order_relaxed) == 0 &&
+      state.compare_exchange_strong(s, 1, std::memory_order_acquire,
+                                    std::memory_order_relaxed);
   }
 
   void unlock() noexcept {
-    spin_unlock(af);
+    if (unlikely(state.exchange(0, std::memory_order_release) == 2)) {
+      wake();
+    }
+  }
+
+  bool is_locked() const {
+    return state.load(std::memory_order_relaxed) != 0;
   }
 };
 
 // Free functions:
 inline void spin_lock(std::atomic_flag& lock) {
-  while(lock.test_and_set(std::memory_order_acquire))
-    ;
+  while (lock.test_and_set(std::memory_order_acquire)) {
+    while (lock.test(std::memory_order_relaxed)) {
+      cpu_relax();
+    }
+  }
 }
 inline void spin_unlock(std::atomic_flag& lock) {
   lock.clear(std::memory_order_release);
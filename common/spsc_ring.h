@@ -0,0 +1,121 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "queue_waiter.h"
+
+/**
+ * Bounded single-producer single-consumer ring.
+ *
+ * Each side owns one index and keeps a cached copy of the other's, so
+ * in steady state a message costs no shared cacheline reads beyond the
+ * slot itself.  Values are moved in and out; a buffer::list crosses
+ * over without touching its raws.
+ */
+template <class T>
+class spsc_ring {
+public:
+  /// capacity is rounded up to a power of two
+  explicit spsc_ring(size_t capacity)
+    : mask(round_up(capacity) - 1),
+      slots(static_cast<slot_t*>(::operator new[](sizeof(slot_t) * (mask + 1)))) {}
+  ~spsc_ring() {
+    T v;
+    while (pop(v))
+      ;
+    ::operator delete[](slots);
+  }
+  spsc_ring(const spsc_ring&) = delete;
+  spsc_ring& operator=(const spsc_ring&) = delete;
+
+  size_t capacity() const {
+    return mask + 1;
+  }
+
+  // producer
+  bool push(T&& v) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail_cache > mask) {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if (h - tail_cache > mask) {
+        return false;
+      }
+    }
+    new (&slots[h & mask]) T(std::move(v));
+    head.store(h + 1, std::memory_order_release);
+    waiter.notify();
+    return true;
+  }
+
+  // consumer
+  bool pop(T& v) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head_cache) {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t == head_cache) {
+        return false;
+      }
+    }
+    T *p = std::launder(reinterpret_cast<T*>(&slots[t & mask]));
+    v = std::move(*p);
+    p->~T();
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// consumer: up to max values into out, returning how many
+  template <class OutputIt>
+  size_t pop_batch(OutputIt out, size_t max) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    head_cache = head.load(std::memory_order_acquire);
+    size_t n = std::min(head_cache - t, max);
+    for (size_t i = 0; i < n; ++i) {
+      T *p = std::launder(reinterpret_cast<T*>(&slots[(t + i) & mask]));
+      *out++ = std::move(*p);
+      p->~T();
+    }
+    tail.store(t + n, std::memory_order_release);
+    return n;
+  }
+
+  bool empty() const {
+    return tail.load(std::memory_order_relaxed) ==
+      head.load(std::memory_order_acquire);
+  }
+
+  /// consumer: sleep until something arrives; false on timeout
+  bool wait(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) {
+    return waiter.wait([this] { return !empty(); }, timeout);
+  }
+  queue_waiter_t& get_waiter() {
+    return waiter;
+  }
+
+private:
+  struct slot_t {
+    alignas(T) unsigned char bytes[sizeof(T)];
+  };
+
+  static size_t round_up(size_t n) {
+    size_t r = 2;
+    while (r < n) {
+      r <<= 1;
+    }
+    return r;
+  }
+
+  const size_t mask;
+  slot_t *const slots;
+  alignas(64) std::atomic<size_t> head = {0};   // written by the producer
+  size_t tail_cache = 0;
+  alignas(64) std::atomic<size_t> tail = {0};   // written by the consumer
+  size_t head_cache = 0;
+  alignas(64) queue_waiter_t waiter;
+};
+
+#endif // SPSC_RING_H
@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <mutex>
+
+#include "tsc_clock.h"
+#include "arch/probe.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include "arch/intel.h"
+#endif
+
+using namespace tsc_detail;
+
+seqlock<calib_t> tsc_detail::calib;
+std::atomic<int> tsc_detail::state = {0};
+
+namespace {
+
+constexpr uint64_t calibrate_ns = 1000000;       // first estimate, spun for
+constexpr uint64_t initial_span_ns = 10000000;
+constexpr uint64_t max_span_ns = 1000000000;
+constexpr double max_slew = 0.0005;              // rate steering, 500ppm
+constexpr int64_t max_lag_ns = 100000;           // beyond this we step
+
+std::mutex calib_lock;
+std::once_flag calibrated;
+uint64_t ref_ticks = 0, ref_ns = 0;   // first sample; all under calib_lock
+uint64_t span_ns = initial_span_ns;
+double ns_per_tick = 0;
+
+uint64_t mono_ns()
+{
+  return mono_clock::now().time_since_epoch().count();
+}
+
+// a (ticks, ns) pair, from the tightest of a few tries
+void sample(uint64_t *ticks, uint64_t *ns)
+{
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 5; ++i) {
+    uint64_t t0 = read_counter();
+    uint64_t n = mono_ns();
+    uint64_t t1 = read_counter();
+    if (t1 - t0 < best) {
+      best = t1 - t0;
+      *ticks = t0 + (t1 - t0) / 2;
+      *ns = n;
+    }
+  }
+}
+
+uint64_t to_mult(double rate)
+{
+  return rate * 4294967296.0;
+}
+
+bool have_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  arch_probe();
+  return arch_intel_invariant_tsc;
+#elif defined(__aarch64__)
+  // the generic timer runs at a fixed frequency
+  return true;
+#else
+  return false;
+#endif
+}
+
+void init()
+{
+  std::lock_guard l(calib_lock);
+  if (!have_tsc()) {
+    state.store(-1, std::memory_order_release);
+    return;
+  }
+  sample(&ref_ticks, &ref_ns);
+  uint64_t t, n;
+  do {
+    sample(&t, &n);
+  } while (n - ref_ns < calibrate_ns);
+  if (t <= ref_ticks) {
+    state.store(-1, std::memory_order_release);
+    return;
+  }
+  ns_per_tick = (double)(n - ref_ns) / (double)(t - ref_ticks);
+  calib.store(calib_t{t, n, to_mult(ns_per_tick),
+                      (uint64_t)(span_ns / ns_per_tick)});
+  state.store(1, std::memory_order_release);
+}
+
+// called with calib_lock held
+void recalibrate_locked()
+{
+  uint64_t t, n;
+  sample(&t, &n);
+  calib_t c = calib.load();
+  // carry on from where the current calibration has got to, so we
+  // never step back
+  uint64_t cur = to_ns(c, t);
+  int64_t err = n - cur;
+  if (err > max_lag_ns) {
+    // well behind (a suspend?); stepping forward is safe
+    cur = n;
+    err = 0;
+  }
+  // the rate over everything seen so far, steered so that we meet
+  // mono_clock by the end of the next span
+  ns_per_tick = (double)(n - ref_ns) / (double)(t - ref_ticks);
+  span_ns = std::min(span_ns * 2, max_span_ns);
+  uint64_t span_ticks = span_ns / ns_per_tick;
+  double steer = std::clamp((double)err / span_ns, -max_slew, max_slew);
+  calib.store(calib_t{t, cur, to_mult(ns_per_tick * (1 + steer)), span_ticks});
+}
+
+} // anonymous namespace
+
+tsc_clock::time_point tsc_clock::now_slow() noexcept
+{
+  int s = state.load(std::memory_order_acquire);
+  if (s == 0) {
+    std::call_once(calibrated, init);
+    s = state.load(std::memory_order_acquire);
+  }
+  if (s < 0) {
+    return time_point(mono_clock::now().time_since_epoch());
+  }
+  uint64_t t = read_counter();
+  calib_t c = calib.load();
+  // signed: we may be on a cpu whose counter is a little behind
+  if ((int64_t)(t - c.base_ticks) >= (int64_t)c.span_ticks) {
+    std::unique_lock l(calib_lock, std::try_to_lock);
+    if (l.owns_lock()) {
+      c = calib.load();
+      if ((int64_t)(t - c.base_ticks) >= (int64_t)c.span_ticks) {
+        recalibrate_locked();
+        c = calib.load();
+      }
+    }
+    // otherwise someone else is on it; the old calibration will do
+  }
+  return time_point(duration(to_ns(c, t)));
+}
+
+bool tsc_clock::is_tsc()
+{
+  if (state.load(std::memory_order_acquire) == 0) {
+    now_slow();
+  }
+  return state.load(std::memory_order_acquire) > 0;
+}
+
+double tsc_clock::ticks_per_sec()
+{
+  if (!is_tsc()) {
+    return 0;
+  }
+  std::lock_guard l(calib_lock);
+  return 1e9 / ns_per_tick;
+}
+
+void tsc_clock::recalibrate()
+{
+  if (!is_tsc()) {
+    return;
+  }
+  std::lock_guard l(calib_lock);
+  recalibrate_locked();
+}
@@ -0,0 +1,112 @@
+#ifndef TSC_CLOCK_H
+#define TSC_CLOCK_H
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "likely.h"
+#include "seqlock.h"
+#include "time.h"
+
+namespace tsc_detail {
+
+// ns = base_ns + (ticks - base_ticks) * mult / 2^32, good until
+// base_ticks + span_ticks, when it's recalibrated
+struct calib_t {
+  uint64_t base_ticks = 0;
+  uint64_t base_ns = 0;
+  uint64_t mult = 0;
+  uint64_t span_ticks = 0;
+};
+
+extern seqlock<calib_t> calib;
+extern std::atomic<int> state;   // 0 not yet calibrated, 1 tsc, -1 fallback
+
+inline uint64_t read_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  return 0;
+#endif
+}
+
+inline uint64_t to_ns(const calib_t& c, uint64_t ticks) {
+  int64_t d = ticks - c.base_ticks;   // may be a little behind, on another cpu
+  return c.base_ns + (int64_t)(((__int128)d * c.mult) >> 32);
+}
+
+} // namespace tsc_detail
+
+/**
+ * Monotonic clock read from the cpu's counter (rdtsc, or cntvct_el0 on
+ * arm64) rather than clock_gettime.
+ *
+ * The counter is calibrated against mono_clock on first use, and then
+ * recalibrated whenever the current calibration runs out (every 10ms,
+ * growing to every second).  Recalibration steers the rate so the two
+ * clocks converge without tsc_clock ever stepping back, so its times
+ * are mono_clock times, give or take a few microseconds, and to_mono()
+ * is free.  Durations are timespans.
+ *
+ * Without an invariant TSC (one that ticks at the same rate whatever
+ * the power state), or on other architectures, it is mono_clock.
+ */
+class tsc_clock {
+public:
+  typedef timespan duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<tsc_clock> time_point;
+  static constexpr const bool is_steady = true;
+
+  static time_point now() noexcept {
+    if (likely(tsc_detail::state.load(std::memory_order_relaxed) > 0)) {
+      uint64_t t = tsc_detail::read_counter();
+      tsc_detail::calib_t c;
+      if (likely(tsc_detail::calib.try_load(&c)) &&
+          likely(t - c.base_ticks < c.span_ticks)) {
+        return time_point(duration(tsc_detail::to_ns(c, t)));
+      }
+    }
+    return now_slow();
+  }
+
+  /// false if we're falling back to mono_clock
+  static bool is_tsc();
+
+  /// counter ticks per second, as calibrated; 0 without a tsc
+  static double ticks_per_sec();
+
+  /// recalibrate against mono_clock now
+  static void recalibrate();
+
+  static mono_time to_mono(const time_point& t) {
+    return mono_time(t.time_since_epoch());
+  }
+  static time_point from_mono(const mono_time& t) {
+    return time_point(t.time_since_epoch());
+  }
+
+  static bool is_zero(const time_point& t) {
+    return (t == time_point::min());
+  }
+
+  static time_point zero() {
+    return time_point::min();
+  }
+
+private:
+  static time_point now_slow() noexcept;
+};
+
+typedef tsc_clock::time_point tsc_time;
+
+#endif // TSC_CLOCK_H
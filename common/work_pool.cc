@@ -0,0 +1,393 @@
+#include <climits>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "assertion.h"
+#include "futex.h"
+#include "numa.h"
+#include "spinlock.h"
+#include "work_pool.h"
+
+namespace {
+
+thread_local const work_pool_t *current_pool = nullptr;
+thread_local int current_index = -1;
+
+uint64_t next_random(uint64_t& x)
+{
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+} // anonymous namespace
+
+// Chase-Lev deque, after Le et al., "Correct and Efficient Work-Stealing
+// for Weak Memory Models" (PPoPP '13)
+struct work_pool_t::deque_t {
+  struct array_t {
+    const size_t mask;
+    std::unique_ptr<std::atomic<task_t*>[]> slots;
+
+    explicit array_t(size_t n) : mask(n - 1), slots(new std::atomic<task_t*>[n]) {}
+    task_t *get(int64_t i) const {
+      return slots[i & mask].load(std::memory_order_relaxed);
+    }
+    void put(int64_t i, task_t *t) {
+      slots[i & mask].store(t, std::memory_order_relaxed);
+    }
+  };
+
+  alignas(64) std::atomic<int64_t> top = {0};
+  alignas(64) std::atomic<int64_t> bottom = {0};
+  std::atomic<array_t*> array;
+  // outgrown arrays stay until the pool goes, as thieves may still read them
+  std::vector<std::unique_ptr<array_t>> arrays;
+
+  deque_t() {
+    arrays.emplace_back(new array_t(256));
+    array = arrays.back().get();
+  }
+
+  // owner only
+  void push(task_t *t) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t tp = top.load(std::memory_order_acquire);
+    array_t *a = array.load(std::memory_order_relaxed);
+    if (b - tp > (int64_t)a->mask) {
+      auto bigger = new array_t((a->mask + 1) * 2);
+      for (int64_t i = tp; i < b; ++i) {
+        bigger->put(i, a->get(i));
+      }
+      arrays.emplace_back(bigger);
+      array.store(bigger, std::memory_order_release);
+      a = bigger;
+    }
+    a->put(b, t);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // owner only
+  task_t *take() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    array_t *a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    task_t *x = a->get(b);
+    if (t == b) {
+      // the last one; race thieves for it
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        x = nullptr;
+      }
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+  }
+
+  // any thread
+  task_t *steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    array_t *a = array.load(std::memory_order_acquire);
+    task_t *x = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return x;
+  }
+
+  bool empty() const {
+    return top.load(std::memory_order_relaxed) >=
+      bottom.load(std::memory_order_relaxed);
+  }
+};
+
+struct work_pool_t::worker_t {
+  deque_t deque;
+  std::thread thread;
+  unsigned index = 0;
+  int cpu = -1;                  // pinned to, or -1
+  std::atomic<int> node = {0};   // refreshed now and then unless pinned
+  uint64_t rng = 0;
+};
+
+struct work_pool_t::job_t {
+  std::atomic<size_t> remaining;
+  std::atomic<uint32_t> done = {0};   // futex word
+  std::atomic<bool> failed = {false};
+  std::mutex lock;
+  std::exception_ptr error;
+  const std::function<void(size_t, size_t)>& fn;
+  const size_t grain;
+
+  job_t(size_t n, size_t grain, const std::function<void(size_t, size_t)>& fn)
+    : remaining(n), fn(fn), grain(grain) {}
+
+  void fail(std::exception_ptr e) {
+    std::lock_guard l(lock);
+    if (!error) {
+      error = e;
+    }
+    failed = true;
+  }
+  void finish(size_t n) {
+    if (remaining.fetch_sub(n, std::memory_order_acq_rel) == n) {
+      done.store(1, std::memory_order_release);
+      futex_wake(&done, INT_MAX);
+    }
+  }
+};
+
+struct work_pool_t::range_task_t : public task_t {
+  work_pool_t *pool;
+  job_t *job;
+  size_t begin, end;
+
+  range_task_t(work_pool_t *pool, job_t *job, size_t begin, size_t end)
+    : pool(pool), job(job), begin(begin), end(end) {}
+
+  void run() override {
+    // keep the left half, offer the right half to thieves
+    while (end - begin > job->grain) {
+      size_t mid = begin + (end - begin) / 2;
+      pool->push(new range_task_t(pool, job, mid, end));
+      end = mid;
+    }
+    if (!job->failed.load(std::memory_order_relaxed)) {
+      try {
+        job->fn(begin, end);
+      } catch (...) {
+        job->fail(std::current_exception());
+      }
+    }
+    job->finish(end - begin);
+  }
+};
+
+struct work_pool_t::fn_task_t : public task_t {
+  std::function<void()> fn;
+
+  explicit fn_task_t(std::function<void()>&& fn) : fn(std::move(fn)) {}
+  void run() override {
+    // nobody waits for it, and it mustn't unwind out of a parallel_for
+    // that picked it up while helping
+    try {
+      fn();
+    } catch (const std::exception& e) {
+      common_abort_msg(std::string("work_pool_t: submitted task threw: ") +
+                       e.what());
+    } catch (...) {
+      common_abort_msg("work_pool_t: submitted task threw");
+    }
+  }
+};
+
+work_pool_t::work_pool_t(unsigned threads, bool pin)
+{
+  unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+  if (threads == 0) {
+    threads = cpus;
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    auto w = std::make_unique<worker_t>();
+    w->index = i;
+    w->cpu = pin ? i % cpus : -1;
+    w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+    workers.push_back(std::move(w));
+  }
+  for (auto& w : workers) {
+    w->thread = std::thread(&work_pool_t::run_worker, this, w.get());
+  }
+}
+
+work_pool_t::~work_pool_t()
+{
+  stopping = true;
+  wakeups.fetch_add(1);
+  futex_wake(&wakeups, INT_MAX);
+  for (auto& w : workers) {
+    w->thread.join();
+  }
+}
+
+int work_pool_t::current_worker() const
+{
+  return current_pool == this ? current_index : -1;
+}
+
+void work_pool_t::push(task_t *t)
+{
+  int self = current_worker();
+  if (self >= 0) {
+    workers[self]->deque.push(t);
+  } else {
+    std::lock_guard l(inject_lock);
+    injected.push_back(t);
+    injected_size.fetch_add(1, std::memory_order_relaxed);
+  }
+  wake_one();
+}
+
+void work_pool_t::wake_one()
+{
+  // pairs with the sleeper announcing itself before its last look
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers.load(std::memory_order_relaxed) > 0) {
+    wakeups.fetch_add(1, std::memory_order_release);
+    futex_wake(&wakeups, 1);
+  }
+}
+
+bool work_pool_t::has_work() const
+{
+  if (injected_size.load(std::memory_order_relaxed)) {
+    return true;
+  }
+  for (auto& w : workers) {
+    if (!w->deque.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+work_pool_t::task_t *work_pool_t::find_task(worker_t *self)
+{
+  if (self) {
+    if (auto t = self->deque.take()) {
+      return t;
+    }
+  }
+  // victims on our node first, then the rest, from a random start
+  size_t n = workers.size();
+  uint64_t r = self ? next_random(self->rng) : (uintptr_t)&r >> 4;
+  int node = self ? self->node.load(std::memory_order_relaxed) : -1;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < n; ++i) {
+      worker_t *v = workers[(r + i) % n].get();
+      if (v == self || (node >= 0 &&
+          (v->node.load(std::memory_order_relaxed) == node) != (pass == 0))) {
+        continue;
+      }
+      if (auto t = v->deque.steal()) {
+        return t;
+      }
+    }
+    if (node < 0) {
+      break;
+    }
+  }
+  if (injected_size.load(std::memory_order_relaxed)) {
+    std::lock_guard l(inject_lock);
+    if (!injected.empty()) {
+      task_t *t = injected.front();
+      injected.pop_front();
+      injected_size.fetch_sub(1, std::memory_order_relaxed);
+      return t;
+    }
+  }
+  return nullptr;
+}
+
+void work_pool_t::run_task(task_t *t)
+{
+  t->run();
+  delete t;
+}
+
+void work_pool_t::run_worker(worker_t *self)
+{
+  current_pool = this;
+  current_index = self->index;
+  // pin before looking up our node, so it's the node we'll stay on
+  if (self->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(self->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  self->node = numa::current_node();
+  // an unpinned worker may migrate; look again every so many tasks, and
+  // whenever it wakes
+  constexpr unsigned refresh_tasks = 256;
+  unsigned tasks = 0;
+  for (;;) {
+    if (task_t *t = find_task(self)) {
+      run_task(t);
+      if (self->cpu < 0 && ++tasks % refresh_tasks == 0) {
+        self->node = numa::current_node();
+      }
+      continue;
+    }
+    if (stopping) {
+      break;
+    }
+    uint32_t w = wakeups.load(std::memory_order_acquire);
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    if (!has_work() && !stopping) {
+      futex_wait(&wakeups, w);
+      if (self->cpu < 0) {
+        self->node = numa::current_node();
+      }
+    }
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+void work_pool_t::submit(std::function<void()> fn)
+{
+  push(new fn_task_t(std::move(fn)));
+}
+
+void work_pool_t::parallel_for(size_t begin, size_t end, size_t grain,
+                               const std::function<void(size_t, size_t)>& fn)
+{
+  if (begin >= end) {
+    return;
+  }
+  if (grain == 0) {
+    grain = 1;
+  }
+  if (end - begin <= grain || workers.empty()) {
+    fn(begin, end);
+    return;
+  }
+  job_t job(end - begin, grain, fn);
+  push(new range_task_t(this, &job, begin, end));
+
+  // help out until it's done
+  int self = current_worker();
+  worker_t *me = self >= 0 ? workers[self].get() : nullptr;
+  while (!job.done.load(std::memory_order_acquire)) {
+    if (task_t *t = find_task(me)) {
+      run_task(t);
+    } else if (me) {
+      cpu_relax();
+    } else {
+      futex_wait(&job.done, 0);
+    }
+  }
+  if (job.error) {
+    std::rethrow_exception(job.error);
+  }
+}
+
+work_pool_t& get_work_pool()
+{
+  static work_pool_t pool;
+  return pool;
+}
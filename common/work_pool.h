@@ -0,0 +1,110 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work-stealing thread pool.
+ *
+ * Every worker owns a Chase-Lev deque: it pushes and pops work at the
+ * bottom without locking, and idle workers steal from the top of
+ * others', preferring workers on their own NUMA node.  Work submitted
+ * from outside the pool goes through a shared queue.  Idle workers
+ * park on a futex.
+ *
+ * parallel_for() splits a range in halves down to a grain size, so
+ * thieves take large pieces and the splitting itself is spread over
+ * the pool; the calling thread runs pieces too while it waits.
+ */
+class work_pool_t {
+public:
+  struct task_t {
+    virtual ~task_t() = default;
+    virtual void run() = 0;
+  };
+
+  /// threads = 0 for one per cpu; pin binds worker i to cpu i
+  explicit work_pool_t(unsigned threads = 0, bool pin = false);
+  ~work_pool_t();
+
+  work_pool_t(const work_pool_t&) = delete;
+  work_pool_t& operator=(const work_pool_t&) = delete;
+
+  unsigned size() const {
+    return workers.size();
+  }
+
+  /// run fn on some worker, eventually; fn must not throw, and an
+  /// exception escaping it aborts
+  void submit(std::function<void()> fn);
+
+  /// fn(b, e) over [begin, end) in pieces of at least grain; returns when
+  /// all are done, rethrowing the first exception any piece threw
+  void parallel_for(size_t begin, size_t end, size_t grain,
+                    const std::function<void(size_t, size_t)>& fn);
+
+  /// map(b, e) over pieces of [begin, end), folded left to right with
+  /// reduce, so reduce need only be associative; rethrows like
+  /// parallel_for
+  template <class T, class Map, class Reduce>
+  T parallel_reduce(size_t begin, size_t end, size_t grain, T init,
+                    Map&& map, Reduce&& reduce) {
+    if (begin >= end) {
+      return init;
+    }
+    if (grain == 0) {
+      grain = 1;
+    }
+    size_t pieces = (end - begin + grain - 1) / grain;
+    std::vector<T> results(pieces, init);
+    parallel_for(0, pieces, 1, [&](size_t b, size_t e) {
+      for (size_t i = b; i < e; ++i) {
+        size_t pb = begin + i * grain;
+        results[i] = map(pb, std::min(pb + grain, end));
+      }
+    });
+    T r = init;
+    for (auto& v : results) {
+      r = reduce(r, v);
+    }
+    return r;
+  }
+
+  /// index of the calling worker in this pool, or -1
+  int current_worker() const;
+
+private:
+  struct deque_t;
+  struct worker_t;
+  struct job_t;
+  struct range_task_t;
+  struct fn_task_t;
+
+  std::vector<std::unique_ptr<worker_t>> workers;
+  std::mutex inject_lock;
+  std::deque<task_t*> injected;
+  std::atomic<size_t> injected_size = {0};
+  std::atomic<bool> stopping = {false};
+  std::atomic<uint32_t> wakeups = {0};   // futex word
+  std::atomic<int> sleepers = {0};
+
+  void push(task_t *t);
+  task_t *find_task(worker_t *self);
+  bool has_work() const;
+  void wake_one();
+  void run_worker(worker_t *self);
+  void run_task(task_t *t);
+};
+
+/// shared pool, one worker per cpu, created on first use
+work_pool_t& get_work_pool();
+
+#endif // WORK_POOL_H
@@ -5,15 +5,22 @@
 #include <stdexcept>
 #include <climits>
 #include <map>
+#include <deque>
+#include <condition_variable>
+#include <shared_mutex>
 #include <filesystem>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <boost/algorithm/string.hpp>
 
 #include "gtest/gtest.h"
 #include "../common/stringify.h"
 #include "../common/backtrace.h"
+#include "../common/demangle.h"
 #include "../common/clock.h"
+#include "../common/tsc_clock.h"
+#include "../common/cached_clock.h"
 #include "../common/assertion.h"
 #include "../common/formatter.h"
 #include "../common/intarith.h"
@@ -21,6 +28,21 @@
 #include "../common/crc/crc32_sctp.h"
 #include "../common/crc/crc32.h"
 #include "../common/mempool.h"
+#include "../common/mempool_budget.h"
+#include "../common/mempool_sampler.h"
+#include "../common/heap_profiler.h"
+#include "../common/spinlock.h"
+#include "../common/mcs_lock.h"
+#include "../common/seqlock.h"
+#include "../common/rw_spinlock.h"
+#include "../common/lock_profiler.h"
+#include "../common/work_pool.h"
+#include "../common/spsc_ring.h"
+#include "../common/mpsc_queue.h"
+#include "../common/ebr.h"
+#include "../common/perf_counters.h"
+#include "../common/denc.h"
+#include "../common/encoding.h"
 #include "../common/safe_io.h"
 #include "../common/global_definition.h"
 #include "../common/global_context.h"
@@ -817,6 +839,3091 @@ TEST(mempool, check_shard_select)
   EXPECT_LT(missed, mempool::num_shards / 2);
 }
 
+TEST(mempool, percpu_shards)
+{
+  const bool was = mempool::percpu_shards;
+  mempool::set_percpu_shards(true);
+  const size_t n = mempool::percpu_shards.load();
+  ASSERT_GE(n, 1u);
+  ASSERT_EQ(0u, n & (n - 1));
+  ASSERT_LE(n, (size_t)mempool::max_shards);
+  ASSERT_GE(mempool::shards_in_use.load(), n);
+  size_t i = mempool::pool_t::pick_a_shard_int();
+  ASSERT_LT(i, n);
+
+  // counts survive switching modes with allocations outstanding
+  {
+    mempool::unittest::vector<int> v(1000);
+    mempool::set_percpu_shards(false);
+    mempool::unittest::vector<int> w(1000);
+    EXPECT_GE(mempool::unittest::allocated_bytes(), 2000 * sizeof(int));
+    mempool::set_percpu_shards(true);
+    check_usage(mempool::unittest::id);
+  }
+  EXPECT_EQ(0u, mempool::unittest::allocated_bytes());
+  mempool::set_percpu_shards(was);
+}
+
+TEST(mempool, shard_contention)
+{
+  const bool was = mempool::percpu_shards;
+  const size_t per_thread = 200000;
+  for (size_t nthreads : {4, 16, 96}) {
+    for (bool percpu : {false, true}) {
+      mempool::set_percpu_shards(percpu);
+      std::vector<std::thread> workers;
+      std::set<size_t> shards;
+      std::mutex shards_lock;
+      utime_t start = clock_now();
+      for (size_t t = 0; t < nthreads; t++) {
+        workers.push_back(std::thread([&] {
+          auto& pool = mempool::get_pool(mempool::unittest::id);
+          for (size_t i = 0; i < per_thread; i++) {
+            pool.adjust_count(1, 64);
+            pool.adjust_count(-1, -64);
+          }
+          std::lock_guard l(shards_lock);
+          shards.insert(mempool::pool_t::pick_a_shard_int());
+        }));
+      }
+      for (auto& t : workers) {
+        t.join();
+      }
+      utime_t end = clock_now();
+      std::cout << nthreads << " threads, "
+                << (percpu ? "per-cpu" : "thread hash") << ": "
+                << shards.size() << " shards, "
+                << (float)(nthreads * per_thread * 2) / (float)(end - start)
+                << " updates/sec" << std::endl;
+    }
+  }
+  mempool::set_percpu_shards(was);
+  EXPECT_EQ(0u, mempool::unittest::allocated_bytes());
+}
+
+struct mempool_probe_t {
+  char c[40];
+};
+
+TEST(mempool, type_registry)
+{
+  auto& pool = mempool::get_pool(mempool::unittest::id);
+  std::vector<std::thread> workers;
+  std::vector<mempool::type_t*> seen(8);
+  for (size_t t = 0; t < seen.size(); t++) {
+    workers.push_back(std::thread([&, t] {
+      seen[t] = pool.get_type(typeid(std::pair<int, mempool_probe_t>), 44);
+    }));
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+  for (auto p : seen) {
+    ASSERT_EQ(seen[0], p);
+  }
+  size_t n = 0;
+  for (auto t = pool.first_type(); t; t = t->next) {
+    n += t->type_name == seen[0]->type_name;
+  }
+  ASSERT_EQ(1u, n);
+  using alloc_t = mempool::pool_allocator<mempool::unittest::id, mempool_probe_t>;
+  ASSERT_EQ(alloc_t::registered_type(), alloc_t::registered_type());
+  ASSERT_EQ(alloc_t::registered_type(),
+            pool.get_type(typeid(mempool_probe_t), sizeof(mempool_probe_t)));
+
+  // allocator construction no longer takes the pool lock
+  const size_t count = 1000000;
+  utime_t start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    alloc_t a(true);
+    a.deallocate(a.allocate(1), 1);
+  }
+  utime_t end = clock_now();
+  std::cout << (float)count / (float)(end - start)
+            << " registered allocators/sec" << std::endl;
+}
+
+TEST(mempool, sampled_stats)
+{
+  const size_t was = mempool::sample_rate;
+  auto& pool = mempool::get_pool(mempool::unittest::id);
+  auto name = cpputils_demangle(typeid(mempool_probe_t).name());
+  auto sampled = [&](const std::string& n) {
+    std::map<std::string, mempool::stats_t> by_type;
+    pool.get_sampled_stats(&by_type);
+    return by_type[n];
+  };
+  auto base = sampled(name);
+
+  // every allocation sampled: estimates are exact
+  mempool::set_sample_rate(1);
+  {
+    mempool::unittest::vector<mempool_probe_t> v;
+    v.reserve(100);
+    EXPECT_EQ(base.items + 100, sampled(name).items);
+    EXPECT_EQ(base.bytes + 100 * (ssize_t)sizeof(mempool_probe_t),
+              sampled(name).bytes);
+  }
+  EXPECT_EQ(base.items, sampled(name).items);
+  EXPECT_EQ(base.bytes, sampled(name).bytes);
+
+  // sparse sampling converges on the live total
+  mempool::set_sample_rate(16 * sizeof(mempool_probe_t));
+  base = sampled(name);
+  {
+    std::vector<mempool::unittest::vector<mempool_probe_t>> vs(4096);
+    for (auto& v : vs) {
+      v.reserve(1);
+    }
+    ssize_t live = 4096 * sizeof(mempool_probe_t);
+    EXPECT_NEAR(live, sampled(name).bytes - base.bytes, live / 4);
+  }
+
+  mempool::set_sample_rate(0);
+  base = sampled(name);
+  {
+    mempool::unittest::vector<mempool_probe_t> v(100);
+  }
+  EXPECT_EQ(base.bytes, sampled(name).bytes);
+
+  // frees take back exactly what their allocations added, however
+  // they interleave
+  const size_t count = 10000000;
+  auto word = cpputils_demangle(typeid(uint64_t).name());
+  base = sampled(word);
+  for (size_t rate : {(size_t)0, (size_t)1024, was}) {
+    mempool::set_sample_rate(rate);
+    mempool::pool_allocator<mempool::unittest::id, uint64_t> a;
+    utime_t start = clock_now();
+    for (size_t i = 0; i < count; i++) {
+      a.deallocate(a.allocate(1), 1);
+    }
+    utime_t end = clock_now();
+    std::cout << "sample rate " << rate << ": "
+              << (float)count / (float)(end - start)
+              << " alloc+free/sec" << std::endl;
+    EXPECT_EQ(base.items, sampled(word).items);
+    EXPECT_EQ(base.bytes, sampled(word).bytes);
+  }
+
+  // and on many threads at once, with many samples live
+  mempool::set_sample_rate(1);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([] {
+      mempool::pool_allocator<mempool::unittest::id, uint64_t> a;
+      std::vector<uint64_t*> live(20000);
+      for (int round = 0; round < 5; round++) {
+        for (auto& p : live) {
+          p = a.allocate(1);
+        }
+        for (auto p : live) {
+          a.deallocate(p, 1);
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(base.items, sampled(word).items);
+  EXPECT_EQ(base.bytes, sampled(word).bytes);
+  mempool::set_sample_rate(was);
+}
+
+// a cache of 4k entries accounted to the unittest pool
+struct budget_cache_t {
+  std::list<mempool::unittest::vector<char>> entries;
+  bool urgent = false;
+
+  void fill(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      entries.emplace_back(4096);
+    }
+  }
+  size_t trim(size_t bytes, bool u) {
+    urgent |= u;
+    size_t released = 0;
+    while (released < bytes && !entries.empty()) {
+      entries.pop_front();
+      released += 4096;
+    }
+    return released;
+  }
+};
+
+TEST(mempool, budget)
+{
+  mempool::budget_manager_t budgets;
+  budget_cache_t cache;
+  auto ix = mempool::mempool_unittest;
+  budgets.set_limits(ix, 64 << 10, 128 << 10);
+  uint64_t id = budgets.add_trimmer(ix, [&](size_t b, bool u) {
+    return cache.trim(b, u);
+  });
+
+  cache.fill(16);
+  ASSERT_TRUE(budgets.admit(ix, 4096));
+  ASSERT_EQ(0u, budgets.enforce());
+  cache.fill(20);
+  ASSERT_FALSE(budgets.admit(ix, 4096));
+
+  // over hard: trimmed back to soft, urgently
+  ASSERT_GT(budgets.enforce(), 0u);
+  ASSERT_LE(mempool::unittest::allocated_bytes(), 64u << 10);
+  ASSERT_TRUE(cache.urgent);
+  ASSERT_TRUE(budgets.admit(ix, 4096));
+
+  std::stringstream ss;
+  std::unique_ptr<Formatter> f(Formatter::create("json"));
+  f->open_object_section("budgets");
+  budgets.dump(f.get());
+  f->close_section();
+  f->flush(ss);
+  ASSERT_NE(std::string::npos, ss.str().find("\"trimmed\""));
+
+  // the process target trims pools that registered trimmers
+  budgets.set_limits(ix, 0, 0);
+  cache.urgent = false;
+  cache.fill(16);
+  size_t total = 0;
+  for (size_t i = 0; i < mempool::num_pools; i++) {
+    total += mempool::get_pool((mempool::pool_index_t)i).allocated_bytes();
+  }
+  budgets.set_target(total - (32 << 10));
+  size_t before = mempool::unittest::allocated_bytes();
+  ASSERT_GE(budgets.enforce(), 32u << 10);
+  ASSERT_LE(mempool::unittest::allocated_bytes(), before - (32 << 10));
+  ASSERT_FALSE(cache.urgent);
+
+  budgets.remove_trimmer(id);
+  budgets.set_target(1);
+  ASSERT_EQ(0u, budgets.enforce());
+
+  // removal waits for a callback in flight on another thread
+  std::atomic<bool> entered = false, running = false;
+  id = budgets.add_trimmer(ix, [&](size_t b, bool u) {
+    running = true;
+    entered = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    running = false;
+    return 0;
+  });
+  cache.fill(1);
+  std::thread t([&] { budgets.enforce(); });
+  while (!entered) {
+    std::this_thread::yield();
+  }
+  budgets.remove_trimmer(id);
+  ASSERT_FALSE(running);
+  t.join();
+
+  // and a callback may remove itself
+  id = budgets.add_trimmer(ix, [&](size_t b, bool u) {
+    budgets.remove_trimmer(id);
+    return 0;
+  });
+  budgets.enforce();
+  budgets.enforce();
+}
+
+TEST(mempool, budget_balancer)
+{
+  mempool::budget_manager_t budgets;
+  auto a = mempool::mempool_unittest;
+  auto b = mempool::mempool_arena;
+  size_t others = 0;
+  for (size_t i = 0; i < mempool::num_pools; i++) {
+    if (i != a && i != b) {
+      others += mempool::get_pool((mempool::pool_index_t)i).allocated_bytes();
+    }
+  }
+  const size_t share = 1 << 20;
+  budgets.set_target(others + share);
+  budgets.set_balanced(a, 16 << 10, 0);
+  budgets.set_balanced(b, 16 << 10, 0);
+
+  auto run = [&](uint64_t misses_a, uint64_t misses_b) {
+    for (int i = 0; i < 12; i++) {
+      budgets.record_access(a, 10000 - misses_a, misses_a);
+      budgets.record_access(b, 10000 - misses_b, misses_b);
+      budgets.rebalance();
+    }
+  };
+  run(1000, 100);
+  size_t sa = budgets.get_limits(a).soft;
+  size_t sb = budgets.get_limits(b).soft;
+  std::cout << "a " << sa << " b " << sb << std::endl;
+  ASSERT_GT(sa, 4 * sb);
+  ASSERT_NEAR((double)share, (double)(sa + sb), share / 10.0);
+
+  // the split follows the feedback
+  run(10, 5000);
+  sa = budgets.get_limits(a).soft;
+  sb = budgets.get_limits(b).soft;
+  std::cout << "a " << sa << " b " << sb << std::endl;
+  ASSERT_GT(sb, 4 * sa);
+  ASSERT_GE(sa, 16u << 10);
+
+  // max caps a pool, the rest goes to the other
+  budgets.set_balanced(b, 16 << 10, 256 << 10);
+  run(10, 5000);
+  ASSERT_LE(budgets.get_limits(b).soft, 260u << 10);
+  ASSERT_GT(budgets.get_limits(a).soft, 600u << 10);
+
+  // background thread trims on its own
+  budget_cache_t cache;
+  budgets.clear_balanced(a);
+  budgets.set_limits(a, 64 << 10, 0);
+  budgets.add_trimmer(a, [&](size_t n, bool u) { return cache.trim(n, u); });
+  cache.fill(64);
+  budgets.start(std::chrono::milliseconds(1));
+  for (int i = 0; i < 1000 && mempool::unittest::allocated_bytes() > (64 << 10); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  budgets.stop();
+  ASSERT_LE(mempool::unittest::allocated_bytes(), 64u << 10);
+}
+
+TEST(mempool, heap_profile)
+{
+  const size_t was = mempool::heap_profile_rate;
+  auto stats = [](mempool::pool_index_t ix) {
+    mempool::heap_profile_stats_t s;
+    mempool::get_heap_profile_stats(ix, &s);
+    return s;
+  };
+
+  // a rate of one byte samples everything: the estimates are exact
+  mempool::set_heap_profile_rate(1);
+  {
+    mempool::unittest::vector<uint64_t> v(1000);
+    auto s = stats(mempool::mempool_unittest);
+    EXPECT_EQ(1u, s.sites);
+    EXPECT_EQ(8000u, s.live_bytes);
+    EXPECT_EQ(1u, s.live_objects);
+
+    buffer::list bl;
+    bl.append(buffer::create(4096));
+    EXPECT_GE(stats(mempool::mempool_buffer_anon).live_bytes, 4096u);
+    // a raw and its data, sampled at the same address in two pools
+    bl.append(buffer::create_malloc(4096));
+    EXPECT_GE(stats(mempool::mempool_buffer_anon).live_bytes, 8192u);
+    EXPECT_GT(stats(mempool::mempool_buffer_meta).live_bytes, 0u);
+    // the data's sample follows the raw to its new pool, to be freed there
+    buffer::list moved;
+    moved.append(buffer::create_malloc(4096));
+    moved.reassign_to_mempool(mempool::mempool_unittest);
+
+    std::stringstream ss;
+    std::unique_ptr<Formatter> f(Formatter::create("json"));
+    f->open_object_section("heap");
+    mempool::dump_heap_profile(f.get());
+    f->close_section();
+    f->flush(ss);
+    EXPECT_NE(std::string::npos, ss.str().find("\"live_bytes\":8000"));
+    EXPECT_NE(std::string::npos, ss.str().find("\"stack\""));
+    // stacks start at the allocation, not in the profiler's hooks
+    EXPECT_NE(std::string::npos, ss.str().find("raw_malloc::raw_malloc"));
+    EXPECT_EQ(std::string::npos, ss.str().find("heap_profile_"));
+
+    std::stringstream pp;
+    mempool::dump_heap_profile_pprof(pp);
+    std::string line;
+    std::getline(pp, line);
+    EXPECT_EQ(0u, line.find("heap profile: "));
+    EXPECT_NE(std::string::npos, line.find("@ heapprofile"));
+    EXPECT_NE(std::string::npos, pp.str().find("MAPPED_LIBRARIES:"));
+  }
+  EXPECT_EQ(0u, stats(mempool::mempool_unittest).live_bytes);
+  EXPECT_EQ(8000u, stats(mempool::mempool_unittest).alloc_bytes);
+  EXPECT_EQ(0u, stats(mempool::mempool_buffer_anon).live_bytes);
+  EXPECT_EQ(0u, stats(mempool::mempool_buffer_meta).live_bytes);
+
+  // sparse sampling still estimates the live total
+  mempool::set_heap_profile_rate(0);
+  mempool::set_heap_profile_rate(4096);
+  {
+    std::vector<mempool::unittest::vector<char>> vs(20000);
+    for (auto& v : vs) {
+      v.resize(256);
+    }
+    double live = 20000 * 256;
+    EXPECT_NEAR(live, stats(mempool::mempool_unittest).live_bytes, live / 5);
+  }
+  EXPECT_EQ(0u, stats(mempool::mempool_unittest).live_bytes);
+
+  // frees on many threads, with many samples live
+  mempool::set_heap_profile_rate(1);
+  size_t alloc_bytes = stats(mempool::mempool_unittest).alloc_bytes;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([] {
+      mempool::pool_allocator<mempool::mempool_unittest, uint64_t> a;
+      std::vector<uint64_t*> live(20000);
+      for (int round = 0; round < 3; round++) {
+        for (auto& p : live) {
+          p = a.allocate(1);
+        }
+        for (auto p : live) {
+          a.deallocate(p, 1);
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(0u, stats(mempool::mempool_unittest).live_bytes);
+  double allocated = 4 * 3 * 20000 * 8;
+  EXPECT_NEAR(allocated,
+              stats(mempool::mempool_unittest).alloc_bytes - alloc_bytes,
+              allocated / 100);
+
+  mempool::set_heap_profile_rate(0);
+  EXPECT_EQ(0u, stats(mempool::mempool_unittest).sites);
+  mempool::set_heap_profile_rate(was);
+}
+
+TEST(mempool, heap_profile_performance)
+{
+  const size_t was = mempool::heap_profile_rate;
+  const size_t count = 10000000;
+  for (size_t rate : {0ul, 512ul << 10}) {
+    mempool::set_heap_profile_rate(rate);
+    mempool::pool_allocator<mempool::mempool_unittest, uint64_t> a;
+    utime_t start = clock_now();
+    for (size_t i = 0; i < count; i++) {
+      a.deallocate(a.allocate(8), 8);
+    }
+    utime_t end = clock_now();
+    std::cout << "heap profile rate " << rate << ": "
+              << (float)count / (float)(end - start)
+              << " alloc+free/sec" << std::endl;
+  }
+  mempool::set_heap_profile_rate(was);
+}
+
+TEST(mempool, numa)
+{
+  ASSERT_GE(numa::num_nodes(), 1);
+  int here = numa::current_node();
+  ASSERT_GE(here, 0);
+  ASSERT_LT(here, numa::num_nodes());
+
+  auto& pool = mempool::get_pool(mempool::mempool_buffer_anon);
+  ssize_t before = pool.get_node_bytes(0);
+  {
+    buffer::ptr p(buffer::create_on_node(100000, 0));
+    ASSERT_TRUE(p.is_page_aligned());
+    memset(p.c_str(), 1, p.length());
+    ASSERT_EQ(before + 100000, pool.get_node_bytes(0));
+    buffer::ptr q(p.clone());
+    ASSERT_EQ(before + 200000, pool.get_node_bytes(0));
+    ASSERT_EQ(0, memcmp(p.c_str(), q.c_str(), p.length()));
+  }
+  ASSERT_EQ(before, pool.get_node_bytes(0));
+  ASSERT_THROW(buffer::create_on_node(4096, numa::num_nodes()),
+               std::invalid_argument);
+  ASSERT_THROW(buffer::create_on_node(4096, -1), std::invalid_argument);
+  ASSERT_EQ(before, pool.get_node_bytes(0));
+
+  // the pool policy applies to large buffers only
+  pool.set_numa_policy(numa::POLICY_LOCAL);
+  before = pool.get_node_bytes(here);
+  {
+    buffer::list bl;
+    bl.append(buffer::create(1 << 20));
+    bl.append(buffer::create(4096));
+    ASSERT_EQ(before + (1 << 20), pool.get_node_bytes(here));
+
+    std::stringstream ss;
+    std::unique_ptr<Formatter> f(Formatter::create("json"));
+    f->open_object_section("pool");
+    pool.dump(f.get());
+    f->close_section();
+    f->flush(ss);
+    ASSERT_NE(std::string::npos, ss.str().find("\"policy\":\"local\""));
+    ASSERT_NE(std::string::npos, ss.str().find("\"by_node\""));
+  }
+  pool.set_numa_policy(numa::POLICY_INTERLEAVE);
+  {
+    ssize_t total = 0;
+    for (int i = 0; i < numa::num_nodes(); i++) {
+      total -= pool.get_node_bytes(i);
+    }
+    buffer::ptr p(buffer::create(1 << 20));
+    for (int i = 0; i < numa::num_nodes(); i++) {
+      total += pool.get_node_bytes(i);
+    }
+    ASSERT_EQ(1 << 20, total);
+  }
+  pool.set_numa_policy(numa::POLICY_NONE);
+  ASSERT_EQ(before, pool.get_node_bytes(here));
+
+  const size_t count = 2000;
+  for (bool placed : {false, true}) {
+    utime_t start = clock_now();
+    for (size_t i = 0; i < count; i++) {
+      buffer::ptr p(placed ? buffer::create_on_node(1 << 20, here) :
+                             buffer::create(1 << 20));
+      memset(p.c_str(), 0, p.length());
+    }
+    utime_t end = clock_now();
+    std::cout << (placed ? "node-placed" : "heap") << " 1M buffers: "
+              << (float)count / (float)(end - start) << " create+fill/sec"
+              << std::endl;
+  }
+}
+
+TEST(mempool, stats_sampler)
+{
+  auto ix = mempool::mempool_unittest;
+  mempool::stats_sampler_t sampler(8);
+  std::vector<mempool::stats_sampler_t::sample_t> samples;
+  sampler.get_samples(10, &samples);
+  ASSERT_TRUE(samples.empty());
+
+  sampler.sample();
+  {
+    mempool::unittest::vector<int> v(1000);
+    sampler.sample();
+  }
+  sampler.sample();
+  sampler.get_samples(10, &samples);
+  ASSERT_EQ(3u, samples.size());
+  auto& a = samples[0].pools[ix];
+  auto& b = samples[1].pools[ix];
+  auto& c = samples[2].pools[ix];
+  ASSERT_EQ(a.bytes + 4000, b.bytes);
+  ASSERT_EQ(a.bytes, c.bytes);
+  ASSERT_EQ(a.allocated + 1000, b.allocated);
+  ASSERT_EQ(b.allocated, c.allocated);
+  ASSERT_LE(samples[0].stamp, samples[1].stamp);
+  ASSERT_GE(sampler.get_high_water_bytes(ix), b.bytes);
+
+  std::stringstream ss;
+  std::unique_ptr<Formatter> f(Formatter::create("json"));
+  f->open_object_section("stats");
+  sampler.dump(f.get(), 2);
+  f->close_section();
+  f->flush(ss);
+  ASSERT_NE(std::string::npos, ss.str().find("\"high_water\""));
+  ASSERT_NE(std::string::npos, ss.str().find("\"alloc_rate\""));
+  ASSERT_NE(std::string::npos, ss.str().find("\"free_rate\""));
+
+  // the ring keeps the newest, and readers never see a torn snapshot
+  std::atomic<bool> done = false;
+  std::atomic<size_t> reads = 0;
+  std::thread reader([&] {
+    std::vector<mempool::stats_sampler_t::sample_t> s;
+    while (!done) {
+      sampler.get_samples(8, &s);
+      for (size_t i = 1; i < s.size(); i++) {
+        ASSERT_LE(s[i - 1].stamp, s[i].stamp);
+      }
+      reads++;
+    }
+  });
+  for (int i = 0; i < 10000; i++) {
+    sampler.sample();
+  }
+  done = true;
+  reader.join();
+  sampler.get_samples(100, &samples);
+  ASSERT_EQ(8u, samples.size());
+
+  sampler.start(std::chrono::milliseconds(1));
+  uint64_t last = samples.back().stamp;
+  for (int i = 0; i < 1000; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    sampler.get_samples(1, &samples);
+    if (samples.back().stamp > last) {
+      break;
+    }
+  }
+  sampler.stop();
+  ASSERT_GT(samples.back().stamp, last);
+
+  const size_t count = 100000;
+  utime_t start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sampler.sample();
+  }
+  utime_t end = clock_now();
+  std::cout << (float)count / (float)(end - start) << " samples/sec, "
+            << reads << " concurrent reads" << std::endl;
+}
+
+TEST(Buffer, thread_local_refs)
+{
+  buffer::ptr a(4096);
+  a.set_thread_local(true);
+  {
+    buffer::ptr b(a);
+    buffer::ptr c(a, 10, 100);
+    buffer::ptr d;
+    d = c;
+    ASSERT_EQ(4, a.raw_nref());
+    buffer::list bl;
+    bl.append(a);
+    bl.append(c);
+    buffer::list sub;
+    sub.substr_of(bl, 100, 4000);
+    ASSERT_EQ(8, a.raw_nref());
+  }
+  ASSERT_EQ(1, a.raw_nref());
+
+  // shared again before handing it over
+  buffer::list bl;
+  bl.append(a);
+  bl.set_thread_local(false);
+  std::thread t([bl = std::move(bl)]() mutable {
+    buffer::ptr p(bl.front());
+    bl.clear();
+  });
+  t.join();
+  ASSERT_EQ(1, a.raw_nref());
+}
+
+TEST(Buffer, thread_local_refs_performance)
+{
+  const size_t count = 2000000;
+  for (bool confined : {false, true}) {
+    buffer::list src;
+    for (int i = 0; i < 16; i++) {
+      src.append(buffer::create(4096));
+    }
+    src.set_thread_local(confined);
+    buffer::ptr bp(src.front());
+    utime_t start = clock_now();
+    for (size_t i = 0; i < count; i++) {
+      buffer::ptr a(bp);
+      buffer::ptr b(a, i % 2048, 1024);
+      a = b;
+    }
+    utime_t mid = clock_now();
+    for (size_t i = 0; i < count / 16; i++) {
+      buffer::list sub;
+      sub.substr_of(src, i % 4096, 8 * 4096);
+    }
+    utime_t end = clock_now();
+    std::cout << (confined ? "thread-local" : "atomic") << " refs: "
+              << (float)(count * 3) / (float)(mid - start) << " ptr copies/sec, "
+              << (float)(count / 16) / (float)(end - mid) << " substr_of/sec"
+              << std::endl;
+  }
+}
+
+static void check_segments(const buffer::list& bl, const std::string& ref)
+{
+  ASSERT_EQ(ref.size(), bl.length());
+  for (unsigned i = 0; i < ref.size(); i += 3) {
+    ASSERT_EQ(ref[i], bl[i]);
+  }
+  for (unsigned i = 0; i < ref.size(); i += 97) {
+    auto it = bl.begin(i);
+    ASSERT_EQ(ref[i], *it);
+    it += std::min<unsigned>(ref.size() - i - 1, 501);
+    ASSERT_EQ(ref[it.get_off()], *it);
+    it.seek(ref.size() - 1 - i);
+    ASSERT_EQ(ref[ref.size() - 1 - i], *it);
+    buffer::list sub;
+    unsigned len = std::min<unsigned>(ref.size() - i, 300);
+    sub.substr_of(bl, i, len);
+    ASSERT_EQ(ref.substr(i, len), sub.to_str());
+  }
+}
+
+static void append_segments(buffer::list *bl, std::string *ref, int n)
+{
+  for (int i = 0; i < n; i++) {
+    std::string s(i % 7 + 1, 'a' + (ref->size() % 26));
+    for (size_t j = 0; j < s.size(); j++) {
+      s[j] += j;
+    }
+    bl->append(buffer::copy(s.c_str(), s.size()));
+    *ref += s;
+  }
+}
+
+TEST(Buffer, segment_index)
+{
+  buffer::list bl;
+  std::string ref;
+  append_segments(&bl, &ref, 1000);
+  ASSERT_EQ(1000u, bl.get_num_buffers());
+  check_segments(bl, ref);
+
+  // appends extend the index as a prefix, and past twice its size rebuild it
+  append_segments(&bl, &ref, 300);
+  check_segments(bl, ref);
+  bl.append("tail", 4);
+  ref += "tail";
+  append_segments(&bl, &ref, 2000);
+  check_segments(bl, ref);
+
+  buffer::list cut;
+  bl.splice(1234, 567, &cut);
+  ASSERT_EQ(ref.substr(1234, 567), cut.to_str());
+  ref.erase(1234, 567);
+  check_segments(bl, ref);
+
+  bl.prepend_zero(5);
+  ref.insert(0, 5, '\0');
+  check_segments(bl, ref);
+
+  buffer::list more;
+  std::string more_ref;
+  append_segments(&more, &more_ref, 500);
+  check_segments(more, more_ref);
+  bl.claim_append(more);
+  ref += more_ref;
+  ASSERT_EQ(0u, more.length());
+  check_segments(bl, ref);
+
+  buffer::list copy(bl);
+  check_segments(copy, ref);
+  buffer::list moved(std::move(copy));
+  check_segments(moved, ref);
+  buffer::list other;
+  std::string other_ref;
+  append_segments(&other, &other_ref, 200);
+  check_segments(other, other_ref);
+  other.swap(moved);
+  check_segments(other, ref);
+  check_segments(moved, other_ref);
+
+  bl.rebuild();
+  ASSERT_EQ(1u, bl.get_num_buffers());
+  check_segments(bl, ref);
+}
+
+TEST(Buffer, segment_index_performance)
+{
+  const unsigned segments = 10000;
+  buffer::list bl;
+  std::string ref;
+  append_segments(&bl, &ref, segments);
+  const size_t count = 200000;
+  std::vector<unsigned> offs(count);
+  for (auto& o : offs) {
+    o = rand() % bl.length();
+  }
+
+  // what every seek used to do
+  utime_t start = clock_now();
+  unsigned sum = 0;
+  for (size_t i = 0; i < count / 100; i++) {
+    unsigned n = offs[i];
+    for (const auto& node : bl.buffers()) {
+      if (n < node.length()) {
+        sum += node[n];
+        break;
+      }
+      n -= node.length();
+    }
+  }
+  utime_t walked = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sum += *bl.begin(offs[i]);
+  }
+  utime_t seeked = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sum += bl[offs[i]];
+  }
+  utime_t indexed = clock_now();
+  for (size_t i = 0; i < count / 10; i++) {
+    buffer::list sub;
+    sub.substr_of(bl, std::min<unsigned>(offs[i], bl.length() - 64), 64);
+    sum += sub.length();
+  }
+  utime_t end = clock_now();
+  std::cout << segments << " segments: "
+            << (float)(count / 100) / (float)(walked - start) << " walks/sec, "
+            << (float)count / (float)(seeked - walked) << " seeks/sec, "
+            << (float)count / (float)(indexed - seeked) << " operator[]/sec, "
+            << (float)(count / 10) / (float)(end - indexed) << " substr_of/sec"
+            << " (" << sum << ")" << std::endl;
+}
+
+TEST(Buffer, compact)
+{
+  // a small slice pinning a big raw is copied out
+  {
+    buffer::ptr big(4 << 20);
+    memset(big.c_str(), 'x', big.length());
+    buffer::list whole;
+    whole.append(big);
+    buffer::list bl;
+    bl.substr_of(whole, 1000, 10);
+    whole.clear();
+    ASSERT_TRUE(bl.should_compact());
+    ASSERT_GE(bl.compact(), (4u << 20) - 4096);
+    ASSERT_EQ(1, big.raw_nref());
+    ASSERT_EQ(std::string(10, 'x'), bl.to_str());
+    ASSERT_FALSE(bl.should_compact());
+  }
+
+  // tiny segments are merged, large well utilised ones stay put
+  {
+    buffer::list bl;
+    std::string ref;
+    buffer::ptr large(128 * 1024);
+    memset(large.c_str(), 'L', large.length());
+    for (int i = 0; i < 1000; i++) {
+      std::string s(16, 'a' + i % 26);
+      bl.append(buffer::copy(s.c_str(), s.size()));
+      ref += s;
+      if (i == 500) {
+        bl.append(large);
+        ref += std::string(large.length(), 'L');
+      }
+    }
+    ASSERT_EQ(1001u, bl.get_num_buffers());
+    ASSERT_TRUE(bl.should_compact());
+    bl.compact();
+    // 500 + 501 runs of 16 bytes, each within one merge
+    ASSERT_EQ(3u, bl.get_num_buffers());
+    ASSERT_EQ(ref, bl.to_str());
+    auto it = bl.buffers().begin();
+    ++it;
+    ASSERT_EQ(large.c_str(), it->c_str());
+    ASSERT_FALSE(bl.maybe_compact());
+  }
+
+  // merges are capped, and the append buffer is left for appending
+  {
+    buffer::list bl;
+    std::string ref;
+    for (int i = 0; i < 100; i++) {
+      std::string s(100, 'a' + i % 26);
+      bl.append(buffer::copy(s.c_str(), s.size()));
+      ref += s;
+    }
+    bl.append("carriage", 8);
+    ref += "carriage";
+    buffer::compact_policy_t policy;
+    policy.max_merge = 1000;
+    ASSERT_TRUE(bl.maybe_compact(policy));
+    ASSERT_EQ(11u, bl.get_num_buffers());
+    ASSERT_EQ(ref, bl.to_str());
+    const char *tail = bl.back().end_c_str();
+    bl.append("more", 4);
+    ASSERT_EQ(tail, bl.back().end_c_str() - 4);
+  }
+}
+
+TEST(Buffer, compact_performance)
+{
+  const size_t count = 200;
+  buffer::list fragmented;
+  for (int i = 0; i < 16384; i++) {
+    fragmented.append(buffer::copy("0123456789abcdefghijklmnopqrstuv", 32));
+  }
+  buffer::list compacted(fragmented);
+  utime_t start = clock_now();
+  compacted.compact();
+  utime_t compacted_at = clock_now();
+  // through the iterator, so the raws' cached crcs don't help
+  uint32_t crc = 0;
+  for (size_t i = 0; i < count; i++) {
+    crc += fragmented.begin().crc32c(fragmented.length(), i);
+  }
+  utime_t mid = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    crc += compacted.begin().crc32c(compacted.length(), i);
+  }
+  utime_t crcs = clock_now();
+  int fd = ::open("/dev/null", O_WRONLY);
+  ASSERT_GE(fd, 0);
+  for (size_t i = 0; i < count; i++) {
+    ASSERT_EQ(0, fragmented.write_fd(fd));
+  }
+  utime_t written = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    ASSERT_EQ(0, compacted.write_fd(fd));
+  }
+  utime_t end = clock_now();
+  ::close(fd);
+  float bytes = count * fragmented.length();
+  std::cout << fragmented.get_num_buffers() << " -> "
+            << compacted.get_num_buffers() << " segments in "
+            << (float)(compacted_at - start) << " sec; crc32c "
+            << bytes / (float)(mid - compacted_at) << " -> "
+            << bytes / (float)(crcs - mid) << " bytes/sec; write_fd "
+            << bytes / (float)(written - crcs) << " -> "
+            << bytes / (float)(end - written) << " bytes/sec"
+            << " (" << crc << ")" << std::endl;
+}
+
+// the spinlock we used to have
+struct tas_lock_t {
+  std::atomic_flag af = ATOMIC_FLAG_INIT;
+  void lock() {
+    while (af.test_and_set(std::memory_order_acquire))
+      ;
+  }
+  void unlock() {
+    af.clear(std::memory_order_release);
+  }
+};
+
+// ops/sec of nthreads taking the lock around a short critical section;
+// per-thread counts go to *acquired
+template <class Lock>
+double lock_throughput(Lock& lock, int nthreads, size_t ops,
+                       std::vector<size_t> *acquired = nullptr)
+{
+  std::atomic<bool> go = false, stop = false;
+  std::atomic<size_t> done = 0;
+  std::vector<size_t> counts(nthreads);
+  uint64_t shared[8] = {};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nthreads; t++) {
+    threads.emplace_back([&, t] {
+      while (!go) {
+        std::this_thread::yield();
+      }
+      size_t n = 0;
+      while (!stop) {
+        {
+          std::lock_guard l(lock);
+          for (auto& v : shared) {
+            v++;
+          }
+        }
+        if (++n % 64 == 0 && done.fetch_add(64) + 64 >= ops) {
+          stop = true;
+        }
+      }
+      counts[t] = n;
+    });
+  }
+  utime_t start = clock_now();
+  go = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+  utime_t end = clock_now();
+  size_t total = 0;
+  for (auto n : counts) {
+    total += n;
+  }
+  EXPECT_EQ(total, shared[0]);
+  if (acquired) {
+    *acquired = std::move(counts);
+  }
+  return (double)total / (double)(end - start);
+}
+
+TEST(Spinlock, basic)
+{
+  spinlock l;
+  ASSERT_TRUE(l.try_lock());
+  ASSERT_TRUE(l.is_locked());
+  ASSERT_FALSE(l.try_lock());
+  l.unlock();
+  ASSERT_FALSE(l.is_locked());
+
+  // a holder that sleeps makes waiters park, and unlock wakes them
+  size_t n = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 1000; i++) {
+        std::lock_guard g(l);
+        if (i % 100 == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        n++;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(8000u, n);
+  ASSERT_FALSE(l.is_locked());
+}
+
+TEST(Spinlock, contention_performance)
+{
+  const size_t ops = 200000;
+  for (int nthreads : {1, 2, 4, 8, 16, 32, 64, 128}) {
+    tas_lock_t tas;
+    spinlock adaptive;
+    std::mutex mutex;
+    double a = lock_throughput(adaptive, nthreads, ops);
+    double m = lock_throughput(mutex, nthreads, ops);
+    // the bare TAS lock can spin away whole time slices; keep it short
+    double t = lock_throughput(tas, nthreads, ops / 10);
+    std::cout << nthreads << " threads: tas " << t << ", spinlock " << a
+              << ", mutex " << m << " locks/sec" << std::endl;
+  }
+}
+
+TEST(MCSLock, basic)
+{
+  mcs_lock a, b;
+  ASSERT_TRUE(a.try_lock());
+  ASSERT_FALSE(a.try_lock());
+  ASSERT_FALSE(a.has_waiters());
+  // held out of order
+  b.lock();
+  a.unlock();
+  ASSERT_FALSE(a.is_locked());
+  b.unlock();
+  ASSERT_FALSE(b.is_locked());
+
+  cohort_lock c;
+  size_t n = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 2000; i++) {
+        std::lock_guard g(a);
+        std::lock_guard h(c);
+        if (i % 500 == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        n++;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(16000u, n);
+  ASSERT_FALSE(a.is_locked());
+}
+
+// min/max of per-thread acquisitions; 1 is perfectly fair
+static double lock_fairness(const std::vector<size_t>& acquired)
+{
+  auto [lo, hi] = std::minmax_element(acquired.begin(), acquired.end());
+  return *hi ? (double)*lo / (double)*hi : 1;
+}
+
+TEST(MCSLock, contention_performance)
+{
+  const size_t ops = 200000;
+  for (int nthreads : {1, 2, 4, 8, 16, 32, 64}) {
+    spinlock spin;
+    std::mutex mutex;
+    mcs_lock mcs;
+    cohort_lock cohort;
+    std::vector<size_t> acquired;
+    std::cout << nthreads << " threads:";
+    double r = lock_throughput(spin, nthreads, ops, &acquired);
+    std::cout << " spinlock " << r << " (" << lock_fairness(acquired) << ")";
+    r = lock_throughput(mutex, nthreads, ops, &acquired);
+    std::cout << ", mutex " << r << " (" << lock_fairness(acquired) << ")";
+    r = lock_throughput(mcs, nthreads, ops, &acquired);
+    std::cout << ", mcs " << r << " (" << lock_fairness(acquired) << ")";
+    r = lock_throughput(cohort, nthreads, ops, &acquired);
+    std::cout << ", cohort " << r << " (" << lock_fairness(acquired) << ")"
+              << " locks/sec (fairness)" << std::endl;
+  }
+}
+
+struct seq_record_t {
+  uint64_t a = 0;
+  uint64_t b = 0;
+  uint32_t c = 0;
+};
+
+TEST(Seqlock, basic)
+{
+  seqlock<seq_record_t> sl;
+  seq_record_t r = sl.load();
+  ASSERT_EQ(0u, r.a);
+  sl.store(seq_record_t{1, 2, 3});
+  ASSERT_TRUE(sl.try_load(&r));
+  ASSERT_EQ(2u, r.b);
+  sl.update([](seq_record_t& v) { v.c += 10; });
+  ASSERT_EQ(13u, sl.load().c);
+
+  // readers never see a half-written record
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> writers;
+  for (int w = 0; w < 2; w++) {
+    writers.emplace_back([&] {
+      for (uint64_t i = 0; i < 100000; i++) {
+        sl.update([](seq_record_t& v) {
+          v.a++;
+          v.b = v.a * 2;
+          v.c = v.a * 3;
+        });
+      }
+    });
+  }
+  std::vector<std::thread> readers;
+  std::atomic<size_t> torn = 0;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&] {
+      while (!stop) {
+        seq_record_t v = sl.load();
+        if (v.b != v.a * 2 || v.c != (uint32_t)(v.a * 3)) {
+          torn++;
+        }
+      }
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  stop = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  ASSERT_EQ(0u, torn);
+  ASSERT_EQ(200001u, sl.load().a);
+}
+
+TEST(RWSpinlock, basic)
+{
+  rw_spinlock l;
+  ASSERT_TRUE(l.try_lock_shared());
+  ASSERT_TRUE(l.try_lock_shared());
+  ASSERT_FALSE(l.try_lock());
+  l.unlock_shared();
+  l.unlock_shared();
+  ASSERT_TRUE(l.try_lock());
+  ASSERT_FALSE(l.try_lock_shared());
+  l.unlock();
+
+  uint64_t a = 0, b = 0;
+  std::atomic<bool> stop = false;
+  std::atomic<size_t> torn = 0, reads = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      while (!stop) {
+        std::shared_lock g(l);
+        if (a != b) {
+          torn++;
+        }
+        reads++;
+      }
+    });
+  }
+  std::vector<std::thread> writers;
+  for (int w = 0; w < 2; w++) {
+    writers.emplace_back([&] {
+      for (int i = 0; i < 20000; i++) {
+        std::unique_lock g(l);
+        a++;
+        if (i % 1000 == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        b++;
+      }
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  stop = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(0u, torn);
+  ASSERT_EQ(40000u, a);
+  ASSERT_GT(reads, 0u);
+}
+
+// reads/sec of nreaders against one writer updating every 100us; read()
+// returns what it read so it isn't optimised away
+template <class Read, class Write>
+double read_throughput(int nreaders, double seconds, Read&& read,
+                       Write&& write)
+{
+  std::atomic<bool> stop = false;
+  std::atomic<size_t> total = 0;
+  std::atomic<uint64_t> sink = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nreaders; t++) {
+    threads.emplace_back([&] {
+      size_t n = 0;
+      uint64_t sum = 0;
+      while (!stop) {
+        sum += read();
+        n++;
+      }
+      total += n;
+      sink += sum;
+    });
+  }
+  std::thread writer([&] {
+    while (!stop) {
+      write();
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+  utime_t start = clock_now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+  writer.join();
+  return (double)total / (double)(clock_now() - start);
+}
+
+TEST(RWSpinlock, read_scaling_performance)
+{
+  const double seconds = 0.1;
+  for (int nreaders : {1, 2, 4, 8, 16}) {
+    seq_record_t rec;
+
+    spinlock spin;
+    double s = read_throughput(nreaders, seconds, [&] {
+      std::lock_guard g(spin);
+      return rec.a;
+    }, [&] {
+      std::lock_guard g(spin);
+      rec.a++;
+    });
+    std::shared_mutex shared;
+    double m = read_throughput(nreaders, seconds, [&] {
+      std::shared_lock g(shared);
+      return rec.a;
+    }, [&] {
+      std::unique_lock g(shared);
+      rec.a++;
+    });
+    rw_spinlock rw;
+    double r = read_throughput(nreaders, seconds, [&] {
+      std::shared_lock g(rw);
+      return rec.a;
+    }, [&] {
+      std::unique_lock g(rw);
+      rec.a++;
+    });
+    seqlock<seq_record_t> seq;
+    double q = read_throughput(nreaders, seconds, [&] {
+      return seq.load().a;
+    }, [&] {
+      seq.update([](seq_record_t& v) { v.a++; });
+    });
+    std::cout << nreaders << " readers: spinlock " << s << ", shared_mutex "
+              << m << ", rw_spinlock " << r << ", seqlock " << q
+              << " reads/sec" << std::endl;
+  }
+}
+
+TEST(LockProfiler, basic)
+{
+  lockprof::set_enabled(true);
+  lockprof::reset();
+  lockprof::profiled_spinlock a("test::a"), a2("test::a");
+  lockprof::profiled_mutex b("test::b");
+
+  for (int i = 0; i < 100; i++) {
+    std::lock_guard g(i % 2 ? a : a2);
+  }
+  ASSERT_TRUE(a.try_lock());
+  a.unlock();
+
+  // holders that sleep make the others wait
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 50; i++) {
+        std::lock_guard g(b);
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // the threads have exited; their counts were kept
+  std::map<std::string, lockprof::lock_stats_t> stats;
+  lockprof::get_stats(&stats);
+  auto& sa = stats["test::a"];
+  ASSERT_EQ(101u, sa.acquisitions);
+  ASSERT_EQ(0u, sa.contended);
+  auto& sb = stats["test::b"];
+  ASSERT_EQ(200u, sb.acquisitions);
+  ASSERT_GT(sb.contended, 0u);
+  ASSERT_GT(sb.wait_ns, 0u);
+  ASSERT_GE(sb.hold_ns, 200u * 200000);
+  uint64_t held = 0;
+  for (auto n : sb.hold_hist) {
+    held += n;
+  }
+  ASSERT_EQ(200u, held);
+
+  // ranked by wait time
+  std::stringstream ss;
+  std::unique_ptr<Formatter> f(Formatter::create("json"));
+  f->open_object_section("locks");
+  lockprof::dump(f.get());
+  f->close_section();
+  f->flush(ss);
+  std::string out = ss.str();
+  ASSERT_NE(std::string::npos, out.find("\"hold_histogram\""));
+  ASSERT_LT(out.find("\"test::b\""), out.find("\"test::a\""));
+
+  lockprof::set_enabled(false);
+  lockprof::reset();
+  {
+    std::lock_guard g(b);
+  }
+  stats.clear();
+  lockprof::get_stats(&stats);
+  ASSERT_EQ(0u, stats["test::b"].acquisitions);
+}
+
+TEST(LockProfiler, thread_exit_with_slab_cache)
+{
+  // the slab thread cache is drained after the thread's lock stats are
+  // torn down, and the drain takes the profiled slab class lock
+  auto& pool = mempool::get_pool(mempool::unittest::id);
+  ASSERT_EQ(0u, mempool::unittest::allocated_items());
+  ASSERT_TRUE(pool.set_slab(mempool::unittest::id, true));
+  lockprof::set_enabled(true);
+  for (int round = 0; round < 4; round++) {
+    std::thread t([] {
+      mempool::unittest::set<int> s;
+      for (int i = 0; i < 1000; i++) {
+        s.insert(i);
+      }
+    });
+    t.join();
+  }
+  lockprof::set_enabled(false);
+  ASSERT_EQ(0u, mempool::unittest::allocated_items());
+  ASSERT_TRUE(pool.set_slab(mempool::unittest::id, false));
+}
+
+TEST(LockProfiler, overhead_performance)
+{
+  const size_t count = 5000000;
+  spinlock plain;
+  lockprof::profiled_spinlock profiled("test::overhead");
+  utime_t start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    std::lock_guard g(plain);
+  }
+  utime_t off_start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    std::lock_guard g(profiled);
+  }
+  lockprof::set_enabled(true);
+  utime_t on_start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    std::lock_guard g(profiled);
+  }
+  utime_t end = clock_now();
+  lockprof::set_enabled(false);
+  std::cout << "spinlock " << (float)count / (float)(off_start - start)
+            << ", profiled off " << (float)count / (float)(on_start - off_start)
+            << ", profiled on " << (float)count / (float)(end - on_start)
+            << " locks/sec" << std::endl;
+}
+
+TEST(WorkPool, basic)
+{
+  work_pool_t pool(4);
+  ASSERT_EQ(4u, pool.size());
+  ASSERT_EQ(-1, pool.current_worker());
+
+  // every index exactly once
+  std::vector<std::atomic<int>> hits(100000);
+  pool.parallel_for(0, hits.size(), 100, [&](size_t b, size_t e) {
+    ASSERT_LE(e - b, 100u);
+    for (size_t i = b; i < e; i++) {
+      hits[i]++;
+    }
+  });
+  for (auto& h : hits) {
+    ASSERT_EQ(1, h);
+  }
+
+  // folded in order
+  std::string digits = pool.parallel_reduce(
+    0, 1000, 7, std::string(),
+    [](size_t b, size_t e) {
+      std::string s;
+      for (size_t i = b; i < e; i++) {
+        s += '0' + i % 10;
+      }
+      return s;
+    },
+    [](const std::string& a, const std::string& b) { return a + b; });
+  ASSERT_EQ(1000u, digits.size());
+  for (size_t i = 0; i < digits.size(); i++) {
+    ASSERT_EQ('0' + (int)(i % 10), digits[i]);
+  }
+  // empty and backwards ranges fold to init
+  auto count = [](size_t b, size_t e) { return e - b; };
+  auto add = [](size_t a, size_t b) { return a + b; };
+  ASSERT_EQ(7u, pool.parallel_reduce(5, 5, 1, (size_t)7, count, add));
+  ASSERT_EQ(7u, pool.parallel_reduce(9, 5, 1, (size_t)7, count, add));
+
+  // nested, from inside the pool
+  std::atomic<size_t> inner = 0;
+  pool.parallel_for(0, 16, 1, [&](size_t b, size_t e) {
+    ASSERT_GE(pool.current_worker() + 1, 0);
+    pool.parallel_for(0, 1000, 10, [&](size_t b, size_t e) {
+      inner += e - b;
+    });
+  });
+  ASSERT_EQ(16000u, inner);
+
+  // the first exception comes back to the caller
+  ASSERT_THROW(pool.parallel_for(0, 1000, 1, [](size_t b, size_t e) {
+    if (b == 500) {
+      throw std::runtime_error("piece 500");
+    }
+  }), std::runtime_error);
+
+  ASSERT_THROW(pool.parallel_reduce(0, 1000, 10, (size_t)0,
+                                    [](size_t b, size_t e) -> size_t {
+                                      if (b == 500) {
+                                        throw std::runtime_error("piece 500");
+                                      }
+                                      return e - b;
+                                    }, add), std::runtime_error);
+
+  std::atomic<uint32_t> ran = 0;
+  for (int i = 0; i < 100; i++) {
+    pool.submit([&] { ran++; });
+  }
+  while (ran < 100) {
+    std::this_thread::yield();
+  }
+
+  // pinned workers are on their cpus before they run anything
+  work_pool_t pinned(2, true);
+  const int cpus = std::max(1u, std::thread::hardware_concurrency());
+  std::atomic<size_t> n = 0;
+  std::atomic<int> misplaced = 0;
+  pinned.parallel_for(0, 1000, 1, [&](size_t b, size_t e) {
+    int w = pinned.current_worker();
+    if (w >= 0 && sched_getcpu() != w % cpus) {
+      misplaced++;
+    }
+    n += e - b;
+  });
+  ASSERT_EQ(1000u, n);
+  ASSERT_EQ(0, misplaced);
+}
+
+TEST(WorkPool, submit_throws)
+{
+  // other tests leave the shared pool's workers running
+  GTEST_FLAG_SET(death_test_style, "threadsafe");
+  EXPECT_DEATH({
+    work_pool_t pool(1);
+    pool.submit([] { throw std::runtime_error("submitted"); });
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+  }, "submitted task threw");
+  GTEST_FLAG_SET(death_test_style, "fast");
+}
+
+TEST(WorkPool, parallel_crc32c)
+{
+  buffer::list bl;
+  for (int i = 0; i < 1000; i++) {
+    buffer::ptr bp(4096 + i * 7);
+    for (unsigned j = 0; j < bp.length(); j++) {
+      bp.c_str()[j] = rand();
+    }
+    bl.append(bp);
+  }
+  work_pool_t pool(4);
+  for (uint32_t seed : {0u, 1u, 0xffffffffu}) {
+    uint32_t serial = bl.begin().crc32c(bl.length(), seed);
+    ASSERT_EQ(serial, bl.crc32c(seed, &pool));
+    ASSERT_EQ(serial, bl.crc32c(seed, nullptr));
+  }
+  buffer::list small;
+  small.append("abc", 3);
+  ASSERT_EQ(small.crc32c(5), small.crc32c(5, &pool));
+}
+
+TEST(WorkPool, performance)
+{
+  buffer::list bl;
+  for (int i = 0; i < 64; i++) {
+    bl.append(buffer::create(256 * 1024));
+  }
+  bl.zero();
+  const size_t count = 20;
+  uint32_t crc = 0;
+  utime_t start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    crc ^= bl.begin().crc32c(bl.length(), i);
+  }
+  float serial = (float)(count * bl.length()) / (float)(clock_now() - start);
+  std::cout << "crc32c serial " << serial << " bytes/sec";
+  // a one-thread pool takes the serial (cached) path
+  for (unsigned threads : {2, 4, 8}) {
+    work_pool_t pool(threads);
+    start = clock_now();
+    for (size_t i = 0; i < count; i++) {
+      crc ^= bl.crc32c(i, &pool);
+    }
+    std::cout << ", " << threads << " threads "
+              << (float)(count * bl.length()) / (float)(clock_now() - start);
+  }
+  std::cout << " (" << crc << ")" << std::endl;
+
+  // scheduling overhead: empty pieces
+  for (unsigned threads : {1, 2, 4, 8}) {
+    work_pool_t pool(threads);
+    std::atomic<size_t> n = 0;
+    start = clock_now();
+    pool.parallel_for(0, 1000000, 1, [&](size_t b, size_t e) {
+      n.fetch_add(e - b, std::memory_order_relaxed);
+    });
+    std::cout << threads << " threads: "
+              << (float)n / (float)(clock_now() - start) << " pieces/sec"
+              << std::endl;
+  }
+}
+
+TEST(Queue, spsc_ring)
+{
+  spsc_ring<buffer::list> ring(3);
+  ASSERT_EQ(4u, ring.capacity());
+  ASSERT_TRUE(ring.empty());
+  for (int i = 0; i < 4; i++) {
+    buffer::list bl;
+    bl.append(std::to_string(i));
+    ASSERT_TRUE(ring.push(std::move(bl)));
+  }
+  buffer::list extra;
+  extra.append("x");
+  ASSERT_FALSE(ring.push(std::move(extra)));
+  buffer::list out;
+  ASSERT_TRUE(ring.pop(out));
+  ASSERT_EQ("0", out.to_str());
+  std::vector<buffer::list> batch;
+  ASSERT_EQ(3u, ring.pop_batch(std::back_inserter(batch), 10));
+  ASSERT_EQ("3", batch[2].to_str());
+  ASSERT_FALSE(ring.pop(out));
+
+  // in order across threads, with the consumer sleeping when idle
+  spsc_ring<uint64_t> r(64);
+  const uint64_t n = 200000;
+  std::thread producer([&] {
+    for (uint64_t i = 0; i < n; i++) {
+      while (!r.push(uint64_t(i))) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint64_t expect = 0;
+  while (expect < n) {
+    uint64_t v;
+    if (!r.pop(v)) {
+      r.wait();
+      continue;
+    }
+    ASSERT_EQ(expect, v);
+    expect++;
+  }
+  producer.join();
+}
+
+struct queue_msg_t : public mpsc_hook_t {
+  int producer = 0;
+  uint64_t seq = 0;
+  uint64_t sent = 0;
+  buffer::list bl;
+};
+
+TEST(Queue, mpsc_queue)
+{
+  mpsc_queue<queue_msg_t> q;
+  ASSERT_TRUE(q.empty());
+  ASSERT_EQ(nullptr, q.pop());
+  queue_msg_t a, b;
+  q.push(&a);
+  q.push(&b);
+  ASSERT_FALSE(q.empty());
+  ASSERT_EQ(&a, q.pop());
+  ASSERT_EQ(&b, q.pop());
+  ASSERT_EQ(nullptr, q.pop());
+  ASSERT_TRUE(q.empty());
+  // and again through the stub
+  q.push(&a);
+  ASSERT_EQ(&a, q.pop());
+
+  // per-producer order holds, and nothing is lost
+  const int producers = 4;
+  const uint64_t per = 50000;
+  std::vector<queue_msg_t> msgs(producers * per);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&, p] {
+      for (uint64_t i = 0; i < per; i++) {
+        queue_msg_t& m = msgs[p * per + i];
+        m.producer = p;
+        m.seq = i;
+        q.push(&m);
+      }
+    });
+  }
+  std::vector<uint64_t> next(producers);
+  uint64_t got = 0;
+  while (got < producers * per) {
+    size_t n = q.pop_batch([&](queue_msg_t *m) {
+      ASSERT_EQ(next[m->producer], m->seq);
+      next[m->producer]++;
+    }, 64);
+    got += n;
+    if (!n) {
+      q.wait(std::chrono::milliseconds(10));
+    }
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_TRUE(q.empty());
+
+  // eventfd wakeup, for consumers that poll other descriptors too
+  mpsc_queue<queue_msg_t> eq;
+  int fd = eq.get_waiter().event_fd();
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(eq.get_waiter().prepare_wait([&] { return !eq.empty(); }));
+  std::thread waker([&] { eq.push(&a); });
+  struct pollfd pfd = {fd, POLLIN, 0};
+  ASSERT_EQ(1, ::poll(&pfd, 1, 5000));
+  eq.get_waiter().ack();
+  waker.join();
+  ASSERT_EQ(&a, eq.pop());
+
+  // wakeups racing timeouts leave nothing pending for the next wait
+  queue_waiter_t w;
+  int wfd = w.event_fd();
+  std::atomic<bool> stop = false;
+  std::thread notifier([&] {
+    while (!stop) {
+      w.notify();
+    }
+  });
+  for (int i = 0; i < 20000; i++) {
+    ASSERT_FALSE(w.wait([] { return false; }, std::chrono::microseconds(1)));
+  }
+  stop = true;
+  notifier.join();
+  pfd = {wfd, POLLIN, 0};
+  ASSERT_EQ(0, ::poll(&pfd, 1, 0));
+}
+
+// messages/sec and latency percentiles, in ns, of one pipeline hop
+struct hop_stats_t {
+  double rate = 0;
+  uint64_t p50 = 0, p99 = 0, p999 = 0;
+
+  void set(std::vector<uint64_t>& lat, double seconds) {
+    std::sort(lat.begin(), lat.end());
+    rate = lat.size() / seconds;
+    p50 = lat[lat.size() / 2];
+    p99 = lat[lat.size() * 99 / 100];
+    p999 = lat[lat.size() * 999 / 1000];
+  }
+};
+
+static std::ostream& operator<<(std::ostream& out, const hop_stats_t& s)
+{
+  return out << s.rate << " msgs/sec, p50 " << s.p50 << " p99 " << s.p99
+             << " p99.9 " << s.p999 << " ns";
+}
+
+static uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TEST(Queue, performance)
+{
+  const size_t n = 200000;
+  std::vector<queue_msg_t> msgs(n);
+  for (auto& m : msgs) {
+    m.bl.append("payload", 7);
+  }
+  std::vector<uint64_t> lat;
+  lat.reserve(n);
+
+  // the mutex + condvar queue this replaces
+  {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<queue_msg_t*> q;
+    lat.clear();
+    utime_t start = clock_now();
+    std::thread producer([&] {
+      for (auto& m : msgs) {
+        m.sent = now_ns();
+        std::lock_guard l(lock);
+        q.push_back(&m);
+        cond.notify_one();
+      }
+    });
+    while (lat.size() < n) {
+      std::unique_lock l(lock);
+      cond.wait(l, [&] { return !q.empty(); });
+      while (!q.empty()) {
+        lat.push_back(now_ns() - q.front()->sent);
+        q.pop_front();
+      }
+    }
+    producer.join();
+    hop_stats_t s;
+    s.set(lat, (double)(clock_now() - start));
+    std::cout << "mutex+condvar: " << s << std::endl;
+  }
+
+  {
+    spsc_ring<queue_msg_t*> ring(1024);
+    lat.clear();
+    utime_t start = clock_now();
+    std::thread producer([&] {
+      for (auto& m : msgs) {
+        m.sent = now_ns();
+        while (!ring.push(&m)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+    queue_msg_t *batch[64];
+    while (lat.size() < n) {
+      size_t got = ring.pop_batch(batch, 64);
+      uint64_t now = now_ns();
+      for (size_t i = 0; i < got; i++) {
+        lat.push_back(now - batch[i]->sent);
+      }
+      if (!got) {
+        ring.wait();
+      }
+    }
+    producer.join();
+    hop_stats_t s;
+    s.set(lat, (double)(clock_now() - start));
+    std::cout << "spsc_ring: " << s << std::endl;
+  }
+
+  for (int producers : {1, 4}) {
+    mpsc_queue<queue_msg_t> q;
+    lat.clear();
+    utime_t start = clock_now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+      threads.emplace_back([&, p] {
+        for (size_t i = p; i < n; i += producers) {
+          msgs[i].sent = now_ns();
+          q.push(&msgs[i]);
+        }
+      });
+    }
+    while (lat.size() < n) {
+      size_t got = q.pop_batch([&](queue_msg_t *m) {
+        lat.push_back(now_ns() - m->sent);
+      }, 64);
+      if (!got) {
+        q.wait(std::chrono::milliseconds(1));
+      }
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    hop_stats_t s;
+    s.set(lat, (double)(clock_now() - start));
+    std::cout << "mpsc_queue, " << producers << " producers: " << s
+              << std::endl;
+  }
+}
+
+struct ebr_item_t {
+  static std::atomic<int> destroyed;
+  uint64_t a = 0, b = 0;    // b == 2 * a
+  ~ebr_item_t() {
+    destroyed++;
+  }
+};
+std::atomic<int> ebr_item_t::destroyed = 0;
+
+TEST(EBR, basic)
+{
+  ebr::synchronize();
+  size_t items0, bytes0, items, bytes;
+  ebr::get_pending(&items0, &bytes0);
+  ebr_item_t::destroyed = 0;
+
+  // a reader in a critical section holds the object back
+  std::atomic<int> stage = 0;
+  std::thread reader([&] {
+    ebr::guard_t g;
+    stage = 1;
+    while (stage != 2) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  while (stage != 1) {
+    std::this_thread::yield();
+  }
+  ebr::retire(new ebr_item_t, 100);
+  ebr::get_pending(&items, &bytes);
+  ASSERT_EQ(items0 + 1, items);
+  ASSERT_EQ(bytes0 + 100, bytes);
+
+  std::atomic<bool> synced = false;
+  std::thread syncer([&] {
+    ebr::synchronize();
+    synced = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ASSERT_FALSE(synced);
+  ASSERT_EQ(0, ebr_item_t::destroyed);
+  stage = 2;
+  reader.join();
+  syncer.join();
+  ebr::synchronize();
+  ASSERT_EQ(1, ebr_item_t::destroyed);
+
+  // nested sections, and what an exited thread retired
+  {
+    ebr::guard_t g1;
+    ebr::guard_t g2;
+  }
+  std::thread([] {
+    ebr::guard_t g;
+    ebr::retire(new ebr_item_t);
+  }).join();
+  ebr::synchronize();
+  ASSERT_EQ(2, ebr_item_t::destroyed);
+  ebr::get_pending(&items, &bytes);
+  ASSERT_EQ(items0, items);
+  ASSERT_EQ(bytes0, bytes);
+
+  // an exiting thread's old items don't bring forward the freeing of
+  // newer ones orphaned in the same bucket
+  std::atomic<bool> old_freed = false, new_freed = false;
+  auto mark = [](void *p) { static_cast<std::atomic<bool>*>(p)->store(true); };
+  stage = 0;
+  std::thread older([&] {
+    ebr::retire(&old_freed, mark, 0);
+    stage = 1;
+    while (stage != 2) {
+      std::this_thread::yield();
+    }
+  });
+  while (stage != 1) {
+    std::this_thread::yield();
+  }
+  for (int i = 0; i < 3; i++) {
+    ebr::synchronize();   // six epochs on: the same bucket again
+  }
+  std::thread([&] { ebr::retire(&new_freed, mark, 0); }).join();
+  std::atomic<bool> reading = false, done = false;
+  std::thread holder([&] {
+    ebr::guard_t g;
+    reading = true;
+    while (!done) {
+      std::this_thread::yield();
+    }
+  });
+  while (!reading) {
+    std::this_thread::yield();
+  }
+  stage = 2;
+  older.join();
+  for (int i = 0; i < 64; i++) {
+    ebr::retire(nullptr, [](void*) {}, 0);   // an attempt to advance
+  }
+  ASSERT_FALSE(new_freed);
+  done = true;
+  holder.join();
+  ebr::synchronize();
+  ASSERT_TRUE(old_freed);
+  ASSERT_TRUE(new_freed);
+}
+
+TEST(EBR, reentrant_deleter)
+{
+  // deleters run with no ebr lock held, so they may retire and wait
+  static std::atomic<int> freed;
+  freed = 0;
+  auto deleter = [](void*) {
+    freed++;
+    ebr::retire(nullptr, [](void*) { freed++; }, 0);
+    ebr::synchronize();
+  };
+  std::thread([&] { ebr::retire(nullptr, deleter, 0); }).join();
+  ebr::retire(nullptr, deleter, 0);
+  ebr::synchronize();
+  ebr::synchronize();
+  ASSERT_EQ(4, freed);
+}
+
+struct ebr_late_user_t {
+  ~ebr_late_user_t() {
+    ebr::guard_t g;
+    ebr::retire(new ebr_item_t);
+  }
+};
+
+TEST(EBR, use_after_thread_exit)
+{
+  ebr::synchronize();
+  size_t items0, bytes0, items, bytes;
+  ebr::get_pending(&items0, &bytes0);
+  ebr_item_t::destroyed = 0;
+  for (int i = 0; i < 4; i++) {
+    std::thread([] {
+      // constructed first, so destroyed after ebr's exit hook
+      static thread_local ebr_late_user_t late;
+      (void)&late;
+      ebr::guard_t g;
+    }).join();
+  }
+  ebr::synchronize();
+  ASSERT_EQ(4, ebr_item_t::destroyed);
+  ebr::get_pending(&items, &bytes);
+  ASSERT_EQ(items0, items);
+  ASSERT_EQ(bytes0, bytes);
+}
+
+TEST(EBR, rcu_ptr)
+{
+  ebr::synchronize();
+  size_t items0, bytes0, items, bytes;
+  ebr::get_pending(&items0, &bytes0);
+  ebr_item_t::destroyed = 0;
+  {
+    rcu_ptr<ebr_item_t> p(std::make_unique<ebr_item_t>());
+    std::atomic<bool> stop = false;
+    std::atomic<size_t> bad = 0, reads = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+      readers.emplace_back([&] {
+        size_t n = 0;
+        while (!stop) {
+          ebr::guard_t g;
+          const ebr_item_t *v = p.get();
+          if (v->b != 2 * v->a) {
+            bad++;
+          }
+          n++;
+        }
+        reads += n;
+      });
+    }
+    std::thread writer([&] {
+      for (int i = 0; i < 10000; i++) {
+        p.modify([](ebr_item_t& v) {
+          v.a++;
+          v.b = 2 * v.a;
+        });
+      }
+      for (int i = 0; i < 1000; i++) {
+        auto next = std::make_unique<ebr_item_t>();
+        next->a = 1;
+        next->b = 2;
+        p.update(std::move(next));
+      }
+    });
+    writer.join();
+    stop = true;
+    for (auto& t : readers) {
+      t.join();
+    }
+    ASSERT_EQ(0u, bad);
+    ASSERT_GT(reads, 0u);
+    ebr::guard_t g;
+    ASSERT_EQ(1u, p.get()->a);
+  }
+  ebr::synchronize();
+  // the copies made by modify() go too
+  ASSERT_GE(ebr_item_t::destroyed, 11001);
+  ebr::get_pending(&items, &bytes);
+  ASSERT_EQ(items0, items);
+  ASSERT_EQ(bytes0, bytes);
+}
+
+TEST(EBR, read_scaling_performance)
+{
+  const double seconds = 0.1;
+  for (int nreaders : {1, 2, 4, 8}) {
+    rcu_ptr<ebr_item_t> rcu(std::make_unique<ebr_item_t>());
+    double r = read_throughput(nreaders, seconds, [&] {
+      ebr::guard_t g;
+      return rcu.get()->a;
+    }, [&] {
+      rcu.modify([](ebr_item_t& v) { v.a++; });
+    });
+    std::atomic<std::shared_ptr<ebr_item_t>> shared(
+      std::make_shared<ebr_item_t>());
+    double s = read_throughput(nreaders, seconds, [&] {
+      return shared.load()->a;
+    }, [&] {
+      auto next = std::make_shared<ebr_item_t>(*shared.load());
+      next->a++;
+      shared.store(std::move(next));
+    });
+    ebr_item_t item;
+    rw_spinlock rw;
+    double l = read_throughput(nreaders, seconds, [&] {
+      std::shared_lock g(rw);
+      return item.a;
+    }, [&] {
+      std::unique_lock g(rw);
+      item.a++;
+    });
+    std::cout << nreaders << " readers: rcu_ptr " << r
+              << ", atomic<shared_ptr> " << s << ", rw_spinlock " << l
+              << " reads/sec" << std::endl;
+  }
+  ebr::synchronize();
+}
+
+TEST(PerfCounters, basic)
+{
+  perf::counter_t c("test_counter", "a counter");
+  perf::counter_t c2("test_counter");
+  perf::gauge_t g("test_gauge");
+  uint64_t base = perf::get_counter("test_counter");
+
+  // exited threads' counts are kept
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 10000; i++) {
+        c.inc();
+        c2.inc(2);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  c.inc(5);
+  ASSERT_EQ(base + 4 * 30000 + 5, perf::get_counter("test_counter"));
+  ASSERT_EQ(0u, perf::get_counter("no_such_counter"));
+
+  g.set(10);
+  g.inc();
+  g.dec(3);
+  ASSERT_EQ(8, g.get());
+  ASSERT_EQ(8, perf::get_gauge("test_gauge"));
+}
+
+struct perf_late_user_t {
+  ~perf_late_user_t() {
+    static perf::counter_t c("test_late_counter");
+    c.inc(3);
+  }
+};
+
+TEST(PerfCounters, count_after_thread_exit)
+{
+  perf::counter_t c("test_late_counter");
+  uint64_t base = perf::get_counter("test_late_counter");
+  for (int i = 0; i < 4; i++) {
+    std::thread([&] {
+      // constructed first, so destroyed after the exit hook
+      static thread_local perf_late_user_t late;
+      (void)&late;
+      c.inc();
+    }).join();
+  }
+  ASSERT_EQ(base + 4 * 4, perf::get_counter("test_late_counter"));
+}
+
+TEST(PerfCounters, histogram)
+{
+  // buckets are contiguous, and each is within 1/8 of its values
+  ASSERT_EQ(0u, perf::hist_bucket(0));
+  ASSERT_EQ(7u, perf::hist_bucket(7));
+  ASSERT_EQ(perf::hist_buckets - 1, perf::hist_bucket(UINT64_MAX));
+  for (unsigned b = 1; b < perf::hist_buckets; b++) {
+    uint64_t floor = perf::hist_bucket_floor(b);
+    ASSERT_GT(floor, perf::hist_bucket_floor(b - 1));
+    ASSERT_EQ(b, perf::hist_bucket(floor));
+    ASSERT_EQ(b - 1, perf::hist_bucket(floor - 1));
+    if (b > perf::hist_sub) {
+      ASSERT_LE(floor - perf::hist_bucket_floor(b - 1), floor / 8 + 1);
+    }
+  }
+
+  perf::histogram_t h("test_latency_ns", "a histogram");
+  std::thread([&] {
+    for (uint64_t v = 1; v <= 1000; v++) {
+      h.record(v * 1000);
+    }
+  }).join();
+  for (uint64_t v = 1001; v <= 2000; v++) {
+    h.record(v * 1000);
+  }
+  perf::histogram_snapshot_t s;
+  ASSERT_TRUE(perf::get_histogram("test_latency_ns", &s));
+  ASSERT_EQ(2000u, s.count);
+  ASSERT_EQ(1000u * 2000 * 2001 / 2, s.sum);
+  uint64_t p50 = s.percentile(50);
+  ASSERT_GE(p50, 1000000u);
+  ASSERT_LE(p50, 1000000u * 9 / 8);
+  uint64_t p99 = s.percentile(99);
+  ASSERT_GE(p99, 1980000u);
+  ASSERT_LE(p99, 1980000u * 9 / 8);
+  ASSERT_FALSE(perf::get_histogram("no_such_histogram", &s));
+}
+
+TEST(PerfCounters, dump)
+{
+  perf::counter_t c("test.dump_counter", "dumped \\ once\nonly");
+  perf::histogram_t h("test_dump_ns");
+  c.inc(3);
+  h.record(5);
+  h.record(100);
+
+  std::unique_ptr<Formatter> f(Formatter::create("json"));
+  f->open_object_section("perf");
+  perf::dump(f.get());
+  f->close_section();
+  std::stringstream ss;
+  f->flush(ss);
+  std::string out = ss.str();
+  ASSERT_NE(std::string::npos, out.find("\"test.dump_counter\":3"));
+  ASSERT_NE(std::string::npos, out.find("\"test_dump_ns\""));
+  ASSERT_NE(std::string::npos, out.find("\"p99\""));
+
+  std::stringstream prom;
+  perf::dump_prometheus(prom, "unittest");
+  out = prom.str();
+  ASSERT_NE(std::string::npos, out.find(
+    "# HELP unittest_test_dump_counter_total dumped \\\\ once\\nonly\n"
+    "# TYPE unittest_test_dump_counter_total counter\n"
+    "unittest_test_dump_counter_total 3\n"));
+  // every power of two, empty or not
+  ASSERT_NE(std::string::npos, out.find(
+    "# TYPE unittest_test_dump_ns histogram\n"
+    "unittest_test_dump_ns_bucket{le=\"0\"} 0\n"
+    "unittest_test_dump_ns_bucket{le=\"1\"} 0\n"
+    "unittest_test_dump_ns_bucket{le=\"3\"} 0\n"
+    "unittest_test_dump_ns_bucket{le=\"7\"} 1\n"
+    "unittest_test_dump_ns_bucket{le=\"15\"} 1\n"
+    "unittest_test_dump_ns_bucket{le=\"31\"} 1\n"
+    "unittest_test_dump_ns_bucket{le=\"63\"} 1\n"
+    "unittest_test_dump_ns_bucket{le=\"127\"} 2\n"));
+  ASSERT_NE(std::string::npos, out.find(
+    "unittest_test_dump_ns_bucket{le=\"9223372036854775807\"} 2\n"
+    "unittest_test_dump_ns_bucket{le=\"+Inf\"} 2\n"
+    "unittest_test_dump_ns_sum 105\n"
+    "unittest_test_dump_ns_count 2\n"));
+  size_t lines = 0;
+  for (size_t i = out.find("unittest_test_dump_ns_bucket"); i != std::string::npos;
+       i = out.find("unittest_test_dump_ns_bucket", i + 1)) {
+    lines++;
+  }
+  ASSERT_EQ(65u, lines);
+}
+
+TEST(PerfCounters, buffer)
+{
+  uint64_t refills = perf::get_counter("buffer_refill_append_space");
+  uint64_t misses = perf::get_counter("buffer_crc_cache_miss");
+  uint64_t hits = perf::get_counter("buffer_crc_cache_hit");
+  uint64_t written = perf::get_counter("buffer_write_fd_bytes");
+
+  buffer::list bl;
+  std::string s(100000, 'x');
+  bl.append(s);
+  ASSERT_GT(perf::get_counter("buffer_refill_append_space"), refills);
+  bl.crc32c(0);
+  bl.crc32c(0);
+  uint64_t segs = bl.get_num_buffers();
+  ASSERT_EQ(misses + segs, perf::get_counter("buffer_crc_cache_miss"));
+  ASSERT_EQ(hits + segs, perf::get_counter("buffer_crc_cache_hit"));
+
+  int fd = ::open("/dev/null", O_WRONLY);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(0, bl.write_fd(fd));
+  ::close(fd);
+  ASSERT_EQ(written + bl.length(), perf::get_counter("buffer_write_fd_bytes"));
+  perf::histogram_snapshot_t lat;
+  ASSERT_TRUE(perf::get_histogram("buffer_write_fd_latency_ns", &lat));
+  ASSERT_GT(lat.count, 0u);
+}
+
+TEST(PerfCounters, overhead_performance)
+{
+  const size_t count = 10000000;
+  perf::counter_t c("test_overhead");
+  perf::histogram_t h("test_overhead_ns");
+  for (int nthreads : {1, 4}) {
+    std::atomic<uint64_t> shared = 0;
+    auto run = [&](auto&& op) {
+      std::vector<std::thread> threads;
+      utime_t start = clock_now();
+      for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&] {
+          for (size_t i = 0; i < count / nthreads; i++) {
+            op(i);
+          }
+        });
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+      return (float)count / (float)(clock_now() - start);
+    };
+    float a = run([&](size_t) {
+      shared.fetch_add(1, std::memory_order_relaxed);
+    });
+    float p = run([&](size_t) { c.inc(); });
+    float l = run([&](size_t i) { h.record(i); });
+    std::cout << nthreads << " threads: atomic " << a << ", counter " << p
+              << ", histogram " << l << " ops/sec" << std::endl;
+  }
+}
+
+TEST(TscClock, basic)
+{
+  if (!tsc_clock::is_tsc()) {
+    std::cout << "no invariant tsc; tsc_clock is mono_clock" << std::endl;
+  } else {
+    std::cout << "tsc at " << tsc_clock::ticks_per_sec() / 1e6 << " MHz"
+              << std::endl;
+  }
+
+  // on mono_clock's timeline, across a few recalibrations; in ns, as
+  // gtest can't print time points
+  auto ns = [](auto t) -> int64_t { return t.time_since_epoch().count(); };
+  const int64_t slack = 50000;
+  for (int i = 0; i < 20; i++) {
+    int64_t before = ns(mono_clock::now());
+    int64_t t = ns(tsc_clock::to_mono(tsc_clock::now()));
+    int64_t after = ns(mono_clock::now());
+    ASSERT_GE(t + slack, before);
+    ASSERT_LE(t, after + slack);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  tsc_clock::recalibrate();
+
+  // durations are timespans
+  mono_time m0 = mono_clock::now();
+  tsc_time t0 = tsc_clock::now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  timespan d = tsc_clock::now() - t0;
+  timespan md = mono_clock::now() - m0;
+  ASSERT_GE(d.count(), 20000000u);
+  ASSERT_LE(std::abs((int64_t)d.count() - (int64_t)md.count()), slack);
+
+  // never steps back, in any thread
+  std::atomic<size_t> backwards = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      tsc_time last = tsc_clock::now();
+      for (int i = 0; i < 1000000; i++) {
+        tsc_time now = tsc_clock::now();
+        if (now < last) {
+          backwards++;
+        }
+        last = now;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(0u, backwards);
+}
+
+TEST(TscClock, performance)
+{
+  const size_t count = 10000000;
+  uint64_t sum = 0;
+  utime_t start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sum += mono_clock::now().time_since_epoch().count();
+  }
+  utime_t coarse_start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sum += coarse_mono_clock::now().time_since_epoch().count();
+  }
+  utime_t tsc_start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sum += tsc_clock::now().time_since_epoch().count();
+  }
+  utime_t end = clock_now();
+  ASSERT_NE(0u, sum);
+  std::cout << "mono_clock " << (double)(coarse_start - start) * 1e9 / count
+            << ", coarse_mono_clock "
+            << (double)(tsc_start - coarse_start) * 1e9 / count
+            << ", tsc_clock " << (double)(end - tsc_start) * 1e9 / count
+            << " ns/call" << std::endl;
+}
+
+TEST(CachedClock, basic)
+{
+  auto ns = [](auto t) -> int64_t { return t.time_since_epoch().count(); };
+
+  // not started: the real thing
+  ASSERT_FALSE(cached_clock::is_running());
+  int64_t before = ns(mono_clock::now());
+  int64_t c = ns(cached_mono_clock::now());
+  ASSERT_GE(c, before);
+  ASSERT_LE(c, ns(mono_clock::now()));
+
+  const auto interval = std::chrono::microseconds(500);
+  cached_clock::start(interval);
+  ASSERT_TRUE(cached_clock::is_running());
+  ASSERT_EQ(interval.count(), cached_clock::get_interval().count());
+
+  // behind by about the interval, never ahead
+  std::vector<int64_t> stale;
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_NE(0u, cached_clock::stamps.mono_ns.load());
+    int64_t c = ns(cached_mono_clock::now());
+    int64_t m = ns(mono_clock::now());
+    ASSERT_LE(c, m);
+    stale.push_back(m - c);
+    int64_t r = ns(cached_real_clock::now());
+    ASSERT_LE(r, ns(real_clock::now()));
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  std::sort(stale.begin(), stale.end());
+  int64_t p50 = stale[stale.size() / 2], p99 = stale[stale.size() * 99 / 100];
+  std::cout << "interval 500us: staleness p50 " << p50 / 1000 << "us, p99 "
+            << p99 / 1000 << "us, max " << stale.back() / 1000 << "us"
+            << std::endl;
+  ASSERT_LE(p50, 2 * 1000 * interval.count());
+  ASSERT_LE(stale.back(), 50000000);
+
+  // never goes back, in any thread
+  std::atomic<size_t> backwards = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      cached_mono_time last = cached_mono_clock::now();
+      for (int i = 0; i < 1000000; i++) {
+        cached_mono_time now = cached_mono_clock::now();
+        if (now < last) {
+          backwards++;
+        }
+        last = now;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(0u, backwards);
+
+  // nor as it's stopped and started under readers
+  std::atomic<bool> toggling = true;
+  threads.clear();
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      cached_mono_time last = cached_mono_clock::now();
+      while (toggling) {
+        cached_mono_time now = cached_mono_clock::now();
+        if (now < last) {
+          backwards++;
+        }
+        last = now;
+      }
+    });
+  }
+  for (int i = 0; i < 200; i++) {
+    cached_clock::stop();
+    std::this_thread::yield();
+    cached_clock::start(interval);
+  }
+  toggling = false;
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(0u, backwards);
+
+  // a stop racing a start never leaves the updater running on zeroed
+  // stamps
+  for (int i = 0; i < 100; i++) {
+    std::thread stopper([] { cached_clock::stop(); });
+    cached_clock::start(interval);
+    stopper.join();
+    if (cached_clock::is_running()) {
+      ASSERT_NE(0u, cached_clock::stamps.mono_ns.load());
+    }
+    cached_clock::start(interval);
+  }
+
+  cached_clock::start(std::chrono::microseconds(100));
+  ASSERT_EQ(100, cached_clock::get_interval().count());
+  cached_clock::stop();
+  ASSERT_FALSE(cached_clock::is_running());
+  ASSERT_EQ(0, cached_clock::get_interval().count());
+  before = ns(mono_clock::now());
+  ASSERT_GE(ns(cached_mono_clock::now()), before);
+}
+
+TEST(CachedClock, performance)
+{
+  const size_t count = 10000000;
+  cached_clock::start(std::chrono::milliseconds(1));
+  uint64_t sum = 0;
+  utime_t start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sum += coarse_mono_clock::now().time_since_epoch().count();
+  }
+  utime_t cached_start = clock_now();
+  for (size_t i = 0; i < count; i++) {
+    sum += cached_mono_clock::now().time_since_epoch().count();
+  }
+  utime_t end = clock_now();
+  cached_clock::stop();
+  ASSERT_NE(0u, sum);
+  std::cout << "coarse_mono_clock "
+            << (double)(cached_start - start) * 1e9 / count
+            << ", cached_mono_clock "
+            << (double)(end - cached_start) * 1e9 / count
+            << " ns/call" << std::endl;
+}
+
+struct denc_varint_item_t {
+  uint64_t id = 0;
+  int64_t delta = 0;
+  uint64_t off = 0;
+  int64_t soff = 0;
+  uint64_t lba = 0;
+
+  DENC(denc_varint_item_t, v, p) {
+    DENC_START(1, 1, p);
+    denc_varint(v.id, p);
+    denc_signed_varint(v.delta, p);
+    denc_varint_lowz(v.off, p);
+    denc_signed_varint_lowz(v.soff, p);
+    denc_lba(v.lba, p);
+    DENC_FINISH(p);
+  }
+  bool operator==(const denc_varint_item_t& o) const {
+    return id == o.id && delta == o.delta && off == o.off &&
+           soff == o.soff && lba == o.lba;
+  }
+};
+WRITE_CLASS_DENC_BOUNDED(denc_varint_item_t)
+
+TEST(Denc, exact_size)
+{
+  const uint64_t values[] = {
+    0, 1, 0x7f, 0x80, 0x1000, 0x3fff, 0x4000, 0x10000, 0x123000,
+    0x7fffffff, 0x80000000, 0x100000000ull, 0xfff00000000ull,
+    0x7fffffffffffffffull, 0xffffffffffffffffull,
+  };
+  for (auto a : values) {
+    for (auto b : values) {
+      denc_varint_item_t item;
+      item.id = a;
+      // the signed and lowz encodings give up the top few bits
+      item.delta = (int64_t)(b >> 2) * ((a & 1) ? -1 : 1);
+      item.off = b >> 2;
+      item.soff = -(int64_t)(a >> 5);
+      item.lba = b;
+
+      buffer::list bl;
+      encode(item, bl);
+      ASSERT_EQ(encoded_sizeof_exact(item), bl.length());
+      ASSERT_LE(bl.length(), encoded_sizeof(item));
+
+      denc_varint_item_t out;
+      auto it = std::cbegin(bl);
+      decode(out, it);
+      ASSERT_EQ(item, out);
+    }
+  }
+
+  // bounded containers must not extrapolate from their first element
+  std::vector<denc_varint_item_t> v(100);
+  v.back().id = 0xffffffffffffffffull;
+  buffer::list bl;
+  encode(v, bl);
+  ASSERT_EQ(encoded_sizeof_exact(v), bl.length());
+
+  // only worst-case bounds ask for the exact pass
+  size_t len = 0;
+  _denc::bound_inexact = false;
+  denc(v, len);
+  ASSERT_TRUE(_denc::bound_inexact);
+  std::vector<uint64_t> fixed(100000);
+  std::map<std::string, uint32_t> names = {{"a", 1}, {"bcd", 2}};
+  _denc::bound_inexact = false;
+  denc(fixed, len);
+  denc(names, len);
+  ASSERT_FALSE(_denc::bound_inexact);
+}
+
+TEST(Denc, exact_size_performance)
+{
+  std::vector<denc_varint_item_t> v(200000);
+  for (size_t i = 0; i < v.size(); i++) {
+    v[i].id = i;
+    v[i].delta = (i & 1) ? -(int64_t)(i % 100) : (int64_t)(i % 100);
+    v[i].off = i << 12;
+    v[i].soff = (int64_t)i << 8;
+    v[i].lba = i << 12;
+  }
+
+  utime_t start = clock_now();
+  size_t bound = encoded_sizeof(v);
+  utime_t end = clock_now();
+  std::cout << "bound_encode = " << bound << " bytes in "
+            << (float)(end - start) * 1000000 << " us" << std::endl;
+
+  start = clock_now();
+  size_t exact = encoded_sizeof_exact(v);
+  end = clock_now();
+  std::cout << "exact bound_encode = " << exact << " bytes in "
+            << (float)(end - start) * 1000000 << " us" << std::endl;
+  std::cout << "saved " << (bound - exact) / 1024 << " KiB ("
+            << (float)bound / (float)exact << "x over-reserve)" << std::endl;
+
+  start = clock_now();
+  buffer::list bl;
+  encode(v, bl);
+  end = clock_now();
+  std::cout << "encode = " << (float)(end - start) * 1000000 << " us"
+            << std::endl;
+  ASSERT_EQ(exact, bl.length());
+  ASSERT_LT(exact, bound);
+  ASSERT_EQ(0u, bl.get_append_buffer_unused_tail_length());
+}
+
+struct denc_fixed_item_t {
+  uint64_t a = 0;
+  uint32_t b = 0;
+  uint16_t c = 0;
+  uint8_t d = 0;
+  std::string name;
+
+  DENC(denc_fixed_item_t, v, p) {
+    DENC_START(1, 1, p);
+    denc(v.a, p);
+    denc(v.b, p);
+    denc(v.c, p);
+    denc(v.d, p);
+    denc(v.name, p);
+    DENC_FINISH(p);
+  }
+  bool operator==(const denc_fixed_item_t& o) const {
+    return a == o.a && b == o.b && c == o.c && d == o.d && name == o.name;
+  }
+};
+WRITE_CLASS_DENC(denc_fixed_item_t)
+
+TEST(Denc, trusted_decode)
+{
+  std::vector<denc_fixed_item_t> v(100);
+  for (size_t i = 0; i < v.size(); i++) {
+    v[i].a = i << 40;
+    v[i].b = i << 20;
+    v[i].c = i;
+    v[i].d = i & 0xff;
+    v[i].name = stringify(i);
+  }
+  buffer::list bl;
+  encode(v, bl);
+
+  std::vector<denc_fixed_item_t> checked, trusted;
+  auto p = std::cbegin(bl);
+  decode(checked, p);
+  ASSERT_TRUE(p.end());
+  p = std::cbegin(bl);
+  decode(trusted, p, denc_trusted);
+  ASSERT_TRUE(p.end());
+  ASSERT_EQ(v, checked);
+  ASSERT_EQ(v, trusted);
+
+  // a struct_len running past the end is still caught
+  buffer::list one;
+  encode(v[1], one);
+  buffer::list truncated;
+  truncated.substr_of(one, 0, one.length() - 1);
+  denc_fixed_item_t out;
+  p = std::cbegin(truncated);
+  ASSERT_THROW(decode(out, p, denc_trusted), buffer::end_of_buffer);
+  p = std::cbegin(truncated);
+  ASSERT_THROW(decode(out, p), buffer::end_of_buffer);
+
+  // and so is a header cut short
+  buffer::list header;
+  header.substr_of(one, 0, 5);
+  p = std::cbegin(header);
+  ASSERT_THROW(decode(out, p, denc_trusted), buffer::end_of_buffer);
+}
+
+TEST(Denc, trusted_decode_performance)
+{
+  std::vector<denc_fixed_item_t> v(1000000);
+  for (size_t i = 0; i < v.size(); i++) {
+    v[i].a = i;
+    v[i].b = i;
+    v[i].name = "x";
+  }
+  buffer::list bl;
+  encode(v, bl);
+  bl.rebuild();
+
+  {
+    std::vector<denc_fixed_item_t> out;
+    utime_t start = clock_now();
+    auto p = std::cbegin(bl);
+    decode(out, p);
+    utime_t end = clock_now();
+    float rate = (float)bl.length() / (float)(1024*1024) / (float)(end - start);
+    std::cout << "checked decode = " << rate << " MB/sec" << std::endl;
+    ASSERT_EQ(v.size(), out.size());
+  }
+  {
+    std::vector<denc_fixed_item_t> out;
+    utime_t start = clock_now();
+    auto p = std::cbegin(bl);
+    decode(out, p, denc_trusted);
+    utime_t end = clock_now();
+    float rate = (float)bl.length() / (float)(1024*1024) / (float)(end - start);
+    std::cout << "trusted decode = " << rate << " MB/sec" << std::endl;
+    ASSERT_EQ(v, out);
+  }
+}
+
+struct denc_row_t {
+  uint64_t id = 0;
+  int32_t delta = 0;
+  uint32_t size = 0;
+  uint8_t flags = 0;
+
+  DENC(denc_row_t, v, p) {
+    DENC_START(1, 1, p);
+    denc(v.id, p);
+    denc(v.delta, p);
+    denc(v.size, p);
+    denc(v.flags, p);
+    DENC_FINISH(p);
+  }
+  bool operator==(const denc_row_t& o) const {
+    return id == o.id && delta == o.delta && size == o.size &&
+           flags == o.flags;
+  }
+};
+WRITE_CLASS_DENC_BOUNDED(denc_row_t)
+WRITE_CLASS_DENC_COLUMNS(denc_row_t, &denc_row_t::id, &denc_row_t::delta,
+                         &denc_row_t::size, &denc_row_t::flags)
+
+struct denc_row_prefix_t {
+  uint64_t id = 0;
+  int32_t delta = 0;
+};
+WRITE_CLASS_DENC_COLUMNS(denc_row_prefix_t, &denc_row_prefix_t::id,
+                         &denc_row_prefix_t::delta)
+
+static std::vector<denc_row_t> make_rows(size_t n)
+{
+  std::vector<denc_row_t> v(n);
+  for (size_t i = 0; i < n; i++) {
+    v[i].id = 1000000 + i * 3;
+    v[i].delta = (i & 1) ? -(int32_t)(i % 50) : (int32_t)(i % 50);
+    v[i].size = 0xffffff00u + (i & 0xff);
+    v[i].flags = i & 3;
+  }
+  return v;
+}
+
+TEST(Denc, columnar)
+{
+  auto v = make_rows(1000);
+  buffer::list bl;
+  encode_columnar(v, bl);
+  buffer::list rows;
+  encode(v, rows);
+  std::cout << "row " << rows.length() << " bytes, columnar "
+            << bl.length() << " bytes" << std::endl;
+  ASSERT_LT(bl.length(), rows.length());
+
+  std::vector<denc_row_t> out;
+  auto p = std::cbegin(bl);
+  decode_columnar(out, p);
+  ASSERT_TRUE(p.end());
+  ASSERT_EQ(v, out);
+
+  // only the id and flags columns
+  p = std::cbegin(bl);
+  decode_columnar(out, p, (1 << 0) | (1 << 3));
+  ASSERT_TRUE(p.end());
+  for (size_t i = 0; i < v.size(); i++) {
+    ASSERT_EQ(v[i].id, out[i].id);
+    ASSERT_EQ(0, out[i].delta);
+    ASSERT_EQ(0u, out[i].size);
+    ASSERT_EQ(v[i].flags, out[i].flags);
+  }
+
+  // a reader that knows fewer columns skips the rest
+  std::vector<denc_row_prefix_t> prefix;
+  p = std::cbegin(bl);
+  decode_columnar(prefix, p);
+  ASSERT_TRUE(p.end());
+  ASSERT_EQ(v.size(), prefix.size());
+  for (size_t i = 0; i < v.size(); i++) {
+    ASSERT_EQ(v[i].id, prefix[i].id);
+    ASSERT_EQ(v[i].delta, prefix[i].delta);
+  }
+
+  // and one that knows more leaves them default-initialized
+  buffer::list pbl;
+  encode_columnar(prefix, pbl);
+  p = std::cbegin(pbl);
+  decode_columnar(out, p);
+  ASSERT_EQ(v.size(), out.size());
+  ASSERT_EQ(v.back().id, out.back().id);
+  ASSERT_EQ(0u, out.back().size);
+
+  buffer::list truncated;
+  truncated.substr_of(bl, 0, bl.length() - 1);
+  p = std::cbegin(truncated);
+  ASSERT_THROW(decode_columnar(out, p), buffer::end_of_buffer);
+
+  // a count the columns can't hold is rejected before anything is sized
+  buffer::list bad;
+  encode((uint8_t)1, bad);
+  encode((uint8_t)1, bad);
+  encode((uint32_t)5, bad);
+  encode((uint32_t)0xffffffff, bad);
+  encode((uint8_t)0, bad);
+  p = std::cbegin(bad);
+  ASSERT_THROW(decode_columnar(out, p), buffer::malformed_input);
+}
+
+TEST(Denc, columnar_performance)
+{
+  auto v = make_rows(1000000);
+  buffer::list rows, columns;
+  encode(v, rows);
+  encode_columnar(v, columns);
+  std::cout << "row " << rows.length() << " bytes, columnar "
+            << columns.length() << " bytes" << std::endl;
+
+  std::vector<denc_row_t> out;
+  {
+    utime_t start = clock_now();
+    auto p = std::cbegin(rows);
+    decode(out, p);
+    utime_t end = clock_now();
+    std::cout << "row decode = " << (float)v.size() / (float)(end - start)
+              << " items/sec" << std::endl;
+  }
+  {
+    utime_t start = clock_now();
+    auto p = std::cbegin(columns);
+    decode_columnar(out, p);
+    utime_t end = clock_now();
+    std::cout << "columnar decode = " << (float)v.size() / (float)(end - start)
+              << " items/sec" << std::endl;
+    ASSERT_EQ(v, out);
+  }
+  {
+    utime_t start = clock_now();
+    auto p = std::cbegin(columns);
+    decode_columnar(out, p, 1 << 3);
+    utime_t end = clock_now();
+    std::cout << "columnar decode of one column = "
+              << (float)v.size() / (float)(end - start)
+              << " items/sec" << std::endl;
+  }
+}
+
+TEST(mempool, arena)
+{
+  ASSERT_EQ(0u, mempool::arena::allocated_bytes());
+  {
+    mempool::arena_t arena;
+    mempool::arena_vector<int> v(&arena);
+    for (int i = 0; i < 1000; i++) {
+      v.push_back(i);
+    }
+    EXPECT_GE(arena.used_bytes(), 1000 * sizeof(int));
+    EXPECT_EQ(arena.allocated_bytes(), mempool::arena::allocated_bytes());
+
+    size_t before = arena.used_bytes();
+    void *big = arena.allocate(3 << 20, 64);
+    EXPECT_EQ(0u, (uintptr_t)big % 64);
+    EXPECT_EQ(before + (3 << 20), arena.used_bytes());
+    EXPECT_GE(mempool::arena::allocated_bytes(), 3u << 20);
+
+    {
+      // nested scopes bind default-constructed allocators
+      mempool::arena_t::scope s(arena);
+      mempool::arena_string str("not a short string, so it allocates");
+      EXPECT_EQ(&arena, str.get_allocator().get_arena());
+    }
+    EXPECT_EQ(nullptr, mempool::arena_t::current());
+  }
+  EXPECT_EQ(0u, mempool::arena::allocated_bytes());
+
+  // without an arena the allocator falls back to the heap
+  {
+    mempool::arena_vector<int> v;
+    v.resize(100);
+    EXPECT_EQ(100 * sizeof(int), mempool::arena::allocated_bytes());
+  }
+  EXPECT_EQ(0u, mempool::arena::allocated_bytes());
+}
+
+TEST(mempool, slab)
+{
+  auto& pool = mempool::get_pool(mempool::unittest::id);
+  ASSERT_EQ(0u, mempool::unittest::allocated_items());
+  ASSERT_TRUE(pool.set_slab(mempool::unittest::id, true));
+  ASSERT_NE(nullptr, pool.get_slab());
+
+  for (size_t size : {1, 16, 17, 128, 129, 176, 177, 300, 512}) {
+    size_t c = mempool::slab_t::class_of(size);
+    ASSERT_LT(c, mempool::slab_t::num_classes);
+    ASSERT_GE(mempool::slab_t::class_size(c), size);
+    if (c > 0) {
+      ASSERT_LT(mempool::slab_t::class_size(c - 1), size);
+    }
+  }
+
+  {
+    mempool::unittest::map<int, int> m;
+    std::list<mempool::unittest::set<int>> sets;
+    for (int i = 0; i < 10000; i++) {
+      m[i] = i * 2;
+    }
+    // nodes allocated on one thread and freed on another
+    std::thread t([&m] {
+      for (int i = 0; i < 10000; i += 2) {
+        m.erase(i);
+      }
+    });
+    t.join();
+    for (int i = 0; i < 10000; i++) {
+      ASSERT_EQ(i % 2 == 0 ? 0u : 1u, m.count(i));
+    }
+    check_usage(mempool::unittest::id);
+
+    size_t chunk_bytes, out_bytes, requested_bytes;
+    pool.get_slab()->get_stats(&chunk_bytes, &out_bytes, &requested_bytes);
+    ASSERT_GT(chunk_bytes, 0u);
+    ASSERT_GE(chunk_bytes, out_bytes);
+
+    ostringstream ostr;
+    Formatter* f = Formatter::create("json-pretty", "json-pretty", "json-pretty");
+    mempool::dump(f);
+    f->flush(ostr);
+    delete f;
+    ASSERT_NE(ostr.str().find("\"slab\""), std::string::npos);
+    ASSERT_NE(ostr.str().find("fragmentation"), std::string::npos);
+
+    // can't switch allocators under live allocations
+    ASSERT_FALSE(pool.set_slab(mempool::unittest::id, false));
+  }
+  ASSERT_TRUE(pool.set_slab(mempool::unittest::id, false));
+  ASSERT_EQ(nullptr, pool.get_slab());
+}
+
+TEST(mempool, slab_performance)
+{
+  auto& pool = mempool::get_pool(mempool::unittest::id);
+  const int n = 200000;
+  for (bool slab : {false, true}) {
+    ASSERT_TRUE(pool.set_slab(mempool::unittest::id, slab));
+    utime_t start = clock_now();
+    {
+      mempool::unittest::map<int, int> m;
+      for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < n; i++) {
+          m[i] = i;
+        }
+        for (int i = 0; i < n; i += 2) {
+          m.erase(i);
+        }
+      }
+    }
+    utime_t end = clock_now();
+    std::cout << (slab ? "slab" : "heap") << " map insert/erase = "
+              << (float)n * 5 / (float)(end - start) << " ops/sec"
+              << std::endl;
+  }
+  ASSERT_TRUE(pool.set_slab(mempool::unittest::id, false));
+}
+
+static std::map<std::string, buffer::list> make_string_map(size_t n)
+{
+  std::map<std::string, buffer::list> m;
+  for (size_t i = 0; i < n; i++) {
+    buffer::list bl;
+    bl.append("value");
+    m["key_that_is_not_short_" + stringify(i)] = bl;
+  }
+  return m;
+}
+
+TEST(mempool, arena_decode)
+{
+  auto m = make_string_map(1000);
+  buffer::list bl;
+  encode(m, bl);
+
+  {
+    mempool::arena_t arena;
+    mempool::arena_map<mempool::arena_string, buffer::list> out;
+    auto p = std::cbegin(bl);
+    decode(out, p, arena);
+    ASSERT_TRUE(p.end());
+    ASSERT_EQ(&arena, out.get_allocator().get_arena());
+    ASSERT_EQ(m.size(), out.size());
+    auto i = m.begin();
+    for (auto& [k, v] : out) {
+      ASSERT_EQ(&arena, k.get_allocator().get_arena());
+      ASSERT_EQ(i->first, std::string(k.c_str()));
+      ASSERT_TRUE(i->second.contents_equal(v));
+      ++i;
+    }
+    ASSERT_GT(mempool::arena::allocated_bytes(), 0u);
+
+    ostringstream ostr;
+    Formatter* f = Formatter::create("json-pretty", "json-pretty", "json-pretty");
+    mempool::dump(f);
+    f->flush(ostr);
+    delete f;
+    ASSERT_NE(ostr.str().find("\"arena\""), std::string::npos);
+  }
+  ASSERT_EQ(0u, mempool::arena::allocated_bytes());
+}
+
+TEST(mempool, arena_decode_performance)
+{
+  auto m = make_string_map(200000);
+  buffer::list bl;
+  encode(m, bl);
+
+  {
+    utime_t start = clock_now();
+    {
+      std::map<std::string, buffer::list> out;
+      auto p = std::cbegin(bl);
+      decode(out, p);
+    }
+    utime_t end = clock_now();
+    std::cout << "heap decode + free = " << (float)(end - start) * 1000
+              << " ms" << std::endl;
+  }
+  {
+    utime_t start = clock_now();
+    {
+      mempool::arena_t arena;
+      mempool::arena_map<mempool::arena_string, buffer::list> out;
+      auto p = std::cbegin(bl);
+      decode(out, p, arena);
+    }
+    utime_t end = clock_now();
+    std::cout << "arena decode + release = " << (float)(end - start) * 1000
+              << " ms" << std::endl;
+  }
+}
+
+TEST(Encoding, cached_encoding)
+{
+  common::cached_encoding<std::map<std::string, uint64_t>> c;
+  c.mutate([](auto& m) {
+    m["a"] = 1;
+    m["b"] = 2;
+  });
+  ASSERT_FALSE(c.is_cached(0));
+
+  buffer::list a, b;
+  encode(c, a);
+  encode(c, b);
+  ASSERT_TRUE(c.is_cached(0));
+  ASSERT_TRUE(a.contents_equal(b));
+  // appended by reference: both lists share the cached raw
+  ASSERT_EQ(a.front().c_str(), b.front().c_str());
+
+  buffer::list plain;
+  encode(c.get(), plain);
+  ASSERT_TRUE(plain.contents_equal(a));
+
+  // feature bits select separate entries
+  buffer::list f;
+  encode(c, f, 1);
+  ASSERT_TRUE(c.is_cached(1));
+  ASSERT_NE(a.front().c_str(), f.front().c_str());
+
+  (*c.get_mutable())["c"] = 3;
+  ASSERT_FALSE(c.is_cached(0));
+  ASSERT_FALSE(c.is_cached(1));
+  buffer::list after;
+  encode(c, after);
+  ASSERT_FALSE(after.contents_equal(a));
+
+  // the earlier sends are unaffected
+  std::map<std::string, uint64_t> out;
+  auto p = std::cbegin(a);
+  decode(out, p);
+  ASSERT_EQ(2u, out.size());
+
+  common::cached_encoding<std::map<std::string, uint64_t>> d;
+  p = std::cbegin(after);
+  decode(d, p);
+  ASSERT_EQ(3u, d.get().size());
+
+  // an encode racing a change waits for it, and can't cache the old value
+  std::thread racer;
+  {
+    auto m = c.get_mutable();
+    racer = std::thread([&] {
+      buffer::list r;
+      encode(c, r);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    (*m)["d"] = 4;
+  }
+  racer.join();
+  buffer::list raced;
+  encode(c, raced);
+  out.clear();
+  p = std::cbegin(raced);
+  decode(out, p);
+  ASSERT_EQ(4u, out.size());
+}
+
+TEST(Encoding, cached_encoding_performance)
+{
+  std::map<std::string, uint64_t> m;
+  for (uint64_t i = 0; i < 10000; i++) {
+    m["osd." + stringify(i)] = i;
+  }
+  common::cached_encoding<std::map<std::string, uint64_t>> c(m);
+  const int peers = 200;
+
+  utime_t start = clock_now();
+  for (int i = 0; i < peers; i++) {
+    buffer::list bl;
+    encode(m, bl);
+  }
+  utime_t end = clock_now();
+  std::cout << "encode per peer = " << (float)peers / (float)(end - start)
+            << " sends/sec" << std::endl;
+
+  start = clock_now();
+  for (int i = 0; i < peers; i++) {
+    buffer::list bl;
+    encode(c, bl);
+  }
+  end = clock_now();
+  std::cout << "cached encoding = " << (float)peers / (float)(end - start)
+            << " sends/sec" << std::endl;
+}
+
 TEST(SafeIO, safe_read_file) {
   const char *fname = "safe_read_testfile";
   ::unlink(fname);